@@ -1,5 +1,7 @@
 #include <ncurses.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include "advuiel.h"
 
 void removeCharAt(char *str, int *length, int pos) {
@@ -34,47 +36,174 @@ void getPadDisplayDimensions(WINDOW *window, WINDOW *pad, int *padPosY, int *pad
 	*padSizeX = windowSizeX - 2;
 }
 
-void createOutputField(outputField *field, int height, int width, int y, int x) {
-	field->window = createNewWindow(height, width, y, x, TRUE);
-	field->pad = newpad(OUTPUT_BUFFER_SIZE, width - 2);
-	keypad(field->pad, TRUE);
+int createOutputField(outputField *field, int height, int width, int y, int x, size_t memorySize) {
+	if(memorySize < MIN_SCROLLBACK_SIZE)
+		memorySize = MIN_SCROLLBACK_SIZE;
+	/* The index gets the largest power of two number of records that fits in a third of the memory */
+	uint64_t recordCount = 1;
+	while(2 * recordCount * sizeof(outputRecord) <= memorySize / 3)
+		recordCount *= 2;
+	field->records = malloc(memorySize);
+	if(field->records == NULL)
+		return -1;
+	field->text = (char *)(field->records + recordCount);
+	field->textSize = memorySize - recordCount * sizeof(outputRecord);
+	field->textEnd = 0;
+	field->recordMask = recordCount - 1;
+	field->first = field->next = 0;
+	field->anchorRecord = 0;
+	field->anchorRow = 0;
 	field->scrollPosition = 0;
-	field->previousPadSize = 0;
+
+	field->window = createNewWindow(height, width, y, x, TRUE);
+	field->rows = height - 2;
+	field->columns = width - 2;
+	field->view = newwin(field->rows, field->columns, y + 1, x + 1);
+	return 0;
+}
+
+static outputRecord *getRecord(outputField *field, uint64_t record) {
+	return &field->records[record & field->recordMask];
+}
+
+/* Number of rows the record takes up on screen, an empty line still takes one */
+static int recordRows(outputField *field, uint64_t record) {
+	int length = getRecord(field, record)->length;
+	return (length == 0) ? 1 : (length + field->columns - 1) / field->columns;
+}
+
+/* Moves a position one row up (or down), returns 0 if it's already on the first (or last) row there is */
+static int rowUp(outputField *field, uint64_t *record, int *row) {
+	if(*row > 0)
+		(*row)--;
+	else if(*record > field->first)
+	{
+		(*record)--;
+		*row = recordRows(field, *record) - 1;
+	}
+	else
+		return 0;
+	return 1;
+}
+
+static int rowDown(outputField *field, uint64_t *record, int *row) {
+	if(*row < recordRows(field, *record) - 1)
+		(*row)++;
+	else if(*record + 1 < field->next)
+	{
+		(*record)++;
+		*row = 0;
+	}
+	else
+		return 0;
+	return 1;
+}
+
+/* The bottom of the view follows the newest row until it gets scrolled away from it */
+static void updateAnchor(outputField *field) {
+	if(field->scrollPosition == 0 && field->next > field->first)
+	{
+		field->anchorRecord = field->next - 1;
+		field->anchorRow = recordRows(field, field->anchorRecord) - 1;
+	}
+}
+
+/* Drops the oldest record, moving the anchor to the row after it if it was there */
+static void dropOldestRecord(outputField *field) {
+	if(field->scrollPosition != 0 && field->anchorRecord == field->first)
+	{
+		field->scrollPosition -= recordRows(field, field->first) - field->anchorRow;
+		field->anchorRecord++;
+		field->anchorRow = 0;
+		if(field->scrollPosition < 0 || field->anchorRecord == field->next)
+			field->scrollPosition = 0;
+	}
+	field->first++;
 }
 
+/*
+	Adds a line at the bottom. A line never wraps around the end of the text ring - if it doesn't fit in
+	what's left there, it starts over at the beginning.
+*/
+void printOutputField(outputField *field, const char *format, ...) {
+	char line[OUTPUT_LINE_SIZE];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if(length < 0)
+		return;
+	if(length >= (int)sizeof(line))
+		length = sizeof(line) - 1;
+
+	uint64_t offset = field->textEnd;
+	if(offset % field->textSize + length > field->textSize)
+		offset += field->textSize - offset % field->textSize;
+	uint64_t end = offset + length;
+	/* Every record that starts before the last textSize bytes up to the end of the new one gets written over */
+	while(field->next > field->first && (field->next - field->first > field->recordMask
+		|| (end > field->textSize && getRecord(field, field->first)->offset < end - field->textSize)))
+		dropOldestRecord(field);
+
+	memcpy(field->text + offset % field->textSize, line, length);
+	outputRecord *record = getRecord(field, field->next);
+	record->offset = offset;
+	record->length = length;
+	field->next++;
+	field->textEnd = end;
+	if(field->scrollPosition != 0)
+		field->scrollPosition += recordRows(field, field->next - 1);
+}
+
+/* Draws the rows that fit in the view, ending with the anchor */
 void refreshOutputField(outputField *field) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	prefresh(field->pad, padRows - padSizeY - field->scrollPosition, 0, padPosY, padPosX, padPosY + padSizeY - 1, padPosX + padSizeX - 1);
+	werase(field->view);
+	updateAnchor(field);
+	if(field->next > field->first)
+	{
+		uint64_t record = field->anchorRecord;
+		int row = field->anchorRow, rows = 1;
+		while(rows < field->rows && rowUp(field, &record, &row))
+			rows++;
+		for(int y = 0; y < rows; y++)
+		{
+			outputRecord *r = getRecord(field, record);
+			int start = row * field->columns;
+			int length = (r->length - start < field->columns) ? r->length - start : field->columns;
+			mvwaddnstr(field->view, y, 0, field->text + r->offset % field->textSize + start, length);
+			rowDown(field, &record, &row);
+		}
+	}
+	wnoutrefresh(field->view);
 }
 
 void triggerOutputFieldEvent(outputField *field, int c) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	if(field->scrollPosition != 0)
-		(field->scrollPosition) += padRows - field->previousPadSize;
+	updateAnchor(field);
 	switch(c)
 	{
+		/* Only if there's something above the top row */
 		case KEY_UP:
-			if(padRows - field->scrollPosition > padSizeY)
+		{
+			uint64_t record = field->anchorRecord;
+			int row = field->anchorRow, rows = 1;
+			while(rows < field->rows && rowUp(field, &record, &row))
+				rows++;
+			if(rows == field->rows && rowUp(field, &record, &row) && rowUp(field, &field->anchorRecord, &field->anchorRow))
 				field->scrollPosition++;
 			break;
+		}
 		case KEY_DOWN:
 			if(field->scrollPosition > 0)
-				field->scrollPosition--;
+				field->scrollPosition = rowDown(field, &field->anchorRecord, &field->anchorRow) ? field->scrollPosition - 1 : 0;
 			break;
 	}
-	field->previousPadSize = padRows;
 	refreshOutputField(field);
 }
 
 void deleteOutputField(outputField *field) {
 	delwin(field->window);
-	delwin(field->pad);
+	delwin(field->view);
+	free(field->records);
 }
 
 void createInputField(inputField *field, int width, int y, int x) {
@@ -87,7 +216,7 @@ void createInputField(inputField *field, int width, int y, int x) {
 void refreshInputField(inputField *field) {
 	int padPosY, padPosX, padSizeY, padSizeX;
 	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	prefresh(field->pad, 0, field->lineBuffer.position - padSizeX + 1, padPosY, padPosX, padPosY, padPosX + padSizeX - 1);
+	pnoutrefresh(field->pad, 0, field->lineBuffer.position - padSizeX + 1, padPosY, padPosX, padPosY, padPosX + padSizeX - 1);
 }
 
 void triggerInputFieldEvent(inputField *field, int c) {
@@ -147,146 +276,155 @@ void deleteInputField(inputField *field) {
 	delwin(field->pad);
 }
 
-void createListField(listField *field, int height, int width, int y, int x) {
+int createListField(listField *field, int height, int width, int y, int x) {
+	if(initRoster(&field->roster) == -1)
+		return -1;
 	field->window = createNewWindow(height, width, y, x, TRUE);
-	int maxPadRows = LIST_ITEM_SIZE / (width - 2) * MAX_LIST_ITEMS;
-	field->pad = newpad(maxPadRows, width - 2);
-	keypad(field->pad, TRUE);
-	field->listBuffer.position = field->listBuffer.length = 0;
-	field->scrollPosition = 0;
+	field->rows = height - 2;
+	field->columns = width - 2;
+	field->view = newwin(field->rows, field->columns, y + 1, x + 1);
+	field->top = field->position = 0;
+	field->focused = 0;
+	field->changed = 0;
+	return 0;
 }
 
-void refreshListField(listField *field) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	prefresh(field->pad, padRows - padSizeY + 1, 0, padPosY, padPosX, padPosY + padSizeY - 1, padPosX + padSizeX - 1);
+/* Long names wrap onto as many rows as they need */
+static int itemRows(listField *field, int index) {
+	int length = strlen(rosterNameAt(&field->roster, index));
+	return (length == 0) ? 1 : (length + field->columns - 1) / field->columns;
 }
 
-void addListFieldItem(listField *field, char *item) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	strcpy(field->listBuffer.items[field->listBuffer.length], item);
-	field->listBuffer.length++;
-	int itemRowPosition = 0;
-	for(int i = 0; i < field->listBuffer.length - 1; i++)
+/* Scrolls just far enough for the selected item to be in view */
+static void showPosition(listField *field) {
+	if(field->position < field->top)
+		field->top = field->position;
+	while(field->top < field->position)
 	{
-		int itemStrLen = strlen(field->listBuffer.items[i]);
-		itemRowPosition += itemStrLen / padSizeX + 1;
+		int rows = 0;
+		for(int i = field->top; i <= field->position && rows <= field->rows; i++)
+			rows += itemRows(field, i);
+		if(rows <= field->rows)
+			break;
+		field->top++;
 	}
-	wmove(field->pad, itemRowPosition, 0);
-	wprintw(field->pad, "%s\n", item);
-	wmove(field->pad, padRows, 0);
-	refreshListField(field);
 }
 
-void removeListFieldItem(listField *field, char *item) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	int searchedStrLen = strlen(item);
-	int itemRowPosition = 0;
-	for(int i = 0; i < field->listBuffer.length; i++)
+/* Draws the items from the top of the view down until it's full, nothing else gets looked at */
+void refreshListField(listField *field) {
+	werase(field->view);
+	int y = 0;
+	for(int i = field->top; i < field->roster.length && y < field->rows; i++)
 	{
-		int itemStrLen = strlen(field->listBuffer.items[i]);
-		if(itemStrLen == searchedStrLen && strcmp(item, field->listBuffer.items[i]) == 0)
+		char *name = rosterNameAt(&field->roster, i);
+		int rows = itemRows(field, i);
+		for(int row = 0; row < rows && y + row < field->rows; row++)
 		{
-			for(int j = i; j < field->listBuffer.length - 1; j++)
-				strcpy(field->listBuffer.items[j], field->listBuffer.items[j + 1]);
-			field->listBuffer.length--;
-			wmove(field->pad, itemRowPosition, 0);
-			wclrtobot(field->pad);
-			for(int j = i; j < field->listBuffer.length; j++)
-				wprintw(field->pad, "%s\n", field->listBuffer.items[j]);
-			break;
+			mvwaddnstr(field->view, y + row, 0, name + row * field->columns, field->columns);
+			if(field->focused && i == field->position)
+				mvwchgat(field->view, y + row, 0, -1, A_REVERSE, 0, NULL);
 		}
-		else
-			itemRowPosition += itemStrLen / padSizeX + 1;
+		y += rows;
 	}
-	wmove(field->pad, padRows, 0);
-	refreshListField(field);
+	field->changed = 0;
+	wnoutrefresh(field->view);
+}
+
+/*
+	Adding and removing only touch the roster and mark the field as changed, whoever draws the screen
+	refreshes it once however many names came and went. Items that move in front of the view or the
+	selection shift them along, so neither jumps to a different name.
+*/
+void addListFieldItem(listField *field, char *item) {
+	int position = addRosterName(&field->roster, item);
+	if(position < 0)
+		return;
+	if(field->roster.length > 1 && position <= field->position)
+		field->position++;
+	if(field->roster.length > 1 && position < field->top)
+		field->top++;
+	field->changed = 1;
 }
 
+/* For a whole batch of names, the selection and the view's top stay on the same name (and the same copy of it) */
+void addListFieldItems(listField *field, char **items, int length) {
+	int anchors[2] = {field->position, field->top}, copies[2];
+	char *names[2];
+	for(int i = 0; i < 2; i++)
+	{
+		names[i] = rosterNameAt(&field->roster, anchors[i]);
+		if(names[i] != NULL)
+			copies[i] = anchors[i] - findRosterName(&field->roster, names[i]);
+	}
+	if(addRosterNames(&field->roster, items, length) <= 0)
+		return;
+	if(names[0] != NULL)
+		field->position = findRosterName(&field->roster, names[0]) + copies[0];
+	if(names[1] != NULL)
+		field->top = findRosterName(&field->roster, names[1]) + copies[1];
+	field->changed = 1;
+}
+
+void removeListFieldItem(listField *field, char *item) {
+	int position = removeRosterName(&field->roster, item);
+	if(position < 0)
+		return;
+	if(position < field->position || (field->position > 0 && field->position == field->roster.length))
+		field->position--;
+	if(position < field->top || (field->top > 0 && field->top == field->roster.length))
+		field->top--;
+	field->changed = 1;
+}
+
+/* The new name goes wherever it sorts, the selection goes with it if it was on the old one */
 void replaceListFieldItem(listField *field, char *itemOld, char *itemNew) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int padRows, padColumns;
-	getyx(field->pad, padRows, padColumns);
-	int searchedStrLen = strlen(itemOld);
-	int itemRowPosition = 0;
-	for(int i = 0; i < field->listBuffer.length; i++)
+	if(findRosterName(&field->roster, itemOld) == -1)
+		return;
+	/* Any copy of the old name counts, they all look the same */
+	char *current = rosterNameAt(&field->roster, field->position);
+	int selected = (current != NULL && strcmp(current, itemOld) == 0);
+	removeListFieldItem(field, itemOld);
+	addListFieldItem(field, itemNew);
+	if(selected)
 	{
-		int itemStrLen = strlen(field->listBuffer.items[i]);
-		if(itemStrLen == searchedStrLen && strcmp(itemOld, field->listBuffer.items[i]) == 0)
-		{
-			strcpy(field->listBuffer.items[i], itemNew);
-			wmove(field->pad, itemRowPosition, 0);
-			wclrtobot(field->pad);
-			for(int j = i; j < field->listBuffer.length; j++)
-				wprintw(field->pad, "%s\n", field->listBuffer.items[j]);
-			break;
-		}
-		else
-			itemRowPosition += itemStrLen / padSizeX + 1;
+		int position = findRosterName(&field->roster, itemNew);
+		if(position != -1)
+			field->position = position;
+		showPosition(field);
 	}
-	wmove(field->pad, padRows, 0);
-	refreshListField(field);
 }
 
 void focusListField(listField *field) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int itemRowLength = strlen(field->listBuffer.items[field->listBuffer.position]) / padSizeX + 1;
-	for(int i = 0; i < itemRowLength; i++)
-		mvwchgat(field->pad, field->scrollPosition + i, 0, -1, A_REVERSE, 0, NULL);
+	field->focused = 1;
+	showPosition(field);
 	refreshListField(field);
 }
 
 void unfocusListField(listField *field) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int itemRowLength = strlen(field->listBuffer.items[field->listBuffer.position]) / padSizeX + 1;
-	for(int i = 0; i < itemRowLength; i++)
-		mvwchgat(field->pad, field->scrollPosition + i, 0, -1, 0, 0, NULL);
+	field->focused = 0;
 	refreshListField(field);
 }
 
 void triggerListFieldEvent(listField *field, int c) {
-	int padPosY, padPosX, padSizeY, padSizeX;
-	getPadDisplayDimensions(field->window, field->pad, &padPosY, &padPosX, &padSizeY, &padSizeX);
-	int itemRowLength;
 	switch(c)
 	{
 		case KEY_UP:
-			if(field->listBuffer.position > 0)
-			{
-				unfocusListField(field);
-				itemRowLength = strlen(field->listBuffer.items[field->listBuffer.position - 1]) / padSizeX + 1;
-				field->scrollPosition = field->scrollPosition - itemRowLength;
-				field->listBuffer.position--;
-				focusListField(field);
-			}
+			if(field->position > 0)
+				field->position--;
 			break;
 		case KEY_DOWN:
-			if(field->listBuffer.position < field->listBuffer.length - 1)
-			{
-				unfocusListField(field);
-				itemRowLength = strlen(field->listBuffer.items[field->listBuffer.position]) / padSizeX + 1;
-				field->scrollPosition = field->scrollPosition + itemRowLength;
-				field->listBuffer.position++;
-				focusListField(field);
-			}
+			if(field->position < field->roster.length - 1)
+				field->position++;
 			break;
 	}
+	showPosition(field);
+	refreshListField(field);
 }
 
 void deleteListField(listField *field) {
 	delwin(field->window);
-	delwin(field->pad);
+	delwin(field->view);
+	freeRoster(&field->roster);
 }
 
 void createButton(button *btn, char *labelText, int y, int x) {
@@ -297,16 +435,14 @@ void createButton(button *btn, char *labelText, int y, int x) {
 }
 
 void focusButton(button *btn) {
-	int windowSizeY, windowSizeX;
-	getmaxyx(btn->window, windowSizeY, windowSizeX);
+	int windowSizeX = getmaxx(btn->window);
 	curs_set(0);
 	mvwchgat(btn->window, 1, 1, windowSizeX - 2, A_REVERSE, 0, NULL);
 	wrefresh(btn->window);
 }
 
 void unfocusButton(button *btn) {
-	int windowSizeY, windowSizeX;
-	getmaxyx(btn->window, windowSizeY, windowSizeX);
+	int windowSizeX = getmaxx(btn->window);
 	curs_set(1);
 	mvwchgat(btn->window, 1, 1, windowSizeX - 2, 0, 0, NULL);
 	wrefresh(btn->window);
@@ -3,29 +3,64 @@
 
 #include <ncurses.h>
 #include <string.h>
+#include <stdint.h>
 
-#define OUTPUT_BUFFER_SIZE 1024
+#include "roster.h"
+
+#define OUTPUT_LINE_SIZE 2048
+#define MIN_SCROLLBACK_SIZE (64 * 1024)
 #define LINE_BUFFER_SIZE 1024
-#define MAX_LIST_ITEMS 256
-#define LIST_ITEM_SIZE 64
 
 /* utility */
 void removeCharAt(char *str, int *length, int pos);
 void insertCharAt(char *str, int *length, int pos, char c);
 
+/*
+	The field refresh functions only stage their changes on the virtual screen (pnoutrefresh), nothing
+	reaches the terminal until doupdate, so any number of updates can go out as one frame. The cursor ends
+	up wherever the field staged last left it.
+*/
+
 /* ui - general */
 WINDOW *createNewWindow(int height, int width, int y, int x, bool borders);
 void getPadDisplayDimensions(WINDOW *window, WINDOW *pad, int *padPosY, int *padPosX, int *padSizeY, int *padSizeX);
 
-/* ui - scrollable output */
+/*
+	ui - scrollable output
+	The lines live in a ring buffer of records instead of a pad, all of it in one allocation of the size
+	given when the field is created - the text goes into a byte ring, and an index of where every record
+	starts takes up to a third of it. Whatever doesn't fit anymore gets dropped from the oldest end, so a
+	session can run for days without the client growing.
+
+	Only the rows that are on screen ever get drawn. The view is anchored to the record (and the row of
+	it, for lines that wrap) at its bottom, which stays put while new lines come in unless the view is at
+	the bottom (scrollPosition 0, counted in rows above the newest one), so scrolling and drawing both
+	take time in proportion to the height of the window, however long the scrollback is.
+*/
+typedef struct {
+	uint64_t offset;
+	int length;
+} outputRecord;
+
 typedef struct {
 	WINDOW *window;
-	WINDOW *pad;
+	WINDOW *view;
+	int rows;
+	int columns;
+	char *text;
+	uint64_t textSize;
+	uint64_t textEnd;
+	outputRecord *records;
+	uint64_t recordMask;
+	uint64_t first;
+	uint64_t next;
+	uint64_t anchorRecord;
+	int anchorRow;
 	int scrollPosition;
-	int previousPadSize;
 } outputField;
 
-void createOutputField(outputField *field, int height, int width, int y, int x);
+int createOutputField(outputField *field, int height, int width, int y, int x, size_t memorySize);
+void printOutputField(outputField *field, const char *format, ...);
 void refreshOutputField(outputField *field);
 void triggerOutputFieldEvent(outputField *field, int c);
 void deleteOutputField(outputField *field);
@@ -48,23 +83,28 @@ void refreshInputField(inputField *field);
 void triggerInputFieldEvent(inputField *field, int c);
 void deleteInputField(inputField *field);
 
-/* ui - scrollable list */
-typedef struct {
-	int position;
-	int length;
-	char items[MAX_LIST_ITEMS][LIST_ITEM_SIZE];
-} listBuffer;
-
+/*
+	ui - scrollable list
+	The items are kept sorted in a roster (see roster.h), so a name comes or goes in O(log n) however
+	many there are, and only the items in view get looked at when the list is drawn. top is the first
+	item in view and position the selected one, the selection is only shown while the list has focus.
+*/
 typedef struct {
 	WINDOW *window;
-	WINDOW *pad;
-	listBuffer listBuffer;
-	int scrollPosition;
+	WINDOW *view;
+	roster roster;
+	int rows;
+	int columns;
+	int top;
+	int position;
+	int focused;
+	int changed;
 } listField;
 
-void createListField(listField *field, int height, int width, int y, int x);
+int createListField(listField *field, int height, int width, int y, int x);
 void refreshListField(listField *field);
 void addListFieldItem(listField *field, char *item);
+void addListFieldItems(listField *field, char **items, int length);
 void removeListFieldItem(listField *field, char *item);
 void replaceListFieldItem(listField *field, char *itemOld, char *itemNew);
 void focusListField(listField *field);
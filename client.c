@@ -13,9 +13,13 @@
 #include <string.h>
 #include <ncurses.h>
 #include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 #include "socketcom.h"
 #include "advuiel.h"
+#include "spscqueue.h"
 
 #define checkError(expression, errorMessage)\
 do\
@@ -37,8 +41,48 @@ do\
 #define CHAT_WINDOW 1
 #define CLIENT_LIST 2
 
+/* Screen updates are capped at this many per second by default, 0 means as often as something changes */
+#define DEFAULT_FPS 60
+
+/* Memory the chat window's scrollback gets by default, the oldest lines make way for new ones past that */
+#define DEFAULT_SCROLLBACK_SIZE (4 * 1024 * 1024)
+
+/* Decoded messages the network thread can get ahead of the UI by, and how many the UI takes per wakeup */
+#define NETWORK_QUEUE_SIZE 512
+#define MAX_DRAIN 256
+
 int activeWindow = INPUT_FIELD;
 char nick[MAX_NAME_SIZE] = "CLIENT";
+int protocolVersion = PROTOCOL_V1;
+
+/* The channel that whatever isn't a command goes to, everyone on the server if it's empty */
+char channel[MAX_NAME_SIZE] = "";
+
+/* Set when something got printed to the chat window since the last frame */
+int chatChanged = 0;
+
+/*
+	The network thread reads everything that comes in on the socket, decodes it straight into the slots of
+	a lock-free queue and pokes the UI thread's wakeup eventfd - only the first message since the UI's last
+	drain pays for the write. That way a flood of traffic can't hold keys up, and a slow terminal can't hold
+	up reading the socket until its buffer fills. When the queue is full the network thread stops reading
+	and sleeps on the space eventfd, which the UI pokes once it has taken messages out. The UI thread still
+	does all the sending.
+
+	If the connection fails, the thread stores what went wrong, wakes the UI up for the last time and quits.
+*/
+typedef struct {
+	int socketFD;
+	int wakeupFD;
+	int spaceFD;
+	spscQueue queue;
+	atomic_int wakeupPending;
+	atomic_int waitingForSpace;
+	atomic_int stopped;
+	int error;
+	char *failure;
+	pthread_t thread;
+} networkThread;
 
 typedef struct {
 	char *commandStr;
@@ -47,27 +91,72 @@ typedef struct {
 
 int changeNick(char *args, int socketFD);
 int sendPrivate(char *args, int socketFD);
+int joinChannel(char *args, int socketFD);
+int partChannel(char *args, int socketFD);
+int listChannels(char *args, int socketFD);
 
 command commands[] =
 {
 	{"/nick", changeNick},
 	{"/msg", sendPrivate},
+	{"/join", joinChannel},
+	{"/part", partChannel},
+	{"/list", listChannels},
 };
 
 int numOfCommands = sizeof(commands) / sizeof(command);
 int getCommandPosition(char *command);
 int isCommand(char *buffer);
 int runCommand(char *buffer, int socketFD);
+int sendChat(char *buffer, int socketFD);
 
 void printTimestamped(outputField *chatWindow, message *msg);
+int untilNextFrame(struct timespec *lastFrame, long frameInterval);
+int startNetworkThread(networkThread *network, int socketFD);
+void *runNetworkThread(void *arg);
+int drainNetwork(networkThread *network, outputField *chatWindow, listField *clientList);
+void handleMessage(message *msg, outputField *chatWindow, listField *clientList);
+void drawFrame(outputField *chatWindow, listField *clientList, inputField *chatInput, struct timespec *lastFrame);
 
 int main(int argc, char *argv[]) {
+	int framesPerSecond = DEFAULT_FPS;
+	size_t scrollbackSize = DEFAULT_SCROLLBACK_SIZE;
+	struct option options[] =
+	{
+		{"fps", required_argument, NULL, 'f'},
+		{"scrollback", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+	int option;
+	while((option = getopt_long(argc, argv, "f:s:", options, NULL)) != -1)
+	{
+		switch(option)
+		{
+			case 'f':
+				framesPerSecond = atoi(optarg);
+				break;
+			case 's':
+				scrollbackSize = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [--fps N] [--scrollback BYTES]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if(framesPerSecond < 0)
+	{
+		fprintf(stderr, "The frame rate can't be negative\n");
+		exit(EXIT_FAILURE);
+	}
+	long frameInterval = (framesPerSecond > 0) ? 1000000000L / framesPerSecond : 0;
 
 	/* Screen init */
 	initscr();
 	refresh();
 	noecho();
 	keypad(stdscr, TRUE);
+	/* Otherwise doupdate checks for typeahead by reading keys off stdin, where poll would never see them */
+	typeahead(-1);
 	int terminalRows, terminalColumns;
 	getmaxyx(stdscr, terminalRows, terminalColumns);
 	int c;
@@ -99,6 +188,7 @@ int main(int argc, char *argv[]) {
 	activeWindow = ADDRESS_FIELD;
 	while(waitingForInfo)
 	{
+		doupdate();
 		c = getch();
 		switch(activeWindow)
 		{
@@ -164,140 +254,116 @@ int main(int argc, char *argv[]) {
 
 	/* Drawing chat UI */
 	outputField chat;
-	createOutputField(&chat, terminalRows - 3, terminalColumns - 18, 0, 0);
+	checkError(createOutputField(&chat, terminalRows - 3, terminalColumns - 18, 0, 0, scrollbackSize) == -1, "createOutputField");
 
 	inputField chatInput;
 	createInputField(&chatInput, terminalColumns, terminalRows - 3, 0);
 
 	listField clientList;
-	createListField(&clientList, terminalRows - 3, 18, 0, terminalColumns - 18);
+	checkError(createListField(&clientList, terminalRows - 3, 18, 0, terminalColumns - 18) == -1, "createListField");
 
 	/* Initializing connection */
 	int socketFD = connectToServer(serverAddressStr, portNumberStr);
 	checkError(socketFD == -1, "connectToServer");
 
+	/* Starting the network thread, which reads and decodes everything the server sends */
+	networkThread network;
+	checkError(startNetworkThread(&network, socketFD) == -1, "startNetworkThread");
+
 	/* Initializing polling structures */
 	struct pollfd monitors[2];
 	memset(monitors, 0, sizeof(monitors));
 	monitors[0].fd = STDIN_FILENO;
 	monitors[0].events = POLLIN;
-	monitors[1].fd = socketFD;
+	monitors[1].fd = network.wakeupFD;
 	monitors[1].events = POLLIN;
 
-	/* Setting user input to be non-blocking */
+	/* Setting user input to be non-blocking, keys are read through the pad so reading doesn't refresh stdscr */
 	nodelay(chatInput.pad, TRUE);
 
 	/* Setup complete - sending initial connection message to server */
-	checkError(sendMessageStream(socketFD, REQ_M | CON_F, nick, NULL) == -1, "sendMessageStream");
+	checkError(sendMessageStream(socketFD, protocolVersion, REQ_M | CON_F, nick, LATEST_PROTOCOL_STR) == -1, "sendMessageStream");
 
-	/* Polling for activity on either stdin or the socket */
+	/* Polling for activity on either stdin or the network thread */
 	activeWindow = INPUT_FIELD;
+	struct timespec lastFrame = {0, 0};
+	int screenChanged = 1, backlog = 0;
 	while(1)
 	{
-		checkError(poll(monitors, 2, -1) == -1, "poll");
+		/* Nothing's waiting to be drawn, or it's waiting for the next frame - unless there are messages left over */
+		int timeout = (screenChanged) ? untilNextFrame(&lastFrame, frameInterval) : -1;
+		if(backlog)
+			timeout = 0;
+		checkError(poll(monitors, 2, timeout) == -1, "poll");
 
-		/* Activity on stdin */
+		/* Activity on stdin - every key that's there gets handled before drawing */
 		if(monitors[0].revents & POLLIN)
 		{
-			c = getch();
-			switch(activeWindow)
-			{
-				case INPUT_FIELD:
-					switch(c)
-					{
-						case KEY_UP:
-							activeWindow = CHAT_WINDOW;
-							break;
-						case KEY_DOWN:
-							if(chat.scrollPosition != 0)
-								activeWindow = CHAT_WINDOW;
-							break;
-					}
-					break;
-				case CHAT_WINDOW:
-					triggerOutputFieldEvent(&chat, c);
-					switch(c)
-					{
-						case KEY_DOWN:
-							if(chat.scrollPosition == 0)
-								activeWindow = INPUT_FIELD;
-							break;
-						case KEY_RIGHT:
-							focusListField(&clientList);
-							activeWindow = CLIENT_LIST;
-							break;
-					}
-					break;
-				case CLIENT_LIST:
-					triggerListFieldEvent(&clientList, c);
-					switch(c)
-					{
-						case KEY_LEFT:
-							unfocusListField(&clientList);
-							activeWindow = CHAT_WINDOW;
-							break;
-					}
-					break;
-			}
-			triggerInputFieldEvent(&chatInput, c);
-			if(c == '\n' || c == KEY_ENTER)
-			{
-				if(isCommand(chatInput.lineBuffer.buffer))
-					runCommand(chatInput.lineBuffer.buffer, socketFD);
-				else
-					checkError(sendMessageStream(socketFD, REQ_M | REG_F, nick, chatInput.lineBuffer.buffer) == -1, "sendMessageStream");
-			}
-			refreshInputField(&chatInput);
-		}
-
-		/* Activity on socket */
-		if(monitors[1].revents & POLLIN)
-		{
-			char buffer[TOTAL_BUFFER_SIZE];
-			int received;
-			checkError((received = receiveMessageStream(socketFD, buffer)) == -1, "receiveMessage");
-			checkError(received == 0, "Server closed connection");
-			message msg = deserialize_struct_message(buffer);
-
-			/* Handling response messages from server */
-			if((msg.type & MASK_M) == RES_M)
+			while((c = wgetch(chatInput.pad)) != ERR)
 			{
-				switch(msg.type & MASK_F)
+				switch(activeWindow)
 				{
-					case PRV_F:
-						if((msg.type & MASK_S) == SCS_S)
-							printTimestamped(&chat, &msg);
+					case INPUT_FIELD:
+						switch(c)
+						{
+							case KEY_UP:
+								activeWindow = CHAT_WINDOW;
+								break;
+							case KEY_DOWN:
+								if(chat.scrollPosition != 0)
+									activeWindow = CHAT_WINDOW;
+								break;
+						}
 						break;
-					case NIC_F:
-						if((msg.type & MASK_S) == SCS_S)
-							checkError(readArgs(msg.payload, nick, NULL) == -1, "readArgs");
+					case CHAT_WINDOW:
+						triggerOutputFieldEvent(&chat, c);
+						switch(c)
+						{
+							case KEY_DOWN:
+								if(chat.scrollPosition == 0)
+									activeWindow = INPUT_FIELD;
+								break;
+							case KEY_RIGHT:
+								focusListField(&clientList);
+								activeWindow = CLIENT_LIST;
+								break;
+						}
+						break;
+					case CLIENT_LIST:
+						triggerListFieldEvent(&clientList, c);
+						switch(c)
+						{
+							case KEY_LEFT:
+								unfocusListField(&clientList);
+								activeWindow = CHAT_WINDOW;
+								break;
+						}
 						break;
 				}
-			}
-			/* Handling signal messages from server */
-			else if((msg.type & MASK_M) == SIG_M)
-			{
-				switch(msg.type & MASK_F)
+				triggerInputFieldEvent(&chatInput, c);
+				if(c == '\n' || c == KEY_ENTER)
 				{
-					case REG_F:
-						printTimestamped(&chat, &msg);
-						break;
-					case PRV_F:
-						printTimestamped(&chat, &msg);
-						break;
-					case CON_F:
-						addListFieldItem(&clientList, msg.name);
-						break;
-					case DIS_F:
-						removeListFieldItem(&clientList, msg.name);
-						break;
-					case NIC_F:
-						replaceListFieldItem(&clientList, msg.name, msg.payload);
-						break;
+					if(isCommand(chatInput.lineBuffer.buffer))
+						runCommand(chatInput.lineBuffer.buffer, socketFD);
+					else
+						checkError(sendChat(chatInput.lineBuffer.buffer, socketFD) == -1, "sendMessageStream");
 				}
 			}
-			/* Making sure the cursor is back on the input field after updating other elements */
-			refreshInputField(&chatInput);
+			screenChanged = 1;
+		}
+
+		/* Messages from the network thread - a flood of them still leaves room for the keys in between */
+		if((monitors[1].revents & POLLIN) || backlog)
+		{
+			backlog = drainNetwork(&network, &chat, &clientList);
+			screenChanged = 1;
+		}
+
+		/* One frame for everything that happened since the last one */
+		if(screenChanged && untilNextFrame(&lastFrame, frameInterval) == 0)
+		{
+			drawFrame(&chat, &clientList, &chatInput, &lastFrame);
+			screenChanged = 0;
 		}
 	}
 
@@ -310,16 +376,54 @@ int changeNick(char *args, int socketFD) {
 	char newNick[MAX_NAME_SIZE];
 	if(readArgs(args, newNick, NULL) == -1)
 		return -1;
-	if(sendMessageStream(socketFD, REQ_M | NIC_F, nick, newNick) == -1)
+	if(sendMessageStream(socketFD, protocolVersion, REQ_M | NIC_F, nick, newNick) == -1)
 		return -1;
 	return 0;
 }
 
 int sendPrivate(char *args, int socketFD) {
-	sendMessageStream(socketFD, REQ_M | PRV_F, nick, args);
+	sendMessageStream(socketFD, protocolVersion, REQ_M | PRV_F, nick, args);
+	return 0;
+}
+
+int joinChannel(char *args, int socketFD) {
+	char name[MAX_NAME_SIZE];
+	if(readArgs(args, name, NULL) == -1)
+		return -1;
+	if(sendMessageStream(socketFD, protocolVersion, REQ_M | JOI_F, nick, name) == -1)
+		return -1;
 	return 0;
 }
 
+/* Without a channel, it's the current one that gets parted */
+int partChannel(char *args, int socketFD) {
+	char name[MAX_NAME_SIZE];
+	if(readArgs(args, name, NULL) == -1)
+		strcpy(name, channel);
+	if(name[0] == '\0')
+		return -1;
+	if(sendMessageStream(socketFD, protocolVersion, REQ_M | PRT_F, nick, name) == -1)
+		return -1;
+	return 0;
+}
+
+int listChannels(char *args, int socketFD) {
+	/* /list takes no arguments, anything after it is ignored */
+	(void)args;
+	if(sendMessageStream(socketFD, protocolVersion, REQ_M | LST_F, nick, NULL) == -1)
+		return -1;
+	return 0;
+}
+
+/* Channel messages carry the channel in front of the message */
+int sendChat(char *buffer, int socketFD) {
+	if(channel[0] == '\0')
+		return sendMessageStream(socketFD, protocolVersion, REQ_M | REG_F, nick, buffer);
+	char payload[MAX_PAYLOAD_SIZE];
+	snprintf(payload, sizeof(payload), "%s %s", channel, buffer);
+	return sendMessageStream(socketFD, protocolVersion, REQ_M | CHN_F, nick, payload);
+}
+
 int getCommandPosition(char *command) {
 	for(int i = 0; i < numOfCommands; i++)
 	{
@@ -348,14 +452,317 @@ void printTimestamped(outputField *chatWindow, message *msg) {
 	struct tm *currentTime = localtime(&secs);
 	checkError(currentTime == NULL, "localtime");
 	if((msg->type & MASK_F) == REG_F)
-		wprintw(chatWindow->pad, "[%d:%d] %s: %s\n", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
+		printOutputField(chatWindow, "[%d:%d] %s: %s", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
 	else if((msg->type & MASK_F) == PRV_F)
 	{
 		if((msg->type & MASK_M) == RES_M)
-			wprintw(chatWindow->pad, "[%d:%d] PM to %s: %s\n", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
+			printOutputField(chatWindow, "[%d:%d] PM to %s: %s", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
 		else if((msg->type & MASK_M) == SIG_M)
-			wprintw(chatWindow->pad, "[%d:%d] PM from %s: %s\n", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
+			printOutputField(chatWindow, "[%d:%d] PM from %s: %s", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
 	}
-	if(chatWindow->scrollPosition == 0)
+	else if((msg->type & MASK_F) == CHN_F)
+	{
+		/* The payload starts with the channel */
+		char name[MAX_NAME_SIZE];
+		int len = readArgs(msg->payload, name, NULL);
+		if((msg->type & MASK_M) == RES_M)
+			printOutputField(chatWindow, "[%d:%d] You have to join %s before sending to it", currentTime->tm_hour, currentTime->tm_min, msg->payload);
+		else if(len != -1 && msg->payload[len] == ' ')
+			printOutputField(chatWindow, "[%d:%d] %s %s: %s", currentTime->tm_hour, currentTime->tm_min, name, msg->name, msg->payload + len + 1);
+	}
+	else if((msg->type & MASK_F) == JOI_F)
+	{
+		if((msg->type & MASK_M) == SIG_M)
+			printOutputField(chatWindow, "[%d:%d] %s joined %s", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
+		else if((msg->type & MASK_S) == SCS_S)
+			printOutputField(chatWindow, "[%d:%d] You're now talking in %s", currentTime->tm_hour, currentTime->tm_min, msg->payload);
+		else
+			printOutputField(chatWindow, "[%d:%d] Couldn't join %s", currentTime->tm_hour, currentTime->tm_min, msg->payload);
+	}
+	else if((msg->type & MASK_F) == PRT_F)
+	{
+		if((msg->type & MASK_M) == SIG_M)
+			printOutputField(chatWindow, "[%d:%d] %s left %s", currentTime->tm_hour, currentTime->tm_min, msg->name, msg->payload);
+		else if((msg->type & MASK_S) == SCS_S)
+			printOutputField(chatWindow, "[%d:%d] You left %s", currentTime->tm_hour, currentTime->tm_min, msg->payload);
+		else
+			printOutputField(chatWindow, "[%d:%d] You're not in %s", currentTime->tm_hour, currentTime->tm_min, msg->payload);
+	}
+	else if((msg->type & MASK_F) == LST_F)
+	{
+		/* The payload is the channel followed by its number of members */
+		char name[MAX_NAME_SIZE];
+		int members;
+		if((msg->type & MASK_S) == SCS_S && sscanf(msg->payload, "%31s %d", name, &members) == 2)
+			printOutputField(chatWindow, "[%d:%d] %s - %d member(s)", currentTime->tm_hour, currentTime->tm_min, name, members);
+		else if((msg->type & MASK_S) == FLR_S)
+			printOutputField(chatWindow, "[%d:%d] There are no channels yet", currentTime->tm_hour, currentTime->tm_min);
+	}
+	chatChanged = 1;
+}
+
+/* Milliseconds left until the next frame can be drawn, 0 if it can be drawn now */
+int untilNextFrame(struct timespec *lastFrame, long frameInterval) {
+	struct timespec now;
+	checkError(clock_gettime(CLOCK_MONOTONIC, &now) == -1, "clock_gettime");
+	long elapsed = (now.tv_sec - lastFrame->tv_sec) * 1000000000L + (now.tv_nsec - lastFrame->tv_nsec);
+	if(elapsed >= frameInterval || elapsed < 0)
+		return 0;
+	return (frameInterval - elapsed + 999999) / 1000000;
+}
+
+/*
+	Puts everything that changed since the last frame on the screen with a single doupdate. The input field
+	goes last so the cursor ends up back on it.
+*/
+void drawFrame(outputField *chatWindow, listField *clientList, inputField *chatInput, struct timespec *lastFrame) {
+	if(chatChanged)
 		refreshOutputField(chatWindow);
+	if(clientList->changed)
+		refreshListField(clientList);
+	chatChanged = 0;
+	refreshInputField(chatInput);
+	doupdate();
+	checkError(clock_gettime(CLOCK_MONOTONIC, lastFrame) == -1, "clock_gettime");
+}
+
+int startNetworkThread(networkThread *network, int socketFD) {
+	network->socketFD = socketFD;
+	network->wakeupFD = eventfd(0, EFD_NONBLOCK);
+	network->spaceFD = eventfd(0, 0);
+	if(network->wakeupFD == -1 || network->spaceFD == -1)
+		return -1;
+	if(initSpscQueue(&network->queue, NETWORK_QUEUE_SIZE, sizeof(message)) == -1)
+		return -1;
+	atomic_init(&network->wakeupPending, 0);
+	atomic_init(&network->waitingForSpace, 0);
+	atomic_init(&network->stopped, 0);
+	network->error = 0;
+	network->failure = NULL;
+	if(pthread_create(&network->thread, NULL, runNetworkThread, network) != 0)
+		return -1;
+	return 0;
+}
+
+static void wakeUI(networkThread *network) {
+	if(atomic_exchange(&network->wakeupPending, 1) == 0)
+	{
+		uint64_t one = 1;
+		write(network->wakeupFD, &one, sizeof(one));
+	}
+}
+
+static void *stopNetworkThread(networkThread *network, char *failure) {
+	network->error = errno;
+	network->failure = failure;
+	atomic_store(&network->stopped, 1);
+	atomic_store(&network->wakeupPending, 0);
+	wakeUI(network);
+	return NULL;
+}
+
+/* Returns a free slot, sleeping until the UI makes room if there isn't one */
+static message *reserveMessage(networkThread *network) {
+	message *slot;
+	while((slot = reserveSpscQueue(&network->queue)) == NULL)
+	{
+		/* The UI checks the flag after releasing slots, so either it sees it or the check below sees the room */
+		atomic_store(&network->waitingForSpace, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if((slot = reserveSpscQueue(&network->queue)) != NULL)
+		{
+			atomic_store(&network->waitingForSpace, 0);
+			break;
+		}
+		wakeUI(network);
+		uint64_t count;
+		if(read(network->spaceFD, &count, sizeof(count)) == -1 && errno != EINTR)
+			return NULL;
+	}
+	return slot;
+}
+
+void *runNetworkThread(void *arg) {
+	networkThread *network = arg;
+	messageReader reader;
+	initMessageReader(&reader);
+	struct pollfd monitor = {network->socketFD, POLLIN, 0};
+	while(1)
+	{
+		if(poll(&monitor, 1, -1) == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return stopNetworkThread(network, "poll");
+		}
+		do
+		{
+			int received = fillMessageReader(&reader, network->socketFD);
+			if(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if(received == -1)
+				return stopNetworkThread(network, "receiveMessage");
+			if(received == 0)
+				return stopNetworkThread(network, "Server closed connection");
+
+			/* Decoding every complete message that came in, a partial one waits for the rest of it */
+			char *messageStart;
+			int length;
+			while((length = nextMessage(&reader, &messageStart)) > 0)
+			{
+				message *msg = reserveMessage(network);
+				if(msg == NULL)
+					return stopNetworkThread(network, "read");
+				*msg = decodeMessage(messageStart, reader.version);
+
+				/* Everything the server sends after this response is in the version it picked */
+				if(msg->type == (RES_M | SCS_S | CON_F) && atoi(msg->payload) != PROTOCOL_V1)
+					upgradeMessageReader(&reader, atoi(msg->payload));
+				publishSpscQueue(&network->queue);
+			}
+			if(length == -1)
+				return stopNetworkThread(network, "nextMessage");
+			wakeUI(network);
+		} while(!reader.drained);
+	}
+}
+
+/*
+	Handles up to MAX_DRAIN queued messages and returns 1 if there are more left, in which case the caller
+	has to come back without waiting for another wakeup. Exits if the network thread has stopped and
+	everything it queued before that has been handled.
+*/
+int drainNetwork(networkThread *network, outputField *chatWindow, listField *clientList) {
+	uint64_t count;
+	read(network->wakeupFD, &count, sizeof(count));
+	atomic_store(&network->wakeupPending, 0);
+
+	message *msg;
+	int drained = 0;
+	while(drained < MAX_DRAIN && (msg = peekSpscQueue(&network->queue)) != NULL)
+	{
+		handleMessage(msg, chatWindow, clientList);
+		releaseSpscQueue(&network->queue);
+		drained++;
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	if(drained > 0 && atomic_exchange(&network->waitingForSpace, 0) == 1)
+	{
+		uint64_t one = 1;
+		write(network->spaceFD, &one, sizeof(one));
+	}
+	if(drained == MAX_DRAIN)
+		return 1;
+	if(atomic_load(&network->stopped) && peekSpscQueue(&network->queue) == NULL)
+	{
+		errno = network->error;
+		checkError(1, network->failure);
+	}
+	return 0;
 }
+
+void handleMessage(message *msg, outputField *chatWindow, listField *clientList) {
+	/* Handling response messages from server */
+	if((msg->type & MASK_M) == RES_M)
+	{
+		switch(msg->type & MASK_F)
+		{
+			/* The network thread has already switched its reader over, this is for what gets sent from now on */
+			case CON_F:
+				if((msg->type & MASK_S) == SCS_S)
+					protocolVersion = atoi(msg->payload);
+				break;
+			case PRV_F:
+				if((msg->type & MASK_S) == SCS_S)
+					printTimestamped(chatWindow, msg);
+				break;
+			case NIC_F:
+				if((msg->type & MASK_S) == SCS_S)
+					checkError(readArgs(msg->payload, nick, NULL) == -1, "readArgs");
+				break;
+			/* Whatever's typed from now on goes to the channel that was joined (or parted) last */
+			case JOI_F:
+				if((msg->type & MASK_S) == SCS_S)
+					strcpy(channel, msg->payload);
+				printTimestamped(chatWindow, msg);
+				break;
+			case PRT_F:
+				if((msg->type & MASK_S) == SCS_S && strcmp(channel, msg->payload) == 0)
+					strcpy(channel, "");
+				printTimestamped(chatWindow, msg);
+				break;
+			case LST_F:
+				printTimestamped(chatWindow, msg);
+				break;
+			case CHN_F:
+				printTimestamped(chatWindow, msg);
+				break;
+		}
+	}
+	/* Handling signal messages from server */
+	else if((msg->type & MASK_M) == SIG_M)
+	{
+		switch(msg->type & MASK_F)
+		{
+			case REG_F:
+				printTimestamped(chatWindow, msg);
+				break;
+			case PRV_F:
+				printTimestamped(chatWindow, msg);
+				break;
+			case CON_F:
+				addListFieldItem(clientList, msg->name);
+				break;
+			/* Everyone who was already there when we connected, a batch of names at a time goes into the list at once */
+			case RST_F:
+			{
+				char *names[MAX_PAYLOAD_SIZE / 2 + 1];
+				int numOfNames = 0;
+				char *save, *name = strtok_r(msg->payload, " ", &save);
+				while(name != NULL)
+				{
+					names[numOfNames++] = name;
+					name = strtok_r(NULL, " ", &save);
+				}
+				addListFieldItems(clientList, names, numOfNames);
+				break;
+			}
+			/* Joins, departures and nick changes, as many as happened on one of the server's shards since its last batch */
+			case PRS_F:
+			{
+				char *save, *entry = strtok_r(msg->payload, " ", &save);
+				while(entry != NULL)
+				{
+					if(entry[0] == JOIN_P)
+						addListFieldItem(clientList, entry + 1);
+					else if(entry[0] == LEAVE_P)
+						removeListFieldItem(clientList, entry + 1);
+					else if(entry[0] == RENAME_P)
+					{
+						char *newName = strtok_r(NULL, " ", &save);
+						if(newName == NULL)
+							break;
+						replaceListFieldItem(clientList, entry + 1, newName);
+					}
+					entry = strtok_r(NULL, " ", &save);
+				}
+				break;
+			}
+			case DIS_F:
+				removeListFieldItem(clientList, msg->name);
+				break;
+			case NIC_F:
+				replaceListFieldItem(clientList, msg->name, msg->payload);
+				break;
+			case JOI_F:
+				printTimestamped(chatWindow, msg);
+				break;
+			case PRT_F:
+				printTimestamped(chatWindow, msg);
+				break;
+			case CHN_F:
+				printTimestamped(chatWindow, msg);
+				break;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+
+#include "contable.h"
+
+/* Free slots are chained through their positions entries */
+static void chainFreeSlots(connectionTable *table, int from, int to) {
+	for(int i = from; i < to; i++)
+	{
+		table->connections[i] = NULL;
+		table->positions[i] = (i + 1 < to) ? i + 1 : table->freeSlot;
+	}
+	table->freeSlot = from;
+}
+
+static int growConnectionTable(connectionTable *table) {
+	int newCapacity = table->capacity * 2;
+	void **connections = realloc(table->connections, newCapacity * sizeof(void *));
+	if(connections == NULL)
+		return -1;
+	table->connections = connections;
+	int *positions = realloc(table->positions, newCapacity * sizeof(int));
+	if(positions == NULL)
+		return -1;
+	table->positions = positions;
+	int *dense = realloc(table->dense, newCapacity * sizeof(int));
+	if(dense == NULL)
+		return -1;
+	table->dense = dense;
+	chainFreeSlots(table, table->capacity, newCapacity);
+	table->capacity = newCapacity;
+	return 0;
+}
+
+int initConnectionTable(connectionTable *table, int initialCapacity) {
+	if(initialCapacity < 1)
+		initialCapacity = 1;
+	table->connections = malloc(initialCapacity * sizeof(void *));
+	table->positions = malloc(initialCapacity * sizeof(int));
+	table->dense = malloc(initialCapacity * sizeof(int));
+	if(table->connections == NULL || table->positions == NULL || table->dense == NULL)
+	{
+		freeConnectionTable(table);
+		return -1;
+	}
+	table->length = 0;
+	table->capacity = initialCapacity;
+	table->freeSlot = -1;
+	chainFreeSlots(table, 0, initialCapacity);
+	return 0;
+}
+
+void freeConnectionTable(connectionTable *table) {
+	free(table->connections);
+	free(table->positions);
+	free(table->dense);
+	table->connections = NULL;
+	table->positions = table->dense = NULL;
+	table->length = table->capacity = 0;
+	table->freeSlot = -1;
+}
+
+/* Returns the slot ID of the connection, or -1 if the table couldn't grow */
+int insertConnection(connectionTable *table, void *connection) {
+	if(table->freeSlot == -1 && growConnectionTable(table) == -1)
+		return -1;
+	int slotId = table->freeSlot;
+	table->freeSlot = table->positions[slotId];
+	table->connections[slotId] = connection;
+	table->positions[slotId] = table->length;
+	table->dense[table->length++] = slotId;
+	return slotId;
+}
+
+/* The last connection in the dense array takes the place of the removed one */
+void removeConnection(connectionTable *table, int slotId) {
+	int position = table->positions[slotId];
+	int lastSlotId = table->dense[--table->length];
+	table->dense[position] = lastSlotId;
+	table->positions[lastSlotId] = position;
+
+	table->connections[slotId] = NULL;
+	table->positions[slotId] = table->freeSlot;
+	table->freeSlot = slotId;
+}
+
+void *findConnection(connectionTable *table, int slotId) {
+	if(slotId < 0 || slotId >= table->capacity)
+		return NULL;
+	return table->connections[slotId];
+}
+
+int connectionPosition(connectionTable *table, int slotId) {
+	return table->positions[slotId];
+}
@@ -0,0 +1,34 @@
+#ifndef _CONTABLE_H_
+#define _CONTABLE_H_
+
+/*
+	Growable connection table.
+	Every connection gets a slot ID that stays the same for as long as it's in the table, freed slot IDs
+	are recycled through a free list. Next to the slots, the table keeps a dense array of the live
+	connections for iterating over them - removing a connection moves the last one into its place, so
+	both insertion and removal are O(1) and there's no upper limit other than memory.
+
+	SLOTS:     0 1 2 3 4 5 ...    (slot ID -> connection, position in the dense array)
+	DENSE:     3 0 5 ...          (position -> slot ID)
+*/
+
+typedef struct {
+	void **connections;
+	int *positions;
+	int *dense;
+	int length;
+	int capacity;
+	int freeSlot;
+} connectionTable;
+
+int initConnectionTable(connectionTable *table, int initialCapacity);
+void freeConnectionTable(connectionTable *table);
+int insertConnection(connectionTable *table, void *connection);
+void removeConnection(connectionTable *table, int slotId);
+void *findConnection(connectionTable *table, int slotId);
+int connectionPosition(connectionTable *table, int slotId);
+
+/* Iterating over the live connections - position has to be below the table's length */
+#define connectionAt(table, position) ((table)->connections[(table)->dense[(position)]])
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "contable.h"
+
+#define checkError(expression, errorMessage)\
+do\
+{\
+	if(expression)\
+	{\
+		perror(errorMessage);\
+		exit(EXIT_FAILURE);\
+	}\
+} while(0);
+
+#define CHECK_CONNECTIONS 50000
+#define CHECK_ROUNDS 20
+
+/*
+	Test of the server's connection table, built on its own (make check) so it doesn't depend on anything
+	but the table. It puts the table through CHECK_CONNECTIONS connections coming and going.
+*/
+
+int checkConnectionTable(void);
+
+int main(void) {
+	exit(checkConnectionTable() ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Every live connection has to be found through its slot and through its position, and every position has to hold one of them */
+static int verifyConnectionTable(connectionTable *table, char *connections, int *slots, int live) {
+	static char seen[CHECK_CONNECTIONS];
+	if(table->length != live)
+	{
+		fprintf(stderr, "connection table holds %d connections instead of %d\n", table->length, live);
+		return 0;
+	}
+	memset(seen, 0, sizeof(seen));
+	for(int position = 0; position < table->length; position++)
+	{
+		char *connection = connectionAt(table, position);
+		if(connection < connections || connection >= connections + CHECK_CONNECTIONS || seen[connection - connections]++)
+		{
+			fprintf(stderr, "connection table position %d holds a connection it shouldn't\n", position);
+			return 0;
+		}
+	}
+	for(int i = 0; i < CHECK_CONNECTIONS; i++)
+	{
+		if(slots[i] == -1)
+			continue;
+		if(findConnection(table, slots[i]) != &connections[i] || connectionAt(table, connectionPosition(table, slots[i])) != &connections[i])
+		{
+			fprintf(stderr, "connection %d can't be found through slot %d\n", i, slots[i]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Stress test of the connection table. It fills up with CHECK_CONNECTIONS connections from a tiny initial
+	capacity, and then every round disconnects a random part of them (up to all) in random order and
+	connects them back, with single connections coming and going in between. Once it has grown to fit
+	them all, freed slots have to be reused, so it never grows again.
+*/
+int checkConnectionTable(void) {
+	static char connections[CHECK_CONNECTIONS];
+	static int slots[CHECK_CONNECTIONS];
+	static int order[CHECK_CONNECTIONS];
+	connectionTable table;
+	checkError(initConnectionTable(&table, 16) == -1, "initConnectionTable");
+	unsigned int seed = 12345;
+	int live = 0, capacity = 0;
+	uint64_t operations = 0;
+	for(int i = 0; i < CHECK_CONNECTIONS; i++)
+		slots[i] = -1;
+
+	for(int round = 0; round <= CHECK_ROUNDS; round++)
+	{
+		/* Connecting everyone who isn't, in random order */
+		for(int i = 0; i < CHECK_CONNECTIONS; i++)
+			order[i] = i;
+		for(int i = CHECK_CONNECTIONS - 1; i > 0; i--)
+		{
+			int j = rand_r(&seed) % (i + 1), swap = order[i];
+			order[i] = order[j];
+			order[j] = swap;
+		}
+		for(int i = 0; i < CHECK_CONNECTIONS; i++)
+		{
+			if(slots[order[i]] != -1)
+				continue;
+			slots[order[i]] = insertConnection(&table, &connections[order[i]]);
+			checkError(slots[order[i]] == -1, "insertConnection");
+			live++;
+			operations++;
+		}
+		if(!verifyConnectionTable(&table, connections, slots, live))
+			return 0;
+		if(round == 0)
+			capacity = table.capacity;
+		else if(table.capacity != capacity)
+		{
+			fprintf(stderr, "connection table grew from %d to %d slots without having more connections\n", capacity, table.capacity);
+			return 0;
+		}
+
+		/* A mass disconnect, with the odd single connection coming and going */
+		int leaving = (round == CHECK_ROUNDS) ? CHECK_CONNECTIONS : rand_r(&seed) % CHECK_CONNECTIONS;
+		for(int i = 0; i < leaving; i++)
+		{
+			removeConnection(&table, slots[order[i]]);
+			slots[order[i]] = -1;
+			live--;
+			operations++;
+			if(rand_r(&seed) % 8 == 0)
+			{
+				int k = order[rand_r(&seed) % (i + 1)];
+				slots[k] = insertConnection(&table, &connections[k]);
+				checkError(slots[k] == -1, "insertConnection");
+				removeConnection(&table, slots[k]);
+				slots[k] = -1;
+				operations += 2;
+			}
+		}
+		if(!verifyConnectionTable(&table, connections, slots, live))
+			return 0;
+	}
+	freeConnectionTable(&table);
+	printf("contable: %d connections through %llu inserts and removals\n", CHECK_CONNECTIONS, (unsigned long long)operations);
+	return 1;
+}
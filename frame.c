@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "socketcom.h"
+#include "frame.h"
+#include "pool.h"
+
+frame *createFrame(uint32_t type, char *name, char *payload) {
+	uint32_t payloadLength = (payload == NULL) ? 0 : strlen(payload);
+	char compactPrefix[MAX_COMPACT_PREFIX_SIZE];
+	int compactPrefixLength = encodeCompactPrefix(compactPrefix, type, name, payloadLength);
+	frame *f = poolAlloc(sizeof(frame) + MESSAGE_PREFIX_SIZE + compactPrefixLength + 2 * payloadLength);
+	if(f == NULL)
+		return NULL;
+	atomic_init(&f->references, 1);
+	f->dispose = NULL;
+	f->backing = NULL;
+
+	frameData(f, PROTOCOL_V1) = f->buffer;
+	frameLength(f, PROTOCOL_V1) = encodeMessagePrefix(f->buffer, type, name, payloadLength) + payloadLength;
+	if(payloadLength > 0)
+		memcpy(f->buffer + MESSAGE_PREFIX_SIZE, payload, payloadLength);
+
+	frameData(f, PROTOCOL_V2) = f->buffer + frameLength(f, PROTOCOL_V1);
+	frameLength(f, PROTOCOL_V2) = compactPrefixLength + payloadLength;
+	memcpy(frameData(f, PROTOCOL_V2), compactPrefix, compactPrefixLength);
+	if(payloadLength > 0)
+		memcpy(frameData(f, PROTOCOL_V2) + compactPrefixLength, payload, payloadLength);
+	return f;
+}
+
+/* The frame takes over a reference to the backing, which gets disposed of along with the frame */
+frame *wrapFrame(char *data[], int length[], void (*dispose)(void *backing), void *backing) {
+	frame *f = poolAlloc(sizeof(frame));
+	if(f == NULL)
+		return NULL;
+	atomic_init(&f->references, 1);
+	for(int version = PROTOCOL_V1; version <= LATEST_PROTOCOL; version++)
+	{
+		frameData(f, version) = data[version - PROTOCOL_V1];
+		frameLength(f, version) = length[version - PROTOCOL_V1];
+	}
+	f->dispose = dispose;
+	f->backing = backing;
+	return f;
+}
+
+frame *retainFrame(frame *f) {
+	atomic_fetch_add_explicit(&f->references, 1, memory_order_relaxed);
+	return f;
+}
+
+void releaseFrame(frame *f) {
+	if(atomic_fetch_sub_explicit(&f->references, 1, memory_order_acq_rel) == 1)
+	{
+		if(f->dispose != NULL)
+			f->dispose(f->backing);
+		poolFree(f);
+	}
+}
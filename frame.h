@@ -0,0 +1,37 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "socketcom.h"
+
+/*
+	An encoded message, ready to go out on the wire.
+	Frames are immutable once created and reference counted, so a broadcast encodes its message
+	once and every recipient (on any shard) queues the very same frame. The last release frees it,
+	which can happen on a different shard than the one that created it (see pool.h).
+	Since recipients don't all speak the same protocol version, a frame holds an encoding for each
+	of them, one after the other in the same allocation.
+	A frame can also wrap encodings that live somewhere else (like the mapped history segments), in which
+	case it holds on to whatever backs them and hands it to its dispose function once it's released.
+*/
+
+typedef struct {
+	atomic_int references;
+	char *data[LATEST_PROTOCOL];
+	int length[LATEST_PROTOCOL];
+	void (*dispose)(void *backing);
+	void *backing;
+	char buffer[];
+} frame;
+
+#define frameData(f, version) ((f)->data[(version) - PROTOCOL_V1])
+#define frameLength(f, version) ((f)->length[(version) - PROTOCOL_V1])
+
+frame *createFrame(uint32_t type, char *name, char *payload);
+frame *wrapFrame(char *data[], int length[], void (*dispose)(void *backing), void *backing);
+frame *retainFrame(frame *f);
+void releaseFrame(frame *f);
+
+#endif
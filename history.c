@@ -0,0 +1,803 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "socketcom.h"
+#include "frame.h"
+#include "history.h"
+
+#define alignRecord(length) (((length) + 7) & ~(size_t)7)
+#define recordAt(segment, offset) ((historyRecord *)((segment)->map + (offset)))
+
+/* Chores - what the history thread does with a segment, in this order */
+#define RENAME_W 1
+#define SEAL_W 2
+#define RETIRE_W 4
+
+static int64_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_REALTIME, &time);
+	return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/* Anything that doesn't add up marks the end of the segment, be it the zeroed tail or a torn write */
+static int validRecord(historyRecord *record, size_t available) {
+	if(available < sizeof(historyRecord) || record->length < sizeof(historyRecord) || record->length > available || record->length % 8 != 0)
+		return 0;
+	if(record->targetLength >= MAX_NAME_SIZE)
+		return 0;
+	size_t length = sizeof(historyRecord) + record->targetLength;
+	for(int i = 0; i < LATEST_PROTOCOL; i++)
+	{
+		if(record->encodingLength[i] == 0 || record->encodingLength[i] > TOTAL_BUFFER_SIZE + MAX_COMPACT_PREFIX_SIZE)
+			return 0;
+		length += record->encodingLength[i];
+	}
+	return alignRecord(length) == record->length;
+}
+
+static int indexRecord(historySegment *segment, size_t offset) {
+	if(segment->count % HISTORY_INDEX_INTERVAL != 0)
+		return 0;
+	if(segment->indexLength == segment->indexCapacity)
+	{
+		int capacity = (segment->indexCapacity == 0) ? 16 : 2 * segment->indexCapacity;
+		historyIndexEntry *index = realloc(segment->index, capacity * sizeof(historyIndexEntry));
+		if(index == NULL)
+			return -1;
+		segment->index = index;
+		segment->indexCapacity = capacity;
+	}
+	historyIndexEntry *entry = &segment->index[segment->indexLength++];
+	entry->sequence = segment->firstSequence + segment->count;
+	entry->offset = offset;
+	return 0;
+}
+
+static historySegment *newSegment(int fd, char *map, size_t size, uint64_t firstSequence, char *path) {
+	historySegment *segment = malloc(sizeof(historySegment));
+	if(segment == NULL)
+		return NULL;
+	atomic_init(&segment->references, 1);
+	segment->fd = fd;
+	segment->map = map;
+	segment->size = size;
+	segment->end = 0;
+	segment->firstSequence = firstSequence;
+	segment->count = 0;
+	segment->lastTime = 0;
+	segment->index = NULL;
+	segment->indexLength = 0;
+	segment->indexCapacity = 0;
+	strcpy(segment->path, path);
+	segment->chores = 0;
+	segment->nextChore = NULL;
+	return segment;
+}
+
+static void segmentPath(history *h, uint64_t firstSequence, char *path) {
+	snprintf(path, PATH_MAX, "%s/%020" PRIu64 ".seg", h->directory, firstSequence);
+}
+
+static void sparePath(history *h, char *path) {
+	snprintf(path, PATH_MAX, "%s/" HISTORY_SPARE_NAME, h->directory);
+}
+
+/* The history and every replayed frame hold a reference, the last one out unmaps the segment */
+static void releaseSegment(void *backing) {
+	historySegment *segment = backing;
+	if(atomic_fetch_sub_explicit(&segment->references, 1, memory_order_acq_rel) != 1)
+		return;
+	munmap(segment->map, segment->size);
+	close(segment->fd);
+	free(segment->index);
+	free(segment);
+}
+
+static historySegment *createSegment(history *h, char *path, uint64_t firstSequence) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd == -1)
+		return NULL;
+	char *map = MAP_FAILED;
+	if(ftruncate(fd, h->segmentSize) == 0)
+		map = mmap(NULL, h->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	historySegment *segment = NULL;
+	if(map != MAP_FAILED)
+		segment = newSegment(fd, map, h->segmentSize, firstSequence, path);
+	if(segment == NULL)
+	{
+		if(map != MAP_FAILED)
+			munmap(map, h->segmentSize);
+		close(fd);
+		unlink(path);
+	}
+	return segment;
+}
+
+/* Maps an existing segment and scans it, segments without a single record (empty files included) get deleted */
+static historySegment *loadSegment(char *path, uint64_t firstSequence) {
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd == -1)
+		return NULL;
+	struct stat status;
+	if(fstat(fd, &status) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+	if(status.st_size == 0)
+	{
+		unlink(path);
+		close(fd);
+		return NULL;
+	}
+	char *map = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	historySegment *segment = NULL;
+	if(map != MAP_FAILED)
+		segment = newSegment(fd, map, status.st_size, firstSequence, path);
+	if(segment == NULL)
+	{
+		if(map != MAP_FAILED)
+			munmap(map, status.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	while(validRecord(recordAt(segment, segment->end), segment->size - segment->end))
+	{
+		historyRecord *record = recordAt(segment, segment->end);
+		if(indexRecord(segment, segment->end) == -1)
+			break;
+		segment->end += record->length;
+		segment->count++;
+		segment->lastTime = record->time;
+	}
+	if(segment->count == 0)
+	{
+		unlink(path);
+		releaseSegment(segment);
+		return NULL;
+	}
+	if(segment->end < segment->size)
+		ftruncate(fd, segment->end);
+	return segment;
+}
+
+/* Grows a loaded segment back to the full size, its file was cut down to the records in it */
+static int reopenSegment(history *h, historySegment *segment) {
+	if(segment->end + sizeof(historyRecord) >= h->segmentSize)
+		return -1;
+	if(ftruncate(segment->fd, h->segmentSize) == -1)
+		return -1;
+	char *map = mmap(NULL, h->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+	if(map == MAP_FAILED)
+	{
+		ftruncate(segment->fd, segment->end);
+		return -1;
+	}
+	munmap(segment->map, segment->size);
+	segment->map = map;
+	segment->size = h->segmentSize;
+	return 0;
+}
+
+static int addSegment(history *h, historySegment *segment) {
+	if(h->length == h->capacity)
+	{
+		int capacity = (h->capacity == 0) ? 16 : 2 * h->capacity;
+		historySegment **segments = realloc(h->segments, capacity * sizeof(historySegment *));
+		if(segments == NULL)
+			return -1;
+		h->segments = segments;
+		h->capacity = capacity;
+	}
+	h->segments[h->length++] = segment;
+	return 0;
+}
+
+/*
+	Hands a segment over to the history thread, a retired one goes along with the history's reference to it.
+	A rename goes to the front of the list, the next spare is only made once the one before has its proper name.
+*/
+static void queueChore(history *h, historySegment *segment, int chore) {
+	if(segment->chores == 0 && chore == RENAME_W)
+	{
+		segment->nextChore = h->firstChore;
+		h->firstChore = segment;
+		if(h->lastChore == NULL)
+			h->lastChore = segment;
+	}
+	else if(segment->chores == 0)
+	{
+		segment->nextChore = NULL;
+		if(h->lastChore == NULL)
+			h->firstChore = segment;
+		else
+			h->lastChore->nextChore = segment;
+		h->lastChore = segment;
+	}
+	segment->chores |= chore;
+	pthread_cond_signal(&h->wakeup);
+}
+
+/* Takes the next segment off the chore list, along with its chores and where it ends */
+static historySegment *nextChore(history *h, int *chores, size_t *end) {
+	historySegment *segment = h->firstChore;
+	if(segment == NULL)
+		return NULL;
+	h->firstChore = segment->nextChore;
+	if(h->firstChore == NULL)
+		h->lastChore = NULL;
+	*chores = segment->chores;
+	*end = segment->end;
+	segment->chores = 0;
+	return segment;
+}
+
+/* Without the lock - a sealed segment doesn't change any more, and a retired one is only known to the chore */
+static void doChores(history *h, historySegment *segment, int chores, size_t end) {
+	if(chores & RENAME_W)
+	{
+		char path[PATH_MAX];
+		sparePath(h, path);
+		rename(path, segment->path);
+	}
+	if(chores & SEAL_W)
+		ftruncate(segment->fd, end);
+	if(chores & RETIRE_W)
+	{
+		unlink(segment->path);
+		releaseSegment(segment);
+	}
+}
+
+/* The segment that's being appended to is never retired */
+static void retireSegments(history *h) {
+	int64_t oldest = now() - (int64_t)h->maxAge * 1000000000;
+	while(h->length > 1 && (h->length > h->maxSegments || (h->maxAge > 0 && h->segments[0]->lastTime < oldest)))
+	{
+		queueChore(h, h->segments[0], RETIRE_W);
+		memmove(h->segments, h->segments + 1, (h->length - 1) * sizeof(historySegment *));
+		h->length--;
+	}
+}
+
+/* Seals the segment that's being appended to and starts on the next one, the history thread names it */
+static int startSegment(history *h, historySegment *next) {
+	if(addSegment(h, next) == -1)
+		return -1;
+	segmentPath(h, next->firstSequence, next->path);
+	queueChore(h, next, RENAME_W);
+	queueChore(h, h->segments[h->length - 2], SEAL_W);
+	h->wantSpare = 1;
+	retireSegments(h);
+	return 0;
+}
+
+/* Everything but the length */
+static void writeRecord(historyRecord *record, frame *f, uint32_t type, char *target, uint32_t targetLength, int64_t time) {
+	record->type = type;
+	record->time = time;
+	record->targetLength = targetLength;
+	char *data = (char *)(record + 1);
+	memcpy(data, target, targetLength);
+	data += targetLength;
+	for(int version = PROTOCOL_V1; version <= LATEST_PROTOCOL; version++)
+	{
+		record->encodingLength[version - PROTOCOL_V1] = frameLength(f, version);
+		memcpy(data, frameData(f, version), frameLength(f, version));
+		data += frameLength(f, version);
+	}
+}
+
+/*
+	Moves the records that were handed back into a new spare and starts appending to it. Appends keep handing
+	theirs back while it's filling, so nothing takes a sequence number in the meantime and the spare isn't
+	known to anyone else - the copying is done without the lock. Called with the lock held.
+*/
+static void fillSpare(history *h, historySegment *spare) {
+	h->filling = 1;
+	spare->firstSequence = h->nextSequence;
+	while(h->firstPending != NULL)
+	{
+		historyPending *pending = h->firstPending;
+		h->firstPending = NULL;
+		h->lastPending = NULL;
+		h->pendingSize = 0;
+		pthread_mutex_unlock(&h->lock);
+		while(pending != NULL)
+		{
+			historyPending *next = pending->next;
+			historyRecord *record = (historyRecord *)pending->record;
+			if(spare->end + record->length <= spare->size && indexRecord(spare, spare->end) == 0)
+			{
+				memcpy(recordAt(spare, spare->end), record, record->length);
+				spare->end += record->length;
+				spare->count++;
+				spare->lastTime = record->time;
+			}
+			free(pending);
+			pending = next;
+		}
+		pthread_mutex_lock(&h->lock);
+	}
+	h->filling = 0;
+	if(startSegment(h, spare) == -1)
+	{
+		/* Those records are lost, the next spare's file takes over from this one */
+		releaseSegment(spare);
+		h->wantSpare = 1;
+		return;
+	}
+	h->nextSequence += spare->count;
+}
+
+/* Copies a record that can't be appended right now for the history thread, up to a segment's worth of them */
+static int handBack(history *h, frame *f, uint32_t type, char *target, uint32_t targetLength, size_t length) {
+	h->wantSpare = 1;
+	pthread_cond_signal(&h->wakeup);
+	if(h->pendingSize + length > h->segmentSize)
+		return -1;
+	historyPending *pending = malloc(sizeof(historyPending) + length);
+	if(pending == NULL)
+		return -1;
+	historyRecord *record = (historyRecord *)pending->record;
+	writeRecord(record, f, type, target, targetLength, now());
+	record->length = length;
+	pending->next = NULL;
+	if(h->lastPending == NULL)
+		h->firstPending = pending;
+	else
+		h->lastPending->next = pending;
+	h->lastPending = pending;
+	h->pendingSize += length;
+	return 0;
+}
+
+/* A new spare comes before sealing and retiring, records are handed back while there's none */
+static void *runHistory(void *arg) {
+	history *h = arg;
+	pthread_mutex_lock(&h->lock);
+	while(1)
+	{
+		if(h->wantSpare && (!h->stopping || h->firstPending != NULL) && (h->firstChore == NULL || !(h->firstChore->chores & RENAME_W)))
+		{
+			/* If this fails, the next record that's handed back asks for another try */
+			h->wantSpare = 0;
+			if(h->spare != NULL)
+				continue;
+			pthread_mutex_unlock(&h->lock);
+			char path[PATH_MAX];
+			sparePath(h, path);
+			historySegment *spare = createSegment(h, path, 0);
+			pthread_mutex_lock(&h->lock);
+			if(spare != NULL && h->firstPending != NULL)
+				fillSpare(h, spare);
+			else
+				h->spare = spare;
+			continue;
+		}
+		int chores;
+		size_t end;
+		historySegment *segment = nextChore(h, &chores, &end);
+		if(segment != NULL)
+		{
+			pthread_mutex_unlock(&h->lock);
+			doChores(h, segment, chores, end);
+			pthread_mutex_lock(&h->lock);
+		}
+		else if(h->stopping)
+			break;
+		else
+			pthread_cond_wait(&h->wakeup, &h->lock);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+static int compareSequences(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+int openHistory(history *h, char *directory, size_t segmentSize, int maxSegments, long maxAge) {
+	h->directory = directory;
+	h->segmentSize = segmentSize;
+	h->maxSegments = maxSegments;
+	h->maxAge = maxAge;
+	h->segments = NULL;
+	h->length = 0;
+	h->capacity = 0;
+	h->nextSequence = 0;
+	h->running = 0;
+	h->stopping = 0;
+	h->wantSpare = 1;
+	h->spare = NULL;
+	h->firstPending = NULL;
+	h->lastPending = NULL;
+	h->pendingSize = 0;
+	h->filling = 0;
+	h->firstChore = NULL;
+	h->lastChore = NULL;
+	if(pthread_mutex_init(&h->lock, NULL) != 0)
+		return -1;
+	if(pthread_cond_init(&h->wakeup, NULL) != 0)
+	{
+		pthread_mutex_destroy(&h->lock);
+		return -1;
+	}
+	if(mkdir(directory, 0755) == -1 && errno != EEXIST)
+	{
+		closeHistory(h);
+		return -1;
+	}
+
+	/* Picking up the segments a previous run left behind, oldest first */
+	DIR *dir = opendir(directory);
+	if(dir == NULL)
+	{
+		closeHistory(h);
+		return -1;
+	}
+	uint64_t *sequences = NULL;
+	int numOfSequences = 0, sequenceCapacity = 0;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		uint64_t sequence;
+		char suffix[8];
+		if(sscanf(entry->d_name, "%20" SCNu64 "%7s", &sequence, suffix) != 2 || strcmp(suffix, ".seg") != 0)
+			continue;
+		if(numOfSequences == sequenceCapacity)
+		{
+			sequenceCapacity = (sequenceCapacity == 0) ? 16 : 2 * sequenceCapacity;
+			uint64_t *grown = realloc(sequences, sequenceCapacity * sizeof(uint64_t));
+			if(grown == NULL)
+				break;
+			sequences = grown;
+		}
+		sequences[numOfSequences++] = sequence;
+	}
+	closedir(dir);
+	qsort(sequences, numOfSequences, sizeof(uint64_t), compareSequences);
+	char path[PATH_MAX];
+	for(int i = 0; i < numOfSequences; i++)
+	{
+		segmentPath(h, sequences[i], path);
+		historySegment *segment = loadSegment(path, sequences[i]);
+		if(segment == NULL)
+			continue;
+		if(addSegment(h, segment) == -1)
+		{
+			releaseSegment(segment);
+			break;
+		}
+		h->nextSequence = segment->firstSequence + segment->count;
+	}
+	free(sequences);
+
+	/* A spare with records in it was being appended to, the history thread just hadn't named it yet */
+	sparePath(h, path);
+	historySegment *leftover = loadSegment(path, h->nextSequence);
+	if(leftover != NULL)
+	{
+		segmentPath(h, leftover->firstSequence, leftover->path);
+		if(rename(path, leftover->path) == -1 || addSegment(h, leftover) == -1)
+			releaseSegment(leftover);
+		else
+			h->nextSequence += leftover->count;
+	}
+
+	/* Appending carries on in the newest segment while there's room in it, restarts don't use up segments */
+	if(h->length == 0 || reopenSegment(h, h->segments[h->length - 1]) == -1)
+	{
+		segmentPath(h, h->nextSequence, path);
+		historySegment *segment = createSegment(h, path, h->nextSequence);
+		if(segment == NULL || addSegment(h, segment) == -1)
+		{
+			if(segment != NULL)
+				releaseSegment(segment);
+			closeHistory(h);
+			return -1;
+		}
+	}
+	if(pthread_create(&h->thread, NULL, runHistory, h) != 0)
+	{
+		closeHistory(h);
+		return -1;
+	}
+	h->running = 1;
+	pthread_mutex_lock(&h->lock);
+	retireSegments(h);
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+void closeHistory(history *h) {
+	if(h->running)
+	{
+		pthread_mutex_lock(&h->lock);
+		h->stopping = 1;
+		pthread_cond_signal(&h->wakeup);
+		pthread_mutex_unlock(&h->lock);
+		pthread_join(h->thread, NULL);
+		h->running = 0;
+	}
+	int chores;
+	size_t end;
+	historySegment *chore;
+	while((chore = nextChore(h, &chores, &end)) != NULL)
+		doChores(h, chore, chores, end);
+	if(h->spare != NULL)
+	{
+		char path[PATH_MAX];
+		sparePath(h, path);
+		unlink(path);
+		releaseSegment(h->spare);
+		h->spare = NULL;
+	}
+	while(h->firstPending != NULL)
+	{
+		historyPending *pending = h->firstPending;
+		h->firstPending = pending->next;
+		free(pending);
+	}
+	h->lastPending = NULL;
+
+	for(int i = 0; i < h->length; i++)
+	{
+		historySegment *segment = h->segments[i];
+		if(segment->count == 0)
+			unlink(segment->path);
+		else if(segment->end < segment->size)
+			ftruncate(segment->fd, segment->end);
+		releaseSegment(segment);
+	}
+	free(h->segments);
+	h->segments = NULL;
+	h->length = 0;
+	pthread_cond_destroy(&h->wakeup);
+	pthread_mutex_destroy(&h->lock);
+}
+
+/*
+	The length goes in last, a record is only ever seen whole. The append holds a reference to its segment
+	while it's writing, so a segment that gets retired in the meantime stays mapped until it's done.
+*/
+int appendHistory(history *h, frame *f, uint32_t type, char *target) {
+	uint32_t targetLength = (target == NULL) ? 0 : strlen(target);
+	size_t length = sizeof(historyRecord) + targetLength;
+	for(int version = PROTOCOL_V1; version <= LATEST_PROTOCOL; version++)
+		length += frameLength(f, version);
+	length = alignRecord(length);
+	if(length > h->segmentSize)
+		return -1;
+
+	pthread_mutex_lock(&h->lock);
+	historySegment *segment = h->segments[h->length - 1];
+	if(h->firstPending != NULL || h->filling || segment->end + length > segment->size)
+	{
+		/*
+			Sealing the full segment and swapping the spare in, the history thread shrinks the sealed one's file
+			to the records that are actually in it. If it hasn't got a spare ready, or there are records
+			waiting for it already, the record goes to the thread rather than a segment being created here -
+			that's filesystem work under the lock every shard appends through.
+		*/
+		historySegment *next = h->spare;
+		if(h->firstPending != NULL || h->filling || next == NULL)
+		{
+			int result = handBack(h, f, type, target, targetLength, length);
+			pthread_mutex_unlock(&h->lock);
+			return result;
+		}
+		next->firstSequence = h->nextSequence;
+		if(startSegment(h, next) == -1)
+		{
+			/* The spare's file still has its temporary name, so it can wait for the next try */
+			pthread_mutex_unlock(&h->lock);
+			return -1;
+		}
+		h->spare = NULL;
+		segment = next;
+	}
+
+	/* Only claiming the space and the sequence number under the lock, the record is written after it */
+	int64_t time = now();
+	size_t offset = segment->end;
+	indexRecord(segment, offset);
+	segment->end += length;
+	segment->count++;
+	segment->lastTime = time;
+	h->nextSequence++;
+	atomic_fetch_add_explicit(&segment->references, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&h->lock);
+
+	historyRecord *record = recordAt(segment, offset);
+	writeRecord(record, f, type, target, targetLength, time);
+	atomic_store_explicit(&record->length, length, memory_order_release);
+	releaseSegment(segment);
+	return 0;
+}
+
+/* The segments a replay looks at, and where each of them ended when it started */
+typedef struct {
+	historySegment *segment;
+	size_t end;
+} historyView;
+
+/* The length of the record at the offset, or 0 if it's past the end or still being written */
+static uint32_t viewRecord(historyView *view, size_t offset) {
+	if(offset >= view->end)
+		return 0;
+	return atomic_load_explicit(&recordAt(view->segment, offset)->length, memory_order_acquire);
+}
+
+/*
+	Finds the segment and offset of a record, sequence numbers before the oldest segment start at its first
+	record. Only the look-up in the index needs the lock, the walk from there goes through the records.
+*/
+static void seekHistory(history *h, historyView *views, int numOfViews, uint64_t sequence, int *viewId, size_t *offset) {
+	int low = 0, high = numOfViews - 1;
+	while(low < high)
+	{
+		int middle = (low + high + 1) / 2;
+		if(views[middle].segment->firstSequence <= sequence)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	historySegment *segment = views[low].segment;
+	*viewId = low;
+	*offset = 0;
+	if(sequence <= segment->firstSequence)
+		return;
+
+	/* The closest indexed record at or before the one we're after, then walking from there */
+	pthread_mutex_lock(&h->lock);
+	int first = 0, last = segment->indexLength - 1;
+	while(first < last)
+	{
+		int middle = (first + last + 1) / 2;
+		if(segment->index[middle].sequence <= sequence)
+			first = middle;
+		else
+			last = middle - 1;
+	}
+	uint64_t current = segment->firstSequence;
+	if(segment->indexLength > 0)
+	{
+		current = segment->index[first].sequence;
+		*offset = segment->index[first].offset;
+	}
+	pthread_mutex_unlock(&h->lock);
+	uint32_t length;
+	while(current < sequence && (length = viewRecord(&views[low], *offset)) != 0)
+	{
+		*offset += length;
+		current++;
+	}
+}
+
+/*
+	Fills frames with (up to) the last count records of the given type, oldest first, and returns how many
+	there are. The frames point into the segments, the caller has to release every one of them.
+	The segments and where they end are noted down under the lock, with a reference to each of them, and
+	then scanned without it - the history ends at the first record that's still being written.
+	Since records of other types are mixed in, the search window keeps doubling until it has enough of them,
+	it covers the whole history or it's HISTORY_REPLAY_SCAN times the count - a type that's rare enough gets
+	fewer records replayed rather than a scan of everything.
+*/
+int replayHistory(history *h, uint32_t type, int count, frame **frames) {
+	if(count <= 0)
+		return 0;
+	historySegment **segments = malloc(count * sizeof(historySegment *));
+	historyRecord **records = malloc(count * sizeof(historyRecord *));
+	historyView *views = NULL;
+	int numOfViews = 0, viewCapacity = 0;
+	uint64_t nextSequence;
+	while(segments != NULL && records != NULL)
+	{
+		pthread_mutex_lock(&h->lock);
+		if(h->length <= viewCapacity)
+		{
+			for(numOfViews = 0; numOfViews < h->length; numOfViews++)
+			{
+				views[numOfViews].segment = h->segments[numOfViews];
+				views[numOfViews].end = h->segments[numOfViews]->end;
+				atomic_fetch_add_explicit(&h->segments[numOfViews]->references, 1, memory_order_relaxed);
+			}
+			nextSequence = h->nextSequence;
+			pthread_mutex_unlock(&h->lock);
+			break;
+		}
+		viewCapacity = h->length + 4;
+		pthread_mutex_unlock(&h->lock);
+		historyView *grown = realloc(views, viewCapacity * sizeof(historyView));
+		if(grown == NULL)
+			break;
+		views = grown;
+	}
+	if(numOfViews == 0)
+	{
+		free(segments);
+		free(records);
+		free(views);
+		return -1;
+	}
+
+	uint64_t first = views[0].segment->firstSequence;
+	uint64_t window = count, maxWindow = (uint64_t)count * HISTORY_REPLAY_SCAN;
+	int found, newest;
+	while(1)
+	{
+		uint64_t start = (nextSequence - first > window) ? nextSequence - window : first;
+		int viewId;
+		size_t offset;
+		seekHistory(h, views, numOfViews, start, &viewId, &offset);
+
+		/* Keeping the last count matches in a circular buffer */
+		found = 0;
+		newest = -1;
+		int complete = 1;
+		for(; complete && viewId < numOfViews; viewId++, offset = 0)
+		{
+			historyView *view = &views[viewId];
+			uint32_t length;
+			for(; (length = viewRecord(view, offset)) != 0; offset += length)
+			{
+				if(recordAt(view->segment, offset)->type != type)
+					continue;
+				newest = (newest + 1) % count;
+				segments[newest] = view->segment;
+				records[newest] = recordAt(view->segment, offset);
+				found++;
+			}
+			complete = (offset >= view->end);
+		}
+		if(found >= count || start == first || window >= maxWindow)
+			break;
+		window = (2 * window < maxWindow) ? 2 * window : maxWindow;
+	}
+
+	int length = (found < count) ? found : count;
+	int numOfFrames = 0;
+	for(int i = 0; i < length; i++)
+	{
+		int position = (newest - length + 1 + i + count) % count;
+		historyRecord *record = records[position];
+		char *data[LATEST_PROTOCOL];
+		int lengths[LATEST_PROTOCOL];
+		char *next = (char *)(record + 1) + record->targetLength;
+		for(int j = 0; j < LATEST_PROTOCOL; j++)
+		{
+			data[j] = next;
+			lengths[j] = record->encodingLength[j];
+			next += lengths[j];
+		}
+		atomic_fetch_add_explicit(&segments[position]->references, 1, memory_order_relaxed);
+		frames[numOfFrames] = wrapFrame(data, lengths, releaseSegment, segments[position]);
+		if(frames[numOfFrames] == NULL)
+		{
+			releaseSegment(segments[position]);
+			continue;
+		}
+		numOfFrames++;
+	}
+	for(int i = 0; i < numOfViews; i++)
+		releaseSegment(views[i].segment);
+	free(segments);
+	free(records);
+	free(views);
+	return numOfFrames;
+}
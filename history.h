@@ -0,0 +1,120 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "socketcom.h"
+#include "frame.h"
+
+/*
+	Persistent chat history.
+	Every chat and private message frame gets appended to a segment file, which is mapped into memory with
+	MAP_SHARED - an append is a memcpy into the page cache and the kernel writes it back in its own time,
+	there's never an fsync in the way of a broadcast. Records hold the frame in every protocol version,
+	so replaying one means handing out a frame that points straight into the mapping, no copies and no
+	re-encoding. Replayed frames hold a reference to their segment, so it stays mapped until they're sent
+	even if it has been retired in the meantime.
+
+	Segments are named after the sequence number of their first record. Once one is full, it gets truncated
+	to its actual length and a new one is started, after which the oldest segments are retired (deleted)
+	until there's no more than the configured number of them, none older than the maximum age. Appends come
+	from every shard's broadcast path, so none of that filesystem work is done there. The history's own
+	thread keeps a spare segment created and mapped ahead of time, and starting a new segment only swaps the
+	spare in - the thread gives its file the proper name afterwards, truncates the sealed segment and
+	deletes the retired ones. Should the spare not be ready yet, records are handed back to the thread (up
+	to a segment's worth), which writes them into the spare once it has made it. A spare that still has its
+	temporary name on startup (with records in it) is the newest segment. Every HISTORY_INDEX_INTERVAL
+	records, a segment notes down the record's sequence number and offset in a sparse in-memory index, which
+	is what seeking by sequence number goes through. A replay looks at no more than HISTORY_REPLAY_SCAN
+	records per record it's asked for, so a type that's rare doesn't get the whole history scanned. Appends
+	only claim their space and sequence number under the lock and write the record after it, replays note
+	down the segments and where they end under it and scan them after it. On startup the existing segments
+	are scanned (which rebuilds their indexes), a torn record at the end of the last one is cut off and
+	appending carries on in it while it has room.
+
+	RECORD: length | type | time | v1 length | v2 length | target length | target | v1 frame | v2 frame | padding
+	        4        4      8      4           4           4               ...      ...        ...        to 8
+*/
+
+#define HISTORY_INDEX_INTERVAL 32
+#define HISTORY_REPLAY_SCAN 64
+#define HISTORY_SPARE_NAME "spare.tmp"
+#define MIN_HISTORY_SEGMENT_SIZE (64 * 1024)
+#define DEFAULT_HISTORY_SEGMENT_SIZE (8 * 1024 * 1024)
+#define DEFAULT_HISTORY_SEGMENTS 16
+#define DEFAULT_HISTORY_REPLAY 50
+
+typedef struct {
+	/* Set last, once the rest of the record is in - 0 means it's still being written */
+	_Atomic uint32_t length;
+	uint32_t type;
+	int64_t time;
+	uint32_t encodingLength[LATEST_PROTOCOL];
+	uint32_t targetLength;
+} historyRecord;
+
+typedef struct {
+	uint64_t sequence;
+	size_t offset;
+} historyIndexEntry;
+
+/* A record that was handed back to the history thread, with the length already in it */
+typedef struct historyPending {
+	struct historyPending *next;
+	char record[];
+} historyPending;
+
+typedef struct historySegment {
+	atomic_int references;
+	int fd;
+	char *map;
+	size_t size;
+	size_t end;
+	uint64_t firstSequence;
+	uint64_t count;
+	int64_t lastTime;
+	historyIndexEntry *index;
+	int indexLength;
+	int indexCapacity;
+	char path[PATH_MAX];
+	/* What the history thread still has to do with the segment, it's on the chore list while that isn't 0 */
+	int chores;
+	struct historySegment *nextChore;
+} historySegment;
+
+typedef struct {
+	pthread_mutex_t lock;
+	char *directory;
+	size_t segmentSize;
+	int maxSegments;
+	long maxAge;
+	historySegment **segments;
+	int length;
+	int capacity;
+	uint64_t nextSequence;
+	/* The history thread's side, all of it under the lock as well */
+	pthread_t thread;
+	pthread_cond_t wakeup;
+	int running;
+	int stopping;
+	int wantSpare;
+	historySegment *spare;
+	/* Records that came in while there was no spare, and whether the thread is moving them into one */
+	historyPending *firstPending;
+	historyPending *lastPending;
+	size_t pendingSize;
+	int filling;
+	historySegment *firstChore;
+	historySegment *lastChore;
+} history;
+
+int openHistory(history *h, char *directory, size_t segmentSize, int maxSegments, long maxAge);
+void closeHistory(history *h);
+int appendHistory(history *h, frame *f, uint32_t type, char *target);
+int replayHistory(history *h, uint32_t type, int count, frame **frames);
+
+#endif
@@ -0,0 +1,518 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+
+#include "socketcom.h"
+#include "metrics.h"
+
+#define checkError(expression, errorMessage)\
+do\
+{\
+	if(expression)\
+	{\
+		perror(errorMessage);\
+		exit(EXIT_FAILURE);\
+	}\
+} while(0);
+
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_THREADS 2
+#define DEFAULT_RATE 100
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_PRIVATE_PERCENT 10
+#define DEFAULT_MESSAGE_SIZE 64
+#define HANDSHAKE_TIMEOUT 30
+#define DRAIN_TIME 2
+#define MAX_EVENTS 64
+#define OUTGOING_SIZE (MAX_PREFIX_SIZE + MAX_PAYLOAD_SIZE)
+
+/* Bot phases - a bot only sends traffic once the server has taken its nick */
+#define HELLO_P 0
+#define NICK_P 1
+#define READY_P 2
+#define DEAD_P 3
+
+/*
+	Headless load generator.
+	Opens a number of bot connections to the server, takes every one of them through the same handshake as
+	the real client (a CON_F request offering a protocol version, followed by a NIC_F request for a unique
+	nick), and once all of them are in, sends chat and private messages at a fixed total rate for a while.
+
+	Every message carries the time it was sent (CLOCK_MONOTONIC, in nanoseconds) at the start of its text,
+	so every bot that receives it knows how long the server took to get it there - chat messages fan out to
+	every bot, so a single message yields as many latency samples as there are bots. Only messages sent
+	after the warmup count, the results are percentiles of that end-to-end latency and the throughput.
+
+	The bots are spread over a number of threads, each with its own epoll loop, and never block on a send:
+	a message the socket won't take stays in the bot's outgoing buffer until it's writable again, and the
+	bot sits out its turns until then (which shows up as skipped messages).
+*/
+
+struct bot {
+	int fd;
+	int id;
+	int phase;
+	int version;
+	char name[MAX_NAME_SIZE];
+	messageReader reader;
+	int outgoingStart;
+	int outgoingEnd;
+	char outgoing[OUTGOING_SIZE];
+};
+
+struct worker {
+	int id;
+	pthread_t thread;
+	int epollFD;
+	int numOfBots;
+	struct bot *bots;
+	int nextSender;
+	unsigned int seed;
+	/* Results - only read once the worker is done */
+	uint64_t sentRegular;
+	uint64_t sentPrivate;
+	uint64_t skipped;
+	uint64_t received;
+	uint64_t disconnected;
+	histogram latency;
+};
+
+struct benchmark {
+	char *host;
+	char *port;
+	int numOfClients;
+	int numOfWorkers;
+	int rate;
+	int duration;
+	int warmup;
+	int privatePercent;
+	int messageSize;
+	int protocol;
+	char prefix[16];
+	struct worker *workers;
+	atomic_int ready;
+	atomic_int failed;
+	/* Set by the main thread once every bot is in, the workers don't send before */
+	atomic_int started;
+	uint64_t measureStart;
+	uint64_t measureEnd;
+	uint64_t stopTime;
+};
+
+struct benchmark bench;
+
+uint64_t now(void);
+void *runWorker(void *arg);
+void connectBot(struct worker *worker, struct bot *bot);
+void killBot(struct worker *worker, struct bot *bot);
+int queueMessage(struct bot *bot, uint32_t type, char *payload);
+int flushBot(struct worker *worker, struct bot *bot);
+void serviceBot(struct worker *worker, struct bot *bot);
+void handleMessage(struct worker *worker, struct bot *bot, message *msg);
+void sendTraffic(struct worker *worker, uint64_t time);
+void printResults(void);
+
+int main(int argc, char *argv[]) {
+	bench.numOfClients = DEFAULT_CLIENTS;
+	bench.numOfWorkers = DEFAULT_THREADS;
+	bench.rate = DEFAULT_RATE;
+	bench.duration = DEFAULT_DURATION;
+	bench.warmup = DEFAULT_WARMUP;
+	bench.privatePercent = DEFAULT_PRIVATE_PERCENT;
+	bench.messageSize = DEFAULT_MESSAGE_SIZE;
+	bench.protocol = LATEST_PROTOCOL;
+
+	struct option options[] =
+	{
+		{"clients", required_argument, NULL, 'c'},
+		{"threads", required_argument, NULL, 't'},
+		{"rate", required_argument, NULL, 'r'},
+		{"duration", required_argument, NULL, 'd'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"private", required_argument, NULL, 'p'},
+		{"size", required_argument, NULL, 's'},
+		{"protocol", required_argument, NULL, 'v'},
+		{NULL, 0, NULL, 0}
+	};
+	int option;
+	while((option = getopt_long(argc, argv, "c:t:r:d:w:p:s:v:", options, NULL)) != -1)
+	{
+		switch(option)
+		{
+			case 'c':
+				bench.numOfClients = atoi(optarg);
+				break;
+			case 't':
+				bench.numOfWorkers = atoi(optarg);
+				break;
+			case 'r':
+				bench.rate = atoi(optarg);
+				break;
+			case 'd':
+				bench.duration = atoi(optarg);
+				break;
+			case 'w':
+				bench.warmup = atoi(optarg);
+				break;
+			case 'p':
+				bench.privatePercent = atoi(optarg);
+				break;
+			case 's':
+				bench.messageSize = atoi(optarg);
+				break;
+			case 'v':
+				bench.protocol = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [--clients N] [--threads N] [--rate MESSAGES_PER_SECOND] [--duration SECONDS] [--warmup SECONDS] [--private PERCENT] [--size BYTES] [--protocol 1|2] host port\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if(argc - optind != 2)
+	{
+		fprintf(stderr, "Usage: %s [options] host port\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	bench.host = argv[optind];
+	bench.port = argv[optind + 1];
+	if(bench.numOfClients < 1 || bench.numOfWorkers < 1 || bench.numOfWorkers > bench.numOfClients || bench.rate < 1 || bench.duration < 1 || bench.warmup < 0)
+	{
+		fprintf(stderr, "There has to be at least one client per thread, and the rate and duration have to be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	if(bench.privatePercent < 0 || bench.privatePercent > 100 || bench.messageSize < 32 || bench.messageSize > MAX_PAYLOAD_SIZE - MAX_NAME_SIZE || bench.protocol < PROTOCOL_V1 || bench.protocol > LATEST_PROTOCOL)
+	{
+		fprintf(stderr, "The private percentage goes from 0 to 100, messages from 32 to %d bytes and the protocol from %d to %d\n", MAX_PAYLOAD_SIZE - MAX_NAME_SIZE, PROTOCOL_V1, LATEST_PROTOCOL);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	struct rlimit descriptorLimit;
+	if(getrlimit(RLIMIT_NOFILE, &descriptorLimit) == 0 && descriptorLimit.rlim_cur < descriptorLimit.rlim_max)
+	{
+		descriptorLimit.rlim_cur = descriptorLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &descriptorLimit);
+	}
+
+	/* Nicks carry the process ID, so several load generators can share a server */
+	snprintf(bench.prefix, sizeof(bench.prefix), "lg%d_", (int)(getpid() % 100000));
+	atomic_init(&bench.ready, 0);
+	atomic_init(&bench.failed, 0);
+	atomic_init(&bench.started, 0);
+
+	bench.workers = calloc(bench.numOfWorkers, sizeof(struct worker));
+	checkError(bench.workers == NULL, "workers calloc");
+	uint64_t connectStart = now();
+	for(int i = 0; i < bench.numOfWorkers; i++)
+	{
+		struct worker *worker = &bench.workers[i];
+		worker->id = i;
+		worker->seed = getpid() + i;
+		worker->numOfBots = bench.numOfClients / bench.numOfWorkers + (i < bench.numOfClients % bench.numOfWorkers);
+		worker->bots = calloc(worker->numOfBots, sizeof(struct bot));
+		checkError(worker->bots == NULL, "bots calloc");
+		worker->epollFD = epoll_create1(0);
+		checkError(worker->epollFD == -1, "epoll_create1");
+		for(int j = 0; j < worker->numOfBots; j++)
+		{
+			worker->bots[j].id = j * bench.numOfWorkers + i;
+			connectBot(worker, &worker->bots[j]);
+		}
+		checkError(pthread_create(&worker->thread, NULL, runWorker, worker) != 0, "pthread_create");
+	}
+
+	/* Waiting for every bot to get through the handshake */
+	while(atomic_load(&bench.ready) + atomic_load(&bench.failed) < bench.numOfClients)
+	{
+		if(now() - connectStart > HANDSHAKE_TIMEOUT * 1000000000ULL)
+		{
+			fprintf(stderr, "Only %d of %d clients got through the handshake in %d seconds\n", atomic_load(&bench.ready), bench.numOfClients, HANDSHAKE_TIMEOUT);
+			exit(EXIT_FAILURE);
+		}
+		usleep(1000);
+	}
+	if(atomic_load(&bench.failed) > 0)
+	{
+		fprintf(stderr, "%d of %d clients couldn't connect\n", atomic_load(&bench.failed), bench.numOfClients);
+		exit(EXIT_FAILURE);
+	}
+	printf("Connected %d clients in %.2f s\n", bench.numOfClients, (now() - connectStart) / 1e9);
+	fflush(stdout);
+
+	uint64_t start = now();
+	bench.measureStart = start + bench.warmup * 1000000000ULL;
+	bench.measureEnd = bench.measureStart + bench.duration * 1000000000ULL;
+	bench.stopTime = bench.measureEnd + DRAIN_TIME * 1000000000ULL;
+	atomic_store(&bench.started, 1);
+
+	for(int i = 0; i < bench.numOfWorkers; i++)
+		pthread_join(bench.workers[i].thread, NULL);
+	printResults();
+
+	for(int i = 0; i < bench.numOfWorkers; i++)
+	{
+		for(int j = 0; j < bench.workers[i].numOfBots; j++)
+		{
+			if(bench.workers[i].bots[j].phase != DEAD_P)
+				close(bench.workers[i].bots[j].fd);
+		}
+		close(bench.workers[i].epollFD);
+		free(bench.workers[i].bots);
+	}
+	free(bench.workers);
+	exit(EXIT_SUCCESS);
+}
+
+uint64_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+void *runWorker(void *arg) {
+	struct worker *worker = arg;
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t nextSend = 0;
+	while(1)
+	{
+		/* Sleeping until the next message is due, or for a millisecond while waiting for the start */
+		int timeout = 1;
+		if(atomic_load(&bench.started))
+		{
+			uint64_t time = now();
+			if(time >= bench.stopTime)
+				break;
+			if(nextSend == 0)
+				nextSend = time;
+			uint64_t interval = 1000000000ULL * bench.numOfWorkers / bench.rate;
+			while(nextSend <= time && nextSend < bench.measureEnd)
+			{
+				sendTraffic(worker, nextSend);
+				nextSend += interval;
+			}
+			uint64_t deadline = (nextSend < bench.measureEnd) ? nextSend : bench.stopTime;
+			timeout = (deadline > time) ? (deadline - time + 999999) / 1000000 : 0;
+		}
+
+		int numOfEvents = epoll_wait(worker->epollFD, events, MAX_EVENTS, timeout);
+		if(numOfEvents == -1 && errno == EINTR)
+			continue;
+		checkError(numOfEvents == -1, "epoll_wait");
+		for(int i = 0; i < numOfEvents; i++)
+		{
+			struct bot *bot = events[i].data.ptr;
+			if(bot->phase != DEAD_P && (events[i].events & EPOLLOUT))
+				flushBot(worker, bot);
+			if(bot->phase != DEAD_P && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+				serviceBot(worker, bot);
+		}
+	}
+	return NULL;
+}
+
+/* The connect is non-blocking, the hello goes out once the socket reports that it's writable */
+void connectBot(struct worker *worker, struct bot *bot) {
+	bot->phase = HELLO_P;
+	bot->version = PROTOCOL_V1;
+	strcpy(bot->name, "CLIENT");
+	initMessageReader(&bot->reader);
+	bot->outgoingStart = bot->outgoingEnd = 0;
+	bot->fd = connectToServer(bench.host, bench.port);
+	if(bot->fd == -1)
+	{
+		bot->phase = DEAD_P;
+		atomic_fetch_add(&bench.failed, 1);
+		return;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = bot;
+	checkError(epoll_ctl(worker->epollFD, EPOLL_CTL_ADD, bot->fd, &event) == -1, "epoll_ctl");
+
+	char version[16];
+	sprintf(version, "%d", bench.protocol);
+	queueMessage(bot, REQ_M | CON_F, version);
+}
+
+void killBot(struct worker *worker, struct bot *bot) {
+	if(bot->phase == READY_P)
+		worker->disconnected++;
+	else if(bot->phase != DEAD_P)
+		atomic_fetch_add(&bench.failed, 1);
+	bot->phase = DEAD_P;
+	close(bot->fd);
+}
+
+/* Returns -1 if the last message hasn't gone out yet, the bot has to wait for its socket */
+int queueMessage(struct bot *bot, uint32_t type, char *payload) {
+	if(bot->outgoingEnd != bot->outgoingStart)
+		return -1;
+	bot->outgoingStart = 0;
+	bot->outgoingEnd = encodeMessageStream(bot->outgoing, bot->version, type, bot->name, payload);
+	return 0;
+}
+
+int flushBot(struct worker *worker, struct bot *bot) {
+	while(bot->outgoingStart < bot->outgoingEnd)
+	{
+		int sent = send(bot->fd, bot->outgoing + bot->outgoingStart, bot->outgoingEnd - bot->outgoingStart, MSG_NOSIGNAL);
+		if(sent == -1)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+				return 0;
+			killBot(worker, bot);
+			return -1;
+		}
+		bot->outgoingStart += sent;
+	}
+	bot->outgoingStart = bot->outgoingEnd = 0;
+	return 0;
+}
+
+void serviceBot(struct worker *worker, struct bot *bot) {
+	while(bot->phase != DEAD_P)
+	{
+		int received = fillMessageReader(&bot->reader, bot->fd);
+		if(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(received <= 0)
+		{
+			killBot(worker, bot);
+			return;
+		}
+		char *messageStart;
+		int length;
+		while(bot->phase != DEAD_P && (length = nextMessage(&bot->reader, &messageStart)) > 0)
+		{
+			message msg = decodeMessage(messageStart, bot->reader.version);
+			handleMessage(worker, bot, &msg);
+		}
+		if(length == -1)
+		{
+			killBot(worker, bot);
+			return;
+		}
+		if(bot->reader.drained)
+			return;
+	}
+}
+
+void handleMessage(struct worker *worker, struct bot *bot, message *msg) {
+	uint32_t type = msg->type;
+	if(type == (RES_M | SCS_S | CON_F) && bot->phase == HELLO_P)
+	{
+		/* Same as the client, everything after this response comes in the version the server picked */
+		bot->version = atoi(msg->payload);
+		if(bot->version != PROTOCOL_V1)
+			upgradeMessageReader(&bot->reader, bot->version);
+		char nick[MAX_NAME_SIZE];
+		snprintf(nick, sizeof(nick), "%s%d", bench.prefix, bot->id);
+		bot->phase = NICK_P;
+		if(queueMessage(bot, REQ_M | NIC_F, nick) == 0)
+			flushBot(worker, bot);
+	}
+	else if((type & MASK_F) == NIC_F && (type & MASK_M) == RES_M && bot->phase == NICK_P)
+	{
+		if((type & MASK_S) != SCS_S)
+		{
+			killBot(worker, bot);
+			return;
+		}
+		readArgs(msg->payload, bot->name, NULL);
+		bot->phase = READY_P;
+		atomic_fetch_add(&bench.ready, 1);
+	}
+	else if(type == (SIG_M | REG_F) || type == (SIG_M | PRV_F))
+	{
+		/* Only our own bots' messages from the measured window count, there might be other traffic (or a history replay) */
+		if(strncmp(msg->name, bench.prefix, strlen(bench.prefix)) != 0)
+			return;
+		uint64_t sentAt = strtoull(msg->payload, NULL, 10);
+		if(sentAt < bench.measureStart || sentAt >= bench.measureEnd)
+			return;
+		worker->received++;
+		recordValue(&worker->latency, now() - sentAt);
+	}
+}
+
+/* Sends the next message from the next ready bot of the worker, the time it's due at is what gets measured */
+void sendTraffic(struct worker *worker, uint64_t time) {
+	struct bot *bot = NULL;
+	for(int i = 0; i < worker->numOfBots && bot == NULL; i++)
+	{
+		struct bot *candidate = &worker->bots[worker->nextSender];
+		worker->nextSender = (worker->nextSender + 1) % worker->numOfBots;
+		if(candidate->phase == READY_P)
+			bot = candidate;
+	}
+	if(bot == NULL)
+		return;
+
+	/* The timestamp leads, digits and spaces make it through the server's sanitizing as they are */
+	int measured = time >= bench.measureStart;
+	int private = rand_r(&worker->seed) % 100 < bench.privatePercent;
+	char payload[MAX_PAYLOAD_SIZE];
+	int length = 0;
+	if(private)
+		length = sprintf(payload, "%s%d ", bench.prefix, rand_r(&worker->seed) % bench.numOfClients);
+	char *text = payload + length;
+	length += sprintf(text, "%llu ", (unsigned long long)time);
+	while(length < bench.messageSize + (text - payload))
+		payload[length++] = 'x';
+	payload[length] = '\0';
+
+	if(queueMessage(bot, REQ_M | (private ? PRV_F : REG_F), payload) == -1)
+	{
+		if(measured)
+			worker->skipped++;
+		return;
+	}
+	if(measured)
+	{
+		if(private)
+			worker->sentPrivate++;
+		else
+			worker->sentRegular++;
+	}
+	flushBot(worker, bot);
+}
+
+void printResults(void) {
+	uint64_t sentRegular = 0, sentPrivate = 0, skipped = 0, received = 0, disconnected = 0;
+	histogram *latency = calloc(1, sizeof(histogram));
+	checkError(latency == NULL, "histogram calloc");
+	for(int i = 0; i < bench.numOfWorkers; i++)
+	{
+		struct worker *worker = &bench.workers[i];
+		sentRegular += worker->sentRegular;
+		sentPrivate += worker->sentPrivate;
+		skipped += worker->skipped;
+		received += worker->received;
+		disconnected += worker->disconnected;
+		mergeHistogram(latency, &worker->latency);
+	}
+
+	/* Every bot gets every chat message (the sender included), a private message has one recipient */
+	uint64_t expected = sentRegular * bench.numOfClients + sentPrivate;
+	printf("Sent %llu chat and %llu private messages in %d s (%.1f messages/s), %llu skipped on full sockets\n", (unsigned long long)sentRegular,
+		(unsigned long long)sentPrivate, bench.duration, (double)(sentRegular + sentPrivate) / bench.duration, (unsigned long long)skipped);
+	printf("Received %llu of %llu expected deliveries (%.1f deliveries/s), %llu client(s) disconnected\n", (unsigned long long)received,
+		(unsigned long long)expected, (double)received / bench.duration, (unsigned long long)disconnected);
+	printf("Fan-out latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", histogramPercentile(latency, 0.5) / 1e3, histogramPercentile(latency, 0.9) / 1e3,
+		histogramPercentile(latency, 0.99) / 1e3, histogramPercentile(latency, 0.999) / 1e3, histogramPercentile(latency, 1.0) / 1e3);
+	free(latency);
+}
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "socketcom.h"
+#include "resolver.h"
+#include "logger.h"
+
+static const int eventLevels[LOG_EVENTS] = {INFO_L, INFO_L, INFO_L, WARN_L, WARN_L, WARN_L, DEBUG_L};
+static const char *eventNames[LOG_EVENTS] = {"started", "connected", "disconnected", "malformed", "slow", "refused", "nick"};
+static const char *levelNames[] = {"debug", "info", "warn", "error"};
+static const char *levelLabels[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+/*
+	The ring is a bounded multi-producer queue: every record carries a sequence number that tells producers
+	whether the slot is free for the position they're claiming and tells the consumer whether the record at
+	its position has been completely written yet.
+*/
+static struct {
+	loggerConfig config;
+	logRecord *ring;
+	atomic_size_t tail;
+	size_t head;
+	atomic_size_t dropped;
+	atomic_uint occurrences[LOG_EVENTS];
+	atomic_int running;
+	pthread_t thread;
+	FILE *file;
+	long fileSize;
+} logger;
+
+static void copyText(char *destination, char *source, int size) {
+	if(source == NULL)
+		source = "";
+	strncpy(destination, source, size - 1);
+	destination[size - 1] = '\0';
+}
+
+static int openLogFile(char *mode) {
+	if(logger.config.path == NULL)
+	{
+		logger.file = stdout;
+		logger.fileSize = 0;
+		return 0;
+	}
+	logger.file = fopen(logger.config.path, mode);
+	if(logger.file == NULL)
+	{
+		/* Losing the log is better than losing the server */
+		logger.file = stderr;
+		return -1;
+	}
+	fseek(logger.file, 0, SEEK_END);
+	logger.fileSize = ftell(logger.file);
+	return 0;
+}
+
+/* path.N-1 -> path.N, ..., path -> path.1, without any rotated files the log just starts over */
+static void rotateLogFile(void) {
+	if(logger.file != stderr)
+		fclose(logger.file);
+	if(logger.config.maxFiles == 0)
+	{
+		openLogFile("w");
+		return;
+	}
+	char from[PATH_MAX], to[PATH_MAX];
+	for(int i = logger.config.maxFiles - 1; i >= 1; i--)
+	{
+		snprintf(from, sizeof(from), "%s.%d", logger.config.path, i);
+		snprintf(to, sizeof(to), "%s.%d", logger.config.path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", logger.config.path);
+	rename(logger.config.path, to);
+	openLogFile("a");
+}
+
+static void writeLine(char *line, int length) {
+	if(logger.config.path != NULL && logger.file != stderr && logger.fileSize + length > logger.config.maxFileSize)
+		rotateLogFile();
+	fwrite(line, 1, length, logger.file);
+	logger.fileSize += length;
+}
+
+static int formatRecord(logRecord *record, char *line, int size) {
+	struct tm date;
+	localtime_r(&record->time.tv_sec, &date);
+	int length = strftime(line, size, "%Y-%m-%d %H:%M:%S", &date);
+	length += snprintf(line + length, size - length, ".%03ld %s ", record->time.tv_nsec / 1000000, levelLabels[eventLevels[record->event]]);
+	if(record->shardId >= 0)
+		length += snprintf(line + length, size - length, "[shard %d] ", record->shardId);
+
+	/* The connection events carry the client's address, and its numeric host for looking up the name */
+	char hostname[NI_MAXHOST + 3] = "";
+	if(logger.config.resolver != NULL && record->extra[0] != '\0' && record->event != NICK_E)
+	{
+		strcpy(hostname, " (");
+		if(cachedHostname(logger.config.resolver, record->extra, hostname + 2, NI_MAXHOST) == 0)
+			strcat(hostname, ")");
+		else
+			hostname[0] = '\0';
+	}
+
+	switch(record->event)
+	{
+		case STARTED_E:
+			length += snprintf(line + length, size - length, "Server successfully started on port %s with %ld thread(s)\n", record->text, record->number);
+			break;
+		case CONNECTED_E:
+			length += snprintf(line + length, size - length, "New connection from %s%s\n", record->text, hostname);
+			break;
+		case DISCONNECTED_E:
+			length += snprintf(line + length, size - length, "Client disconnected from %s%s\n", record->text, hostname);
+			break;
+		case MALFORMED_E:
+			length += snprintf(line + length, size - length, "Client sent a malformed message from %s%s\n", record->text, hostname);
+			break;
+		case SLOW_E:
+			length += snprintf(line + length, size - length, "Dropping a client that can't keep up from %s%s\n", record->text, hostname);
+			break;
+		case REFUSED_E:
+			length += snprintf(line + length, size - length, "A client failed to connect to the server\n");
+			break;
+		case NICK_E:
+			length += snprintf(line + length, size - length, "%s is now known as %s\n", record->text, record->extra);
+			break;
+	}
+	return (length < size) ? length : size - 1;
+}
+
+/* Returns the number of records written out */
+static int drainLog(void) {
+	char line[1024];
+	int drained = 0;
+	size_t dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+	if(dropped > 0)
+	{
+		int length = snprintf(line, sizeof(line), "%zu log record(s) dropped, the log couldn't keep up\n", dropped);
+		writeLine(line, length);
+		drained++;
+	}
+	while(1)
+	{
+		logRecord *record = &logger.ring[logger.head & (LOG_RING_SIZE - 1)];
+		if(atomic_load_explicit(&record->sequence, memory_order_acquire) != logger.head + 1)
+			break;
+		writeLine(line, formatRecord(record, line, sizeof(line)));
+		atomic_store_explicit(&record->sequence, logger.head + LOG_RING_SIZE, memory_order_release);
+		logger.head++;
+		drained++;
+	}
+	return drained;
+}
+
+/* Producers never wait on the logger, so it polls - an idle ring costs a wakeup every flush interval */
+static void *runLogger(void *arg) {
+	/* The logger's state is global, there's nothing to hand the thread */
+	(void)arg;
+	struct timespec interval = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+	while(1)
+	{
+		if(drainLog() > 0)
+			fflush(logger.file);
+		else if(!atomic_load(&logger.running))
+			break;
+		else
+			nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+void defaultLoggerConfig(loggerConfig *config) {
+	config->level = INFO_L;
+	config->path = NULL;
+	config->maxFileSize = DEFAULT_LOG_FILE_SIZE;
+	config->maxFiles = DEFAULT_LOG_FILES;
+	for(int i = 0; i < LOG_EVENTS; i++)
+		config->sampling[i] = 1;
+	config->resolver = NULL;
+}
+
+/* Has to happen before any of the threads that log start */
+int startLogger(loggerConfig *config) {
+	logger.config = *config;
+	logger.ring = malloc(LOG_RING_SIZE * sizeof(logRecord));
+	if(logger.ring == NULL)
+		return -1;
+	for(size_t i = 0; i < LOG_RING_SIZE; i++)
+		atomic_init(&logger.ring[i].sequence, i);
+	atomic_init(&logger.tail, 0);
+	logger.head = 0;
+	atomic_init(&logger.dropped, 0);
+	for(int i = 0; i < LOG_EVENTS; i++)
+		atomic_init(&logger.occurrences[i], 0);
+	atomic_init(&logger.running, 1);
+	openLogFile("a");
+	if(pthread_create(&logger.thread, NULL, runLogger, NULL) != 0)
+	{
+		free(logger.ring);
+		logger.ring = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes out whatever's still in the ring, nothing may log anymore once this is called */
+void stopLogger(void) {
+	if(logger.ring == NULL)
+		return;
+	atomic_store(&logger.running, 0);
+	pthread_join(logger.thread, NULL);
+	if(logger.file != stdout && logger.file != stderr)
+		fclose(logger.file);
+	free(logger.ring);
+	logger.ring = NULL;
+}
+
+void logEvent(int event, int shardId, char *text, char *extra, long number) {
+	if(logger.ring == NULL || eventLevels[event] < logger.config.level)
+		return;
+	int sampling = logger.config.sampling[event];
+	if(sampling > 1 && atomic_fetch_add_explicit(&logger.occurrences[event], 1, memory_order_relaxed) % sampling != 0)
+		return;
+
+	/* Claiming a slot - a full ring drops the record instead of waiting for the logger */
+	size_t position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+	logRecord *record;
+	while(1)
+	{
+		record = &logger.ring[position & (LOG_RING_SIZE - 1)];
+		intptr_t difference = (intptr_t)atomic_load_explicit(&record->sequence, memory_order_acquire) - (intptr_t)position;
+		if(difference == 0)
+		{
+			if(atomic_compare_exchange_weak_explicit(&logger.tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(difference < 0)
+		{
+			atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->event = event;
+	record->shardId = shardId;
+	record->number = number;
+	copyText(record->text, text, sizeof(record->text));
+	copyText(record->extra, extra, sizeof(record->extra));
+	atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+}
+
+int logLevelByName(char *name) {
+	for(int i = DEBUG_L; i <= ERROR_L; i++)
+	{
+		if(strcmp(name, levelNames[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int logEventByName(char *name) {
+	for(int i = 0; i < LOG_EVENTS; i++)
+	{
+		if(strcmp(name, eventNames[i]) == 0)
+			return i;
+	}
+	return -1;
+}
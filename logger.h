@@ -0,0 +1,71 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <time.h>
+#include <stdatomic.h>
+
+#include "socketcom.h"
+#include "resolver.h"
+
+/*
+	Asynchronous server log.
+	Logging an event only fills in a fixed size binary record in a lock-free ring shared by all the threads,
+	no formatting and no I/O. A logger thread takes the records out in order, formats them and writes them to
+	stdout or to a log file, which gets rotated once it grows past the size limit (path -> path.1 -> path.2 ...).
+
+	Every event has a level, events below the configured level cost a single comparison. Events can also be
+	sampled, so that only one in every N occurrences gets logged. When the ring is full the record is dropped
+	rather than waited for, and the next line the logger writes says how many went missing.
+	Since the logger thread is the one formatting the lines, it's also the one asking the resolver for
+	hostnames, which keeps that lock off the event loops as well.
+*/
+
+#define LOG_RING_SIZE 4096
+#define LOG_FLUSH_INTERVAL_MS 10
+#define DEFAULT_LOG_FILE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_LOG_FILES 4
+
+/* Levels */
+#define DEBUG_L 0
+#define INFO_L 1
+#define WARN_L 2
+#define ERROR_L 3
+
+/* Events */
+#define STARTED_E 0
+#define CONNECTED_E 1
+#define DISCONNECTED_E 2
+#define MALFORMED_E 3
+#define SLOW_E 4
+#define REFUSED_E 5
+#define NICK_E 6
+#define LOG_EVENTS 7
+
+/* What the strings and the number hold depends on the event */
+typedef struct {
+	atomic_size_t sequence;
+	struct timespec time;
+	int event;
+	int shardId;
+	long number;
+	char text[MAX_PEER_SIZE];
+	char extra[MAX_HOST_SIZE];
+} logRecord;
+
+typedef struct {
+	int level;
+	char *path;
+	long maxFileSize;
+	int maxFiles;
+	int sampling[LOG_EVENTS];
+	resolver *resolver;
+} loggerConfig;
+
+void defaultLoggerConfig(loggerConfig *config);
+int startLogger(loggerConfig *config);
+void stopLogger(void);
+void logEvent(int event, int shardId, char *text, char *extra, long number);
+int logLevelByName(char *name);
+int logEventByName(char *name);
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memberset.h"
+
+/* Position of the slot ID, or of where it would have to go */
+static int findPosition(memberSet *set, int slotId) {
+	int low = 0, high = set->length;
+	while(low < high)
+	{
+		int middle = (low + high) / 2;
+		if(set->slots[middle] < slotId)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+void initMemberSet(memberSet *set) {
+	set->slots = NULL;
+	set->length = 0;
+	set->capacity = 0;
+}
+
+void freeMemberSet(memberSet *set) {
+	free(set->slots);
+	initMemberSet(set);
+}
+
+/* Returns 1 if the slot ID got added, 0 if it was already there and -1 if the set couldn't grow */
+int addMember(memberSet *set, int slotId) {
+	int position = findPosition(set, slotId);
+	if(position < set->length && set->slots[position] == slotId)
+		return 0;
+	if(set->length == set->capacity)
+	{
+		int capacity = (set->capacity == 0) ? 8 : 2 * set->capacity;
+		int *slots = realloc(set->slots, capacity * sizeof(int));
+		if(slots == NULL)
+			return -1;
+		set->slots = slots;
+		set->capacity = capacity;
+	}
+	memmove(set->slots + position + 1, set->slots + position, (set->length - position) * sizeof(int));
+	set->slots[position] = slotId;
+	set->length++;
+	return 1;
+}
+
+/* Returns -1 if the slot ID wasn't in the set */
+int removeMember(memberSet *set, int slotId) {
+	int position = findPosition(set, slotId);
+	if(position == set->length || set->slots[position] != slotId)
+		return -1;
+	memmove(set->slots + position, set->slots + position + 1, (set->length - position - 1) * sizeof(int));
+	set->length--;
+	return 0;
+}
+
+int hasMember(memberSet *set, int slotId) {
+	int position = findPosition(set, slotId);
+	return position < set->length && set->slots[position] == slotId;
+}
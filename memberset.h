@@ -0,0 +1,23 @@
+#ifndef _MEMBERSET_H_
+#define _MEMBERSET_H_
+
+/*
+	Compact set of connection slot IDs.
+	The IDs are kept in a sorted array, so membership checks are a binary search, and walking the members
+	touches nothing but one contiguous array - fanning a message out costs as much as the set is big,
+	not as much as the whole connection table.
+*/
+
+typedef struct {
+	int *slots;
+	int length;
+	int capacity;
+} memberSet;
+
+void initMemberSet(memberSet *set);
+void freeMemberSet(memberSet *set);
+int addMember(memberSet *set, int slotId);
+int removeMember(memberSet *set, int slotId);
+int hasMember(memberSet *set, int slotId);
+
+#endif
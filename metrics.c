@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define bumpValue(value, n) atomic_store_explicit(&(value), atomic_load_explicit(&(value), memory_order_relaxed) + (n), memory_order_relaxed)
+#define readValue(value) atomic_load_explicit(&(value), memory_order_relaxed)
+
+static const char *counterNames[COUNTERS] = {"accepts", "disconnects", "frames_in", "frames_out", "bytes_in", "bytes_out", "partial_sends", "dropped_frames", "slow_clients", "envelopes_posted", "envelopes_drained", "queued_bytes"};
+static const char *timerNames[TIMERS] = {"handle_regular", "handle_private", "handle_connect", "handle_nickname", "handle_join", "handle_part", "handle_list", "handle_channel", "loop_iteration"};
+
+/* Values below 2^HISTOGRAM_SUB_BITS get a bucket each, above that every power of two gets the same number of them */
+static int bucketIndex(uint64_t value) {
+	if(value < (1 << HISTOGRAM_SUB_BITS))
+		return value;
+	int exponent = 63 - __builtin_clzll(value);
+	if(exponent >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+	return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* The highest value that ends up in the bucket */
+static uint64_t bucketLimit(int index) {
+	if(index < (1 << HISTOGRAM_SUB_BITS))
+		return index;
+	int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)((1 << HISTOGRAM_SUB_BITS) + (index & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+	return low + (1ULL << shift) - 1;
+}
+
+uint64_t histogramPercentile(histogram *h, double quantile) {
+	uint64_t count = readValue(h->count);
+	if(count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(quantile * count + 0.5), seen = 0;
+	if(rank == 0)
+		rank = 1;
+	for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += readValue(h->buckets[i]);
+		if(seen >= rank)
+		{
+			uint64_t limit = bucketLimit(i), max = readValue(h->max);
+			return (limit < max) ? limit : max;
+		}
+	}
+	return readValue(h->max);
+}
+
+void initMetrics(metrics *m) {
+	memset(m, 0, sizeof(metrics));
+}
+
+void startTimer(struct timespec *start) {
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void stopTimer(metrics *m, int timer, struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	recordTime(m, timer, (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec);
+}
+
+void recordTime(metrics *m, int timer, uint64_t nanoseconds) {
+	recordValue(&m->timers[timer], nanoseconds);
+}
+
+/* Single writer only, same as the counters */
+void recordValue(histogram *h, uint64_t value) {
+	bumpValue(h->buckets[bucketIndex(value)], 1);
+	bumpValue(h->count, 1);
+	bumpValue(h->total, value);
+	if(value > readValue(h->max))
+		atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+/* Adds a histogram to the total, which isn't shared with anyone */
+void mergeHistogram(histogram *total, histogram *h) {
+	for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bumpValue(total->buckets[i], readValue(h->buckets[i]));
+	bumpValue(total->count, readValue(h->count));
+	bumpValue(total->total, readValue(h->total));
+	if(readValue(h->max) > readValue(total->max))
+		atomic_store_explicit(&total->max, readValue(h->max), memory_order_relaxed);
+}
+
+/* Adds a shard's metrics to the total, which isn't shared with anyone */
+void sumMetrics(metrics *total, metrics *m) {
+	for(int i = 0; i < COUNTERS; i++)
+		bumpValue(total->counters[i], readValue(m->counters[i]));
+	for(int i = 0; i < TIMERS; i++)
+		mergeHistogram(&total->timers[i], &m->timers[i]);
+}
+
+/* Counters are NAME VALUE, timers are NAME count=N mean=NS p50=NS p90=NS p99=NS p999=NS max=NS */
+void writeMetrics(FILE *out, metrics *m) {
+	for(int i = 0; i < COUNTERS; i++)
+		fprintf(out, "%s %llu\n", counterNames[i], (unsigned long long)readValue(m->counters[i]));
+	for(int i = 0; i < TIMERS; i++)
+	{
+		histogram *h = &m->timers[i];
+		uint64_t count = readValue(h->count);
+		fprintf(out, "%s_ns count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n", timerNames[i], (unsigned long long)count,
+			(unsigned long long)((count > 0) ? readValue(h->total) / count : 0), (unsigned long long)histogramPercentile(h, 0.5), (unsigned long long)histogramPercentile(h, 0.9),
+			(unsigned long long)histogramPercentile(h, 0.99), (unsigned long long)histogramPercentile(h, 0.999), (unsigned long long)readValue(h->max));
+	}
+}
+
+static void *runStatsEndpoint(void *arg) {
+	statsEndpoint *endpoint = arg;
+	while(1)
+	{
+		int connection = accept(endpoint->fd, NULL, NULL);
+		if(connection == -1)
+		{
+			/* Shutting the listener down is how the endpoint gets stopped */
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		FILE *out = fdopen(connection, "w");
+		if(out == NULL)
+		{
+			close(connection);
+			continue;
+		}
+		endpoint->report(out, endpoint->arg);
+		fclose(out);
+	}
+	return NULL;
+}
+
+/*
+	A stale socket from an earlier run gets replaced, anything else at the path is left alone. The new one is
+	only made accessible to the owner before it starts listening, so nobody else can connect in between.
+*/
+int startStatsEndpoint(statsEndpoint *endpoint, char *path, void (*report)(FILE *out, void *arg), void *arg) {
+	struct sockaddr_un address;
+	if(strlen(path) >= sizeof(address.sun_path))
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	endpoint->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(endpoint->fd == -1)
+		return -1;
+	struct stat status;
+	if(lstat(path, &status) == 0)
+	{
+		if(!S_ISSOCK(status.st_mode))
+			errno = EEXIST;
+		if(!S_ISSOCK(status.st_mode) || unlink(path) == -1)
+		{
+			close(endpoint->fd);
+			return -1;
+		}
+	}
+	if(bind(endpoint->fd, (struct sockaddr*)&address, sizeof(address)) == -1)
+	{
+		close(endpoint->fd);
+		return -1;
+	}
+	if(chmod(path, 0600) == -1 || listen(endpoint->fd, 16) == -1)
+	{
+		close(endpoint->fd);
+		unlink(path);
+		return -1;
+	}
+	endpoint->path = path;
+	endpoint->report = report;
+	endpoint->arg = arg;
+	if(pthread_create(&endpoint->thread, NULL, runStatsEndpoint, endpoint) != 0)
+	{
+		close(endpoint->fd);
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+void stopStatsEndpoint(statsEndpoint *endpoint) {
+	shutdown(endpoint->fd, SHUT_RDWR);
+	pthread_join(endpoint->thread, NULL);
+	close(endpoint->fd);
+	unlink(endpoint->path);
+}
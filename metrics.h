@@ -0,0 +1,92 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+	Server metrics.
+	Every shard keeps its own counters and latency histograms, which only the shard itself ever writes,
+	so recording is a plain load and store (relaxed atomics, which is what lets the stats thread read
+	them at any time) - no locked instructions and no cache lines bouncing between cores. Readers add
+	the shards up when they're asked for a report.
+
+	The histograms are log-linear like HdrHistogram: every power of two is split into 2^HISTOGRAM_SUB_BITS
+	buckets, so a recorded time is off by at most 1 / 2^HISTOGRAM_SUB_BITS (about 6%) at any magnitude.
+	Times are in nanoseconds, anything above 2^HISTOGRAM_MAX_BITS (about four and a half hours) lands in
+	the last bucket.
+
+	The stats endpoint is a UNIX socket that only the server's user can connect to. Every connection gets
+	a plain text report (one metric per line) and is closed, so something like `nc -U PATH` reads it.
+*/
+
+/* Counters - the ones ending up in gauges are adjusted both ways */
+#define ACCEPTS_C 0
+#define DISCONNECTS_C 1
+#define FRAMES_IN_C 2
+#define FRAMES_OUT_C 3
+#define BYTES_IN_C 4
+#define BYTES_OUT_C 5
+#define PARTIAL_SENDS_C 6
+#define DROPPED_FRAMES_C 7
+#define SLOW_CLIENTS_C 8
+#define ENVELOPES_POSTED_C 9
+#define ENVELOPES_DRAINED_C 10
+#define QUEUED_BYTES_C 11
+#define COUNTERS 12
+
+/* Timers - one latency histogram each */
+#define REGULAR_T 0
+#define PRIVATE_T 1
+#define CONNECT_T 2
+#define NICKNAME_T 3
+#define JOIN_T 4
+#define PART_T 5
+#define LIST_T 6
+#define CHANNEL_T 7
+#define LOOP_T 8
+#define TIMERS 9
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 44
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/* Single writer only - the counter's owner */
+#define addCounter(m, counter, n) atomic_store_explicit(&(m)->counters[counter], atomic_load_explicit(&(m)->counters[counter], memory_order_relaxed) + (uint64_t)(n), memory_order_relaxed)
+
+typedef struct {
+	atomic_uint_least64_t buckets[HISTOGRAM_BUCKETS];
+	atomic_uint_least64_t count;
+	atomic_uint_least64_t total;
+	atomic_uint_least64_t max;
+} histogram;
+
+typedef struct {
+	atomic_uint_least64_t counters[COUNTERS];
+	histogram timers[TIMERS];
+} metrics;
+
+typedef struct {
+	int fd;
+	char *path;
+	pthread_t thread;
+	void (*report)(FILE *out, void *arg);
+	void *arg;
+} statsEndpoint;
+
+void initMetrics(metrics *m);
+void startTimer(struct timespec *start);
+void stopTimer(metrics *m, int timer, struct timespec *start);
+void recordTime(metrics *m, int timer, uint64_t nanoseconds);
+void recordValue(histogram *h, uint64_t value);
+void mergeHistogram(histogram *total, histogram *h);
+uint64_t histogramPercentile(histogram *h, double quantile);
+void sumMetrics(metrics *total, metrics *m);
+void writeMetrics(FILE *out, metrics *m);
+int startStatsEndpoint(statsEndpoint *endpoint, char *path, void (*report)(FILE *out, void *arg), void *arg);
+void stopStatsEndpoint(statsEndpoint *endpoint);
+
+#endif
@@ -0,0 +1,418 @@
+#include <getopt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "socketcom.h"
+
+#define checkError(expression, errorMessage)\
+do\
+{\
+	if(expression)\
+	{\
+		perror(errorMessage);\
+		exit(EXIT_FAILURE);\
+	}\
+} while(0);
+
+#define SAMPLES 1024
+#define DEFAULT_TRIALS 5
+#define DEFAULT_MIN_TIME_MS 100
+
+/* Output formats */
+#define JSON_O 0
+#define CSV_O 1
+
+/*
+	Micro-benchmarks for the message codec.
+	Every benchmark runs one function over SAMPLES prepared messages, whose payload sizes follow one of the
+	distributions below, over and over until a trial has taken at least the minimum time. The result is the
+	median of the trials in nanoseconds per call, along with the fastest trial and the throughput in bytes
+	per second, where the bytes are what the call reads or writes (the wire size of the message for the
+	codec functions, the payload for sanitize and so on).
+
+	Results go to stdout, one JSON object per line (or CSV with --csv), so runs can be kept and compared
+	between releases. The prepared messages are plain chat text with the odd double space and control
+	character thrown in, since that's what sanitize has to deal with.
+
+	sanitize works in place, so every call is preceded by copying the payload back in - payload_copy
+	measures that copy on its own. Every sanitize kernel the CPU has gets measured separately, and --check
+	makes sure beforehand that they all give the same output as the scalar one.
+*/
+
+typedef struct {
+	char *name;
+	/* Payload size ranges and the percentage of samples in each, the percentages add up to 100 */
+	int ranges;
+	int low[4];
+	int high[4];
+	int percent[4];
+} distribution;
+
+typedef struct {
+	message msg;
+	char v1[TOTAL_BUFFER_SIZE];
+	char v2[MAX_PREFIX_SIZE + MAX_PAYLOAD_SIZE];
+	int v1Length;
+	int v2Length;
+} sample;
+
+typedef struct {
+	char *name;
+	/* Runs the function once on the sample, returns the number of bytes it went through */
+	size_t (*run)(sample *s);
+	/* The sanitize kernel the CPU needs for it */
+	int kernel;
+} benchmark;
+
+static distribution distributions[] =
+{
+	{"short", 1, {8}, {64}, {100}},
+	{"mixed", 3, {8, 64, 256}, {64, 256, MAX_PAYLOAD_SIZE - 1}, {60, 30, 10}},
+	{"long", 1, {512}, {MAX_PAYLOAD_SIZE - 1}, {100}},
+};
+
+static int numOfDistributions = sizeof(distributions) / sizeof(distribution);
+
+/* Keeps the compiler from throwing the results away */
+volatile uint64_t sink;
+
+static char scratch[TOTAL_BUFFER_SIZE + MAX_PREFIX_SIZE];
+static message scratchMessage;
+
+size_t runSerializeStruct(sample *s);
+size_t runDeserializeStruct(sample *s);
+size_t runDeserializeCompact(sample *s);
+size_t runEncodeV1(sample *s);
+size_t runEncodeV2(sample *s);
+size_t runDeserializeUint32(sample *s);
+size_t runReadArgs(sample *s);
+size_t runPayloadCopy(sample *s);
+size_t runSanitize(sample *s);
+size_t runSanitizeScalar(sample *s);
+size_t runSanitizeSSE2(sample *s);
+size_t runSanitizeAVX2(sample *s);
+
+static benchmark benchmarks[] =
+{
+	{"serialize_struct_message", runSerializeStruct, SCALAR_K},
+	{"deserialize_struct_message", runDeserializeStruct, SCALAR_K},
+	{"deserialize_compact_message", runDeserializeCompact, SCALAR_K},
+	{"encode_message_v1", runEncodeV1, SCALAR_K},
+	{"encode_message_v2", runEncodeV2, SCALAR_K},
+	{"deserialize_uint32_t", runDeserializeUint32, SCALAR_K},
+	{"readArgs", runReadArgs, SCALAR_K},
+	{"payload_copy", runPayloadCopy, SCALAR_K},
+	{"sanitize", runSanitize, SCALAR_K},
+	{"sanitize_scalar", runSanitizeScalar, SCALAR_K},
+	{"sanitize_sse2", runSanitizeSSE2, SSE2_K},
+	{"sanitize_avx2", runSanitizeAVX2, AVX2_K},
+};
+
+static const char *kernelNames[KERNELS] = {"scalar", "sse2", "avx2"};
+
+static int numOfBenchmarks = sizeof(benchmarks) / sizeof(benchmark);
+
+uint64_t now(void);
+void prepareSamples(sample *samples, distribution *d, unsigned int seed);
+int comparePerformance(const void *a, const void *b);
+int checkSanitize(void);
+
+int main(int argc, char *argv[]) {
+	int trials = DEFAULT_TRIALS, minTime = DEFAULT_MIN_TIME_MS, format = JSON_O, check = 0;
+	char *filter = NULL;
+
+	struct option options[] =
+	{
+		{"trials", required_argument, NULL, 't'},
+		{"min-time", required_argument, NULL, 'm'},
+		{"filter", required_argument, NULL, 'f'},
+		{"csv", no_argument, NULL, 'c'},
+		{"check", no_argument, NULL, 'k'},
+		{NULL, 0, NULL, 0}
+	};
+	int option;
+	while((option = getopt_long(argc, argv, "t:m:f:ck", options, NULL)) != -1)
+	{
+		switch(option)
+		{
+			case 't':
+				trials = atoi(optarg);
+				break;
+			case 'm':
+				minTime = atoi(optarg);
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'c':
+				format = CSV_O;
+				break;
+			case 'k':
+				check = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [--trials N] [--min-time MS] [--filter SUBSTRING] [--csv] [--check]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if(trials < 1 || minTime < 1)
+	{
+		fprintf(stderr, "There has to be at least one trial, and the minimum time has to be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	if(check)
+		exit(checkSanitize() ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	sample *samples = malloc(SAMPLES * sizeof(sample));
+	checkError(samples == NULL, "samples malloc");
+	double *performance = malloc(trials * sizeof(double));
+	checkError(performance == NULL, "performance malloc");
+
+	if(format == CSV_O)
+		printf("benchmark,distribution,ops,ns_per_op,min_ns_per_op,bytes_per_op,bytes_per_sec\n");
+	for(int i = 0; i < numOfDistributions; i++)
+	{
+		/* Same seed every run, so every run measures the same messages */
+		prepareSamples(samples, &distributions[i], 12345 + i);
+		for(int j = 0; j < numOfBenchmarks; j++)
+		{
+			benchmark *b = &benchmarks[j];
+			if((filter != NULL && strstr(b->name, filter) == NULL) || b->kernel > bestSanitizeKernel())
+				continue;
+
+			/* One pass to warm up the caches */
+			size_t bytes = 0;
+			for(int k = 0; k < SAMPLES; k++)
+				bytes += b->run(&samples[k]);
+			double bytesPerOp = (double)bytes / SAMPLES;
+
+			uint64_t totalOps = 0;
+			for(int t = 0; t < trials; t++)
+			{
+				uint64_t ops = 0, start = now(), elapsed;
+				do
+				{
+					for(int k = 0; k < SAMPLES; k++)
+						b->run(&samples[k]);
+					ops += SAMPLES;
+					elapsed = now() - start;
+				} while(elapsed < (uint64_t)minTime * 1000000);
+				performance[t] = (double)elapsed / ops;
+				totalOps += ops;
+			}
+			qsort(performance, trials, sizeof(double), comparePerformance);
+			double median = performance[trials / 2], fastest = performance[0];
+			double bytesPerSec = bytesPerOp / median * 1e9;
+
+			if(format == CSV_O)
+				printf("%s,%s,%llu,%.2f,%.2f,%.1f,%.0f\n", b->name, distributions[i].name, (unsigned long long)totalOps, median, fastest, bytesPerOp, bytesPerSec);
+			else
+				printf("{\"benchmark\":\"%s\",\"distribution\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,\"bytes_per_op\":%.1f,\"bytes_per_sec\":%.0f}\n",
+					b->name, distributions[i].name, (unsigned long long)totalOps, median, fastest, bytesPerOp, bytesPerSec);
+			fflush(stdout);
+		}
+	}
+
+	free(performance);
+	free(samples);
+	exit(EXIT_SUCCESS);
+}
+
+uint64_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+int comparePerformance(const void *a, const void *b) {
+	double difference = *(const double *)a - *(const double *)b;
+	return (difference > 0) - (difference < 0);
+}
+
+/* Words of lowercase letters, with a double space in one in twenty gaps and a control character in one in a hundred words */
+void prepareSamples(sample *samples, distribution *d, unsigned int seed) {
+	for(int i = 0; i < SAMPLES; i++)
+	{
+		sample *s = &samples[i];
+		int pick = rand_r(&seed) % 100, range = 0;
+		while(range < d->ranges - 1 && pick >= d->percent[range])
+			pick -= d->percent[range++];
+		int length = d->low[range] + rand_r(&seed) % (d->high[range] - d->low[range] + 1);
+
+		memset(&s->msg, 0, sizeof(message));
+		s->msg.type = REQ_M | REG_F;
+		snprintf(s->msg.name, MAX_NAME_SIZE, "user%d", rand_r(&seed) % 10000);
+		int position = 0;
+		while(position < length)
+		{
+			int word = 1 + rand_r(&seed) % 9;
+			for(int k = 0; k < word && position < length; k++)
+				s->msg.payload[position++] = 'a' + rand_r(&seed) % 26;
+			if(position < length && rand_r(&seed) % 100 == 0)
+				s->msg.payload[position++] = '\t';
+			if(position < length)
+				s->msg.payload[position++] = ' ';
+			if(position < length && rand_r(&seed) % 20 == 0)
+				s->msg.payload[position++] = ' ';
+		}
+		s->msg.payload[length] = '\0';
+		s->msg.payloadLength = length;
+
+		serialize_struct_message(s->v1, &s->msg);
+		s->v1Length = MESSAGE_PREFIX_SIZE + length;
+		s->v2Length = encodeMessageStream(s->v2, PROTOCOL_V2, s->msg.type, s->msg.name, s->msg.payload);
+	}
+}
+
+size_t runSerializeStruct(sample *s) {
+	serialize_struct_message(scratch, &s->msg);
+	sink += scratch[MESSAGE_PREFIX_SIZE];
+	return TOTAL_BUFFER_SIZE;
+}
+
+size_t runDeserializeStruct(sample *s) {
+	message msg = deserialize_struct_message(s->v1);
+	sink += msg.payloadLength + msg.payload[0];
+	return s->v1Length;
+}
+
+size_t runDeserializeCompact(sample *s) {
+	message msg = deserialize_compact_message(s->v2);
+	sink += msg.payloadLength + msg.payload[0];
+	return s->v2Length;
+}
+
+size_t runEncodeV1(sample *s) {
+	int length = encodeMessageStream(scratch, PROTOCOL_V1, s->msg.type, s->msg.name, s->msg.payload);
+	sink += length;
+	return length;
+}
+
+size_t runEncodeV2(sample *s) {
+	int length = encodeMessageStream(scratch, PROTOCOL_V2, s->msg.type, s->msg.name, s->msg.payload);
+	sink += length;
+	return length;
+}
+
+/* Both integers of the prefix */
+size_t runDeserializeUint32(sample *s) {
+	sink += deserialize_uint32_t(s->v1) + deserialize_uint32_t(s->v1 + 4 + MAX_NAME_SIZE);
+	return 2 * sizeof(uint32_t);
+}
+
+/* The way the server takes the target of a private message off the front of the payload */
+size_t runReadArgs(sample *s) {
+	char word[MAX_NAME_SIZE];
+	int length = readArgs(s->msg.payload, word, NULL);
+	sink += length;
+	return (length > 0) ? length : 0;
+}
+
+size_t runPayloadCopy(sample *s) {
+	memcpy(scratchMessage.payload, s->msg.payload, s->msg.payloadLength + 1);
+	scratchMessage.payloadLength = s->msg.payloadLength;
+	sink += scratchMessage.payload[0];
+	return s->msg.payloadLength;
+}
+
+size_t runSanitize(sample *s) {
+	memcpy(scratchMessage.payload, s->msg.payload, s->msg.payloadLength + 1);
+	scratchMessage.payloadLength = s->msg.payloadLength;
+	sink += sanitize(&scratchMessage);
+	return s->msg.payloadLength;
+}
+
+size_t runSanitizeScalar(sample *s) {
+	memcpy(scratchMessage.payload, s->msg.payload, s->msg.payloadLength + 1);
+	scratchMessage.payloadLength = s->msg.payloadLength;
+	sink += sanitizeScalar(&scratchMessage);
+	return s->msg.payloadLength;
+}
+
+size_t runSanitizeSSE2(sample *s) {
+	memcpy(scratchMessage.payload, s->msg.payload, s->msg.payloadLength + 1);
+	scratchMessage.payloadLength = s->msg.payloadLength;
+	sink += sanitizeWith(&scratchMessage, SSE2_K);
+	return s->msg.payloadLength;
+}
+
+size_t runSanitizeAVX2(sample *s) {
+	memcpy(scratchMessage.payload, s->msg.payload, s->msg.payloadLength + 1);
+	scratchMessage.payloadLength = s->msg.payloadLength;
+	sink += sanitizeWith(&scratchMessage, AVX2_K);
+	return s->msg.payloadLength;
+}
+
+/* Runs every kernel the CPU has on a copy of the message and compares it with the scalar result */
+static int compareKernels(message *input) {
+	message expected = *input, actual;
+	sanitizeScalar(&expected);
+	for(int kernel = SCALAR_K + 1; kernel <= bestSanitizeKernel(); kernel++)
+	{
+		actual = *input;
+		sanitizeWith(&actual, kernel);
+		if(actual.payloadLength != expected.payloadLength || memcmp(actual.payload, expected.payload, expected.payloadLength + 1) != 0)
+		{
+			fprintf(stderr, "%s kernel differs from scalar on a %u byte payload:", kernelNames[kernel], input->payloadLength);
+			for(uint32_t i = 0; i < input->payloadLength; i++)
+				fprintf(stderr, " %02x", (unsigned char)input->payload[i]);
+			fprintf(stderr, "\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+	Differential test of the sanitize kernels against the scalar one. The short payloads are every string
+	of up to eight bytes made of a letter, a space, a control character and a byte above 127, so every
+	combination around a kept or dropped byte comes up, placed at every offset in and across vector blocks.
+	The long ones are random, mostly drawn from the same four bytes, at every length up to the maximum.
+*/
+int checkSanitize(void) {
+	static const char alphabet[4] = {'a', ' ', '\t', (char)0xC3};
+	message msg;
+	uint64_t checked = 0;
+	memset(&msg, 0, sizeof(message));
+	for(int length = 0; length <= 8; length++)
+	{
+		int combinations = 1 << (2 * length);
+		for(int combination = 0; combination < combinations; combination++)
+			for(int offset = 0; offset + length < 72; offset += (length == 8) ? 1 : 7)
+			{
+				/* Letters around the pattern, and a space at the front every other time */
+				memset(msg.payload, 'x', 72);
+				if(combination & 1)
+					msg.payload[0] = ' ';
+				for(int i = 0; i < length; i++)
+					msg.payload[offset + i] = alphabet[(combination >> (2 * i)) & 3];
+				msg.payloadLength = 72;
+				msg.payload[72] = '\0';
+				if(!compareKernels(&msg))
+					return 0;
+				checked++;
+			}
+	}
+
+	unsigned int seed = 54321;
+	for(int round = 0; round < 64; round++)
+		for(int length = 0; length < MAX_PAYLOAD_SIZE; length++)
+		{
+			for(int i = 0; i < length; i++)
+			{
+				int pick = rand_r(&seed) % 16;
+				msg.payload[i] = (pick < 12) ? alphabet[pick % 4] : (char)(rand_r(&seed) % 256);
+			}
+			msg.payloadLength = length;
+			msg.payload[length] = '\0';
+			if(!compareKernels(&msg))
+				return 0;
+			checked++;
+		}
+	printf("sanitize: %s and every slower kernel match scalar on %llu payloads\n", kernelNames[bestSanitizeKernel()], (unsigned long long)checked);
+	return 1;
+}
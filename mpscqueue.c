@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "mpscqueue.h"
+
+void initMpscQueue(mpscQueue *queue) {
+	atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+	queue->tail = &queue->stub;
+}
+
+void pushMpscQueue(mpscQueue *queue, mpscNode *node) {
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	mpscNode *previous = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&previous->next, node, memory_order_release);
+}
+
+mpscNode *popMpscQueue(mpscQueue *queue) {
+	mpscNode *tail = queue->tail;
+	mpscNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	/* Skipping over the stub node */
+	if(tail == &queue->stub)
+	{
+		if(next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+	if(next != NULL)
+	{
+		queue->tail = next;
+		return tail;
+	}
+
+	/* A producer has swapped the head but hasn't linked its node yet */
+	if(tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+		return NULL;
+
+	/* The tail is the last node - putting the stub back behind it so it can be handed out */
+	pushMpscQueue(queue, &queue->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if(next != NULL)
+	{
+		queue->tail = next;
+		return tail;
+	}
+	return NULL;
+}
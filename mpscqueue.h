@@ -0,0 +1,29 @@
+#ifndef _MPSCQUEUE_H_
+#define _MPSCQUEUE_H_
+
+#include <stdatomic.h>
+
+/*
+	Intrusive lock-free multi-producer single-consumer queue.
+	Any thread may push, only the owning thread may pop. Nodes are embedded into the
+	queued structures, so pushing never allocates.
+
+	Note: pop can return NULL while a push is still half way through linking its node,
+	producers are expected to wake the consumer up after their push completes.
+*/
+
+typedef struct mpscNode {
+	_Atomic(struct mpscNode *) next;
+} mpscNode;
+
+typedef struct {
+	_Atomic(mpscNode *) head;
+	mpscNode *tail;
+	mpscNode stub;
+} mpscQueue;
+
+void initMpscQueue(mpscQueue *queue);
+void pushMpscQueue(mpscQueue *queue, mpscNode *node);
+mpscNode *popMpscQueue(mpscQueue *queue);
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nickmap.h"
+
+/* FNV-1a */
+static uint32_t hashNick(char *name) {
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < MAX_NAME_SIZE && name[i] != '\0'; i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static nickEntry *probeNick(nickMap *map, char *name, uint32_t hash) {
+	int mask = map->capacity - 1;
+	for(int i = hash & mask; ; i = (i + 1) & mask)
+	{
+		nickEntry *entry = &map->entries[i];
+		if(!entry->used || (entry->hash == hash && strncmp(entry->name, name, MAX_NAME_SIZE) == 0))
+			return entry;
+	}
+}
+
+static int growNickMap(nickMap *map) {
+	nickEntry *oldEntries = map->entries;
+	int oldCapacity = map->capacity;
+	nickEntry *entries = calloc(2 * oldCapacity, sizeof(nickEntry));
+	if(entries == NULL)
+		return -1;
+	map->entries = entries;
+	map->capacity = 2 * oldCapacity;
+	for(int i = 0; i < oldCapacity; i++)
+	{
+		if(oldEntries[i].used)
+			*probeNick(map, oldEntries[i].name, oldEntries[i].hash) = oldEntries[i];
+	}
+	free(oldEntries);
+	return 0;
+}
+
+int initNickMap(nickMap *map, int initialCapacity) {
+	map->capacity = 16;
+	while(map->capacity < 2 * initialCapacity)
+		map->capacity *= 2;
+	map->entries = calloc(map->capacity, sizeof(nickEntry));
+	map->length = 0;
+	return (map->entries == NULL) ? -1 : 0;
+}
+
+void freeNickMap(nickMap *map) {
+	free(map->entries);
+	map->entries = NULL;
+	map->capacity = map->length = 0;
+}
+
+nickEntry *findNick(nickMap *map, char *name) {
+	nickEntry *entry = probeNick(map, name, hashNick(name));
+	return entry->used ? entry : NULL;
+}
+
+/* Returns -1 if the name is already taken (or the map couldn't grow) */
+int insertNick(nickMap *map, char *name, int shardId, int slotId) {
+	if(2 * (map->length + 1) > map->capacity && growNickMap(map) == -1)
+		return -1;
+	uint32_t hash = hashNick(name);
+	nickEntry *entry = probeNick(map, name, hash);
+	if(entry->used)
+		return -1;
+	entry->used = 1;
+	entry->hash = hash;
+	strncpy(entry->name, name, MAX_NAME_SIZE - 1);
+	entry->name[MAX_NAME_SIZE - 1] = '\0';
+	entry->shardId = shardId;
+	entry->slotId = slotId;
+	map->length++;
+	return 0;
+}
+
+int removeNick(nickMap *map, char *name) {
+	nickEntry *entry = probeNick(map, name, hashNick(name));
+	if(!entry->used)
+		return -1;
+
+	/* Pulling back every entry of the run that would no longer be reachable across the hole */
+	int mask = map->capacity - 1;
+	int hole = entry - map->entries;
+	for(int i = (hole + 1) & mask; map->entries[i].used; i = (i + 1) & mask)
+	{
+		int home = map->entries[i].hash & mask;
+		if(((i - home) & mask) >= ((i - hole) & mask))
+		{
+			map->entries[hole] = map->entries[i];
+			hole = i;
+		}
+	}
+	map->entries[hole].used = 0;
+	map->length--;
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _NICKMAP_H_
+#define _NICKMAP_H_
+
+#include <stdint.h>
+
+#include "socketcom.h"
+
+/*
+	Hash index from nicknames to the connections holding them.
+	Open addressing with linear probing over a power of two sized table that's kept at most half full.
+	Removal shifts the following entries of the probe run back instead of leaving tombstones, so lookups
+	never have to wade through deleted entries.
+*/
+
+typedef struct {
+	int used;
+	uint32_t hash;
+	char name[MAX_NAME_SIZE];
+	int shardId;
+	int slotId;
+} nickEntry;
+
+typedef struct {
+	nickEntry *entries;
+	int capacity;
+	int length;
+} nickMap;
+
+int initNickMap(nickMap *map, int initialCapacity);
+void freeNickMap(nickMap *map);
+nickEntry *findNick(nickMap *map, char *name);
+int insertNick(nickMap *map, char *name, int shardId, int slotId);
+int removeNick(nickMap *map, char *name);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "socketcom.h"
+#include "outqueue.h"
+#include "pool.h"
+
+void initOutQueue(outQueue *queue) {
+	queue->head = queue->tail = NULL;
+	queue->headOffset = 0;
+	queue->queuedBytes = 0;
+	queue->sentBytes = 0;
+}
+
+/* The offset is only allowed for a frame that goes to an empty queue, since only the head can be partially written */
+int pushOutQueue(outQueue *queue, frame *f, int version, int offset) {
+	outNode *node = poolAlloc(sizeof(outNode));
+	if(node == NULL)
+		return -1;
+	node->next = NULL;
+	node->frame = retainFrame(f);
+	node->data = frameData(f, version);
+	node->length = frameLength(f, version);
+	if(queue->tail == NULL)
+	{
+		queue->head = node;
+		queue->headOffset = offset;
+	}
+	else
+		queue->tail->next = node;
+	queue->tail = node;
+	queue->queuedBytes += node->length - offset;
+	return 0;
+}
+
+/* Sends straight away if nothing is waiting in front of the frame, through the same sendmsg path as a flush - whatever doesn't fit gets queued */
+int writeOutQueue(outQueue *queue, int socketFD, frame *f, int version) {
+	int sent = 0;
+	if(queue->head == NULL)
+	{
+		struct iovec vector = {frameData(f, version), frameLength(f, version)};
+		if((sent = sendVectorStream(socketFD, &vector, 1)) == -1)
+			return -1;
+		queue->sentBytes += sent;
+		if(sent == frameLength(f, version))
+			return 0;
+	}
+	return pushOutQueue(queue, f, version, sent);
+}
+
+/* Points the vector at up to maxCount frames from the front of the queue, returns how many bytes that is */
+size_t gatherOutQueue(outQueue *queue, struct iovec *vector, int maxCount, int *count) {
+	size_t bytes = 0;
+	*count = 0;
+	for(outNode *node = queue->head; node != NULL && *count < maxCount; node = node->next, (*count)++)
+	{
+		vector[*count].iov_base = node->data;
+		vector[*count].iov_len = node->length;
+		bytes += node->length;
+	}
+	if(*count > 0)
+	{
+		vector[0].iov_base = queue->head->data + queue->headOffset;
+		vector[0].iov_len -= queue->headOffset;
+		bytes -= queue->headOffset;
+	}
+	return bytes;
+}
+
+/* Releases every frame that went out whole, the one the sent bytes end in becomes the partially written head */
+void consumeOutQueue(outQueue *queue, size_t sent) {
+	queue->queuedBytes -= sent;
+	queue->sentBytes += sent;
+	sent += queue->headOffset;
+	while(queue->head != NULL && sent >= (size_t)queue->head->length)
+	{
+		outNode *node = queue->head;
+		sent -= node->length;
+		queue->head = node->next;
+		releaseFrame(node->frame);
+		poolFree(node);
+	}
+	if(queue->head == NULL)
+		queue->tail = NULL;
+	queue->headOffset = sent;
+}
+
+/* Returns 0 once the queue is empty, 1 if the socket filled up first and -1 on error */
+int flushOutQueue(outQueue *queue, int socketFD) {
+	struct iovec vector[MAX_FLUSH_FRAMES];
+	while(queue->head != NULL)
+	{
+		int count;
+		size_t batchBytes = gatherOutQueue(queue, vector, MAX_FLUSH_FRAMES, &count);
+		int sent = sendVectorStream(socketFD, vector, count);
+		if(sent == -1)
+			return -1;
+		consumeOutQueue(queue, sent);
+		if((size_t)sent < batchBytes)
+			return 1;
+	}
+	return 0;
+}
+
+void clearOutQueue(outQueue *queue) {
+	while(queue->head != NULL)
+	{
+		outNode *node = queue->head;
+		queue->head = node->next;
+		releaseFrame(node->frame);
+		poolFree(node);
+	}
+	initOutQueue(queue);
+}
@@ -0,0 +1,44 @@
+#ifndef _OUTQUEUE_H_
+#define _OUTQUEUE_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define MAX_FLUSH_FRAMES 64
+
+#include "frame.h"
+
+/*
+	Outbound queue of a single connection.
+	Frames the socket won't take right away are kept here, in order, until the socket becomes writable
+	again. The queue holds a reference to every frame in it, and only the head one can be partially
+	written, which lets the owner drop queued frames without ever cutting one in half. Every node keeps
+	the encoding it was queued with, so frames queued before a protocol upgrade still go out as they were.
+	Flushing hands up to MAX_FLUSH_FRAMES queued frames to the socket at once, in a single sendmsg.
+	The queue also keeps count of every byte that made it to the socket, for the server's metrics.
+*/
+
+typedef struct outNode {
+	struct outNode *next;
+	frame *frame;
+	char *data;
+	int length;
+} outNode;
+
+typedef struct {
+	outNode *head;
+	outNode *tail;
+	int headOffset;
+	size_t queuedBytes;
+	size_t sentBytes;
+} outQueue;
+
+void initOutQueue(outQueue *queue);
+int pushOutQueue(outQueue *queue, frame *f, int version, int offset);
+int writeOutQueue(outQueue *queue, int socketFD, frame *f, int version);
+size_t gatherOutQueue(outQueue *queue, struct iovec *vector, int maxCount, int *count);
+void consumeOutQueue(outQueue *queue, size_t sent);
+int flushOutQueue(outQueue *queue, int socketFD);
+void clearOutQueue(outQueue *queue);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+/* The pool allocations on this thread come out of */
+static _Thread_local pool *boundPool = NULL;
+
+/* Statistics have a single writer, so they don't need a locked add */
+#define bumpCounter(counter) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1, memory_order_relaxed)
+#define readCounter(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+/* The smallest class whose blocks fit the request along with its header, -1 if none does */
+static int sizeClassOf(size_t size) {
+	size_t blockSize = MIN_BLOCK_SIZE;
+	for(int i = 0; i < POOL_CLASSES; i++, blockSize <<= 1)
+	{
+		if(size + sizeof(poolHeader) <= blockSize)
+			return i;
+	}
+	return -1;
+}
+
+/* Carves a fresh slab into blocks, the slab's first block is reserved for linking it into the pool */
+static int growPoolClass(pool *p, poolClass *class) {
+	char *slab = malloc(SLAB_SIZE);
+	if(slab == NULL)
+		return -1;
+	((poolLink *)slab)->next = p->slabs;
+	p->slabs = (poolLink *)slab;
+
+	size_t count = SLAB_SIZE / class->blockSize - 1;
+	for(size_t i = count; i > 0; i--)
+	{
+		poolLink *link = (poolLink *)(slab + i * class->blockSize);
+		link->next = class->free;
+		class->free = link;
+	}
+	bumpCounter(class->slabs);
+	atomic_store_explicit(&class->blocks, readCounter(class->blocks) + count, memory_order_relaxed);
+	return 0;
+}
+
+void initPool(pool *p) {
+	size_t blockSize = MIN_BLOCK_SIZE;
+	for(int i = 0; i < POOL_CLASSES; i++, blockSize <<= 1)
+	{
+		poolClass *class = &p->classes[i];
+		class->blockSize = blockSize;
+		class->free = NULL;
+		atomic_init(&class->remoteFree, NULL);
+		atomic_init(&class->slabs, 0);
+		atomic_init(&class->blocks, 0);
+		atomic_init(&class->allocations, 0);
+		atomic_init(&class->localFrees, 0);
+		atomic_init(&class->remoteFrees, 0);
+	}
+	p->slabs = NULL;
+	atomic_init(&p->oversized, 0);
+}
+
+/* Every block has to be back by now, or at least never touched again */
+void freePool(pool *p) {
+	while(p->slabs != NULL)
+	{
+		poolLink *slab = p->slabs;
+		p->slabs = slab->next;
+		free(slab);
+	}
+	for(int i = 0; i < POOL_CLASSES; i++)
+		p->classes[i].free = NULL;
+	if(boundPool == p)
+		boundPool = NULL;
+}
+
+void bindPool(pool *p) {
+	boundPool = p;
+}
+
+void *poolAlloc(size_t size) {
+	pool *p = boundPool;
+	int sizeClass = sizeClassOf(size);
+	poolHeader *header;
+	if(p == NULL || sizeClass == -1)
+	{
+		header = malloc(sizeof(poolHeader) + size);
+		if(header == NULL)
+			return NULL;
+		header->owner = NULL;
+		header->sizeClass = -1;
+		if(p != NULL)
+			bumpCounter(p->oversized);
+		return header + 1;
+	}
+
+	poolClass *class = &p->classes[sizeClass];
+	if(class->free == NULL)
+		class->free = atomic_exchange_explicit(&class->remoteFree, NULL, memory_order_acquire);
+	if(class->free == NULL && growPoolClass(p, class) == -1)
+		return NULL;
+	header = (poolHeader *)class->free;
+	class->free = class->free->next;
+	header->owner = p;
+	header->sizeClass = sizeClass;
+	bumpCounter(class->allocations);
+	return header + 1;
+}
+
+void poolFree(void *block) {
+	if(block == NULL)
+		return;
+	poolHeader *header = (poolHeader *)block - 1;
+	pool *owner = header->owner;
+	if(owner == NULL)
+	{
+		free(header);
+		return;
+	}
+
+	poolClass *class = &owner->classes[header->sizeClass];
+	poolLink *link = (poolLink *)header;
+	if(owner == boundPool)
+	{
+		link->next = class->free;
+		class->free = link;
+		bumpCounter(class->localFrees);
+		return;
+	}
+
+	/* Pushing only - the owner takes the whole list at once, so there's no ABA to worry about */
+	link->next = atomic_load_explicit(&class->remoteFree, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&class->remoteFree, &link->next, link, memory_order_release, memory_order_relaxed))
+		;
+	atomic_fetch_add_explicit(&class->remoteFrees, 1, memory_order_relaxed);
+}
+
+/* A snapshot, the counters of a busy pool keep moving while they're being read */
+void getPoolStats(pool *p, poolStats *stats) {
+	memset(stats, 0, sizeof(poolStats));
+	for(int i = 0; i < POOL_CLASSES; i++)
+	{
+		poolClass *class = &p->classes[i];
+		poolClassStats *classStats = &stats->classes[i];
+		classStats->blockSize = class->blockSize;
+		classStats->slabs = readCounter(class->slabs);
+		classStats->blocks = readCounter(class->blocks);
+		classStats->allocations = readCounter(class->allocations);
+		size_t frees = readCounter(class->localFrees) + readCounter(class->remoteFrees);
+		classStats->inUse = (classStats->allocations > frees) ? classStats->allocations - frees : 0;
+		stats->slabBytes += classStats->slabs * SLAB_SIZE;
+	}
+	stats->oversized = readCounter(p->oversized);
+}
@@ -0,0 +1,75 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+	Size class pool allocator.
+	Memory is carved out of slabs into fixed size blocks with one free list per size class, so once the
+	pools have grown to fit the load, frames, queue nodes, envelopes and connection records stop going
+	through malloc altogether. Slabs are never given back, a pool only ever grows to its peak footprint.
+
+	Every shard owns a pool and binds it to its thread, allocations always come out of the calling thread's
+	pool. Blocks can be freed from any thread though, since a frame's last reference can be dropped on any
+	shard: the owner puts them straight back on its free list, everybody else pushes them onto the class's
+	lock-free remote list, which the owner takes over in one go once its own list runs dry.
+
+	Requests above the largest class (and allocations from threads without a pool) go to malloc.
+*/
+
+#define POOL_CLASSES 8
+#define MIN_BLOCK_SIZE 64
+#define SLAB_SIZE (64 * 1024)
+
+/* Sits right in front of every block handed out, a free block reuses it as its free list link */
+typedef struct {
+	struct pool *owner;
+	int sizeClass;
+	int reserved;
+} poolHeader;
+
+typedef struct poolLink {
+	struct poolLink *next;
+} poolLink;
+
+typedef struct {
+	size_t blockSize;
+	poolLink *free;
+	_Atomic(poolLink *) remoteFree;
+	/* Statistics - only the owner writes the plain ones, but anyone may read them */
+	atomic_size_t slabs;
+	atomic_size_t blocks;
+	atomic_size_t allocations;
+	atomic_size_t localFrees;
+	atomic_size_t remoteFrees;
+} poolClass;
+
+typedef struct pool {
+	poolClass classes[POOL_CLASSES];
+	poolLink *slabs;
+	atomic_size_t oversized;
+} pool;
+
+typedef struct {
+	size_t blockSize;
+	size_t slabs;
+	size_t blocks;
+	size_t inUse;
+	size_t allocations;
+} poolClassStats;
+
+typedef struct {
+	poolClassStats classes[POOL_CLASSES];
+	size_t slabBytes;
+	size_t oversized;
+} poolStats;
+
+void initPool(pool *p);
+void freePool(pool *p);
+void bindPool(pool *p);
+void *poolAlloc(size_t size);
+void poolFree(void *block);
+void getPoolStats(pool *p, poolStats *stats);
+
+#endif
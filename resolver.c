@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "socketcom.h"
+#include "resolver.h"
+
+static time_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec;
+}
+
+/* FNV-1a */
+static resolverEntry *cacheSlot(resolver *r, char *host) {
+	uint32_t hash = 2166136261u;
+	for(; *host != '\0'; host++)
+		hash = (hash ^ (unsigned char)*host) * 16777619u;
+	return &r->cache[hash % RESOLVER_CACHE_SIZE];
+}
+
+static void *runResolver(void *arg) {
+	resolver *r = arg;
+	pthread_mutex_lock(&r->lock);
+	while(1)
+	{
+		while(r->running && r->queueLength == 0)
+			pthread_cond_wait(&r->wakeup, &r->lock);
+		if(!r->running)
+			break;
+		resolverRequest request = r->queue[r->queueStart];
+		r->queueStart = (r->queueStart + 1) % RESOLVER_QUEUE_SIZE;
+		r->queueLength--;
+
+		/* The lookup itself happens without the lock, so the event loops can keep reading the cache */
+		pthread_mutex_unlock(&r->lock);
+		char hostname[NI_MAXHOST];
+		int status = getnameinfo((struct sockaddr*)&request.address, request.addressLength, hostname, sizeof(hostname), NULL, 0, NI_NAMEREQD);
+		pthread_mutex_lock(&r->lock);
+
+		/* The slot might have been taken over by another address in the meantime */
+		resolverEntry *entry = cacheSlot(r, request.host);
+		if(strcmp(entry->host, request.host) != 0)
+			continue;
+		entry->state = (status == 0) ? RESOLVED_R : FAILED_R;
+		entry->expires = now() + r->ttl;
+		if(status == 0)
+			strcpy(entry->hostname, hostname);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int startResolver(resolver *r, int ttl) {
+	r->cache = calloc(RESOLVER_CACHE_SIZE, sizeof(resolverEntry));
+	if(r->cache == NULL)
+		return -1;
+	r->ttl = ttl;
+	r->running = 1;
+	r->queueStart = 0;
+	r->queueLength = 0;
+	if(pthread_mutex_init(&r->lock, NULL) != 0)
+	{
+		free(r->cache);
+		return -1;
+	}
+	if(pthread_cond_init(&r->wakeup, NULL) != 0)
+	{
+		pthread_mutex_destroy(&r->lock);
+		free(r->cache);
+		return -1;
+	}
+	if(pthread_create(&r->thread, NULL, runResolver, r) != 0)
+	{
+		pthread_cond_destroy(&r->wakeup);
+		pthread_mutex_destroy(&r->lock);
+		free(r->cache);
+		return -1;
+	}
+	return 0;
+}
+
+/* Waits for the lookup in progress (if any) to finish */
+void stopResolver(resolver *r) {
+	pthread_mutex_lock(&r->lock);
+	r->running = 0;
+	pthread_cond_signal(&r->wakeup);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->wakeup);
+	pthread_mutex_destroy(&r->lock);
+	free(r->cache);
+}
+
+/* Queues a lookup of the address unless the cache already has it (or it's already queued), never blocks */
+void requestHostname(resolver *r, struct sockaddr *address, socklen_t addressLength, char *host) {
+	if(addressLength > sizeof(struct sockaddr_storage))
+		return;
+	pthread_mutex_lock(&r->lock);
+	resolverEntry *entry = cacheSlot(r, host);
+	int known = strcmp(entry->host, host) == 0 && (entry->state == PENDING_R || entry->expires > now());
+	if(!known && r->queueLength < RESOLVER_QUEUE_SIZE)
+	{
+		resolverRequest *request = &r->queue[(r->queueStart + r->queueLength) % RESOLVER_QUEUE_SIZE];
+		memcpy(&request->address, address, addressLength);
+		request->addressLength = addressLength;
+		strcpy(request->host, host);
+		r->queueLength++;
+
+		entry->state = PENDING_R;
+		strcpy(entry->host, host);
+		pthread_cond_signal(&r->wakeup);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Returns -1 unless the cache holds an unexpired name for the host */
+int cachedHostname(resolver *r, char *host, char *hostname, int hostnameSize) {
+	int status = -1;
+	pthread_mutex_lock(&r->lock);
+	resolverEntry *entry = cacheSlot(r, host);
+	if(entry->state == RESOLVED_R && strcmp(entry->host, host) == 0 && entry->expires > now())
+	{
+		snprintf(hostname, hostnameSize, "%s", entry->hostname);
+		status = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return status;
+}
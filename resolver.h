@@ -0,0 +1,62 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "socketcom.h"
+
+/*
+	Background reverse DNS resolver.
+	Event loops never wait on a name server: they only ever look at the cache, and hand addresses the cache
+	doesn't know about to the resolver thread, which does the (blocking) lookups one after the other and
+	stores the results. Failed lookups get cached too, so an address without a name isn't asked about over
+	and over. Every entry expires after the TTL.
+
+	The cache is direct mapped by the hash of the numeric host, a colliding address simply takes the slot
+	over. Requests that don't fit into the queue are dropped, the next connection from the address asks again.
+*/
+
+#define RESOLVER_CACHE_SIZE 1024
+#define RESOLVER_QUEUE_SIZE 256
+#define DEFAULT_RESOLVER_TTL 300
+
+/* Cache entry states */
+#define EMPTY_R 0
+#define PENDING_R 1
+#define RESOLVED_R 2
+#define FAILED_R 3
+
+typedef struct {
+	int state;
+	time_t expires;
+	char host[MAX_HOST_SIZE];
+	char hostname[NI_MAXHOST];
+} resolverEntry;
+
+typedef struct {
+	struct sockaddr_storage address;
+	socklen_t addressLength;
+	char host[MAX_HOST_SIZE];
+} resolverRequest;
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int ttl;
+	int running;
+	resolverEntry *cache;
+	resolverRequest queue[RESOLVER_QUEUE_SIZE];
+	int queueStart;
+	int queueLength;
+} resolver;
+
+int startResolver(resolver *r, int ttl);
+void stopResolver(resolver *r);
+void requestHostname(resolver *r, struct sockaddr *address, socklen_t addressLength, char *host);
+int cachedHostname(resolver *r, char *host, char *hostname, int hostnameSize);
+
+#endif
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "roster.h"
+
+#define INITIAL_BUCKETS 64
+
+/* FNV-1a */
+static uint32_t hashName(char *name) {
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < MAX_NAME_SIZE && name[i] != '\0'; i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* xorshift32, only has to be good enough to keep the tree balanced */
+static uint32_t nextPriority(roster *r) {
+	r->seed ^= r->seed << 13;
+	r->seed ^= r->seed >> 17;
+	r->seed ^= r->seed << 5;
+	return r->seed;
+}
+
+static int nodeSize(rosterNode *node) {
+	return (node == NULL) ? 0 : node->size;
+}
+
+static void updateSize(rosterNode *node) {
+	node->size = node->count + nodeSize(node->left) + nodeSize(node->right);
+}
+
+/* For a name that's already there - changes the sizes on the way down to its node, returns the position of its first copy */
+static int resizePath(roster *r, char *name, int change) {
+	int position = 0;
+	rosterNode *node = r->root;
+	while(node != NULL)
+	{
+		node->size += change;
+		int comparison = strncmp(name, node->name, MAX_NAME_SIZE);
+		if(comparison == 0)
+			return position + nodeSize(node->left);
+		if(comparison < 0)
+			node = node->left;
+		else
+		{
+			position += nodeSize(node->left) + node->count;
+			node = node->right;
+		}
+	}
+	return -1;
+}
+
+/* Splits the tree into the names that sort before the given one and the rest */
+static void splitByName(rosterNode *node, char *name, rosterNode **less, rosterNode **rest) {
+	if(node == NULL)
+	{
+		*less = *rest = NULL;
+		return;
+	}
+	if(strncmp(node->name, name, MAX_NAME_SIZE) < 0)
+	{
+		splitByName(node->right, name, &node->right, rest);
+		*less = node;
+	}
+	else
+	{
+		splitByName(node->left, name, less, &node->left);
+		*rest = node;
+	}
+	updateSize(node);
+}
+
+/* Every name in the left tree has to sort before every name in the right one */
+static rosterNode *merge(rosterNode *left, rosterNode *right) {
+	if(left == NULL)
+		return right;
+	if(right == NULL)
+		return left;
+	if(left->priority > right->priority)
+	{
+		left->right = merge(left->right, right);
+		updateSize(left);
+		return left;
+	}
+	right->left = merge(left, right->left);
+	updateSize(right);
+	return right;
+}
+
+static rosterNode **findBucket(roster *r, char *name, uint32_t hash) {
+	rosterNode **link = &r->buckets[hash & (r->capacity - 1)];
+	while(*link != NULL && ((*link)->hash != hash || strncmp((*link)->name, name, MAX_NAME_SIZE) != 0))
+		link = &(*link)->hashNext;
+	return link;
+}
+
+static int growBuckets(roster *r) {
+	rosterNode **buckets = calloc(2 * r->capacity, sizeof(rosterNode *));
+	if(buckets == NULL)
+		return -1;
+	for(int i = 0; i < r->capacity; i++)
+	{
+		rosterNode *node = r->buckets[i];
+		while(node != NULL)
+		{
+			rosterNode *next = node->hashNext;
+			node->hashNext = buckets[node->hash & (2 * r->capacity - 1)];
+			buckets[node->hash & (2 * r->capacity - 1)] = node;
+			node = next;
+		}
+	}
+	free(r->buckets);
+	r->buckets = buckets;
+	r->capacity *= 2;
+	return 0;
+}
+
+int initRoster(roster *r) {
+	r->buckets = calloc(INITIAL_BUCKETS, sizeof(rosterNode *));
+	if(r->buckets == NULL)
+		return -1;
+	r->capacity = INITIAL_BUCKETS;
+	r->root = NULL;
+	r->length = 0;
+	r->seed = 2463534242u;
+	return 0;
+}
+
+static void freeNodes(rosterNode *node) {
+	if(node == NULL)
+		return;
+	freeNodes(node->left);
+	freeNodes(node->right);
+	free(node);
+}
+
+void freeRoster(roster *r) {
+	freeNodes(r->root);
+	free(r->buckets);
+	r->root = NULL;
+	r->buckets = NULL;
+	r->length = 0;
+}
+
+/* Returns the position the name got, a name that's already there gets one more copy after the others, -2 if there's no memory for it */
+int addRosterName(roster *r, char *name) {
+	uint32_t hash = hashName(name);
+	rosterNode *existing = *findBucket(r, name, hash);
+	if(existing != NULL)
+	{
+		int position = resizePath(r, existing->name, 1) + existing->count;
+		existing->count++;
+		r->length++;
+		return position;
+	}
+	if(r->length >= r->capacity && growBuckets(r) == -1)
+		return -2;
+	rosterNode *node = malloc(sizeof(rosterNode));
+	if(node == NULL)
+		return -2;
+	strncpy(node->name, name, MAX_NAME_SIZE - 1);
+	node->name[MAX_NAME_SIZE - 1] = '\0';
+	node->hash = hash;
+	node->priority = nextPriority(r);
+	node->count = 1;
+	node->size = 1;
+	node->left = node->right = NULL;
+	node->hashNext = r->buckets[hash & (r->capacity - 1)];
+	r->buckets[hash & (r->capacity - 1)] = node;
+
+	rosterNode *less, *rest;
+	splitByName(r->root, node->name, &less, &rest);
+	int position = nodeSize(less);
+	r->root = merge(merge(less, node), rest);
+	r->length++;
+	return position;
+}
+
+static int compareNames(const void *a, const void *b) {
+	return strncmp(*(char * const *)a, *(char * const *)b, MAX_NAME_SIZE);
+}
+
+/* Sets the subtree sizes of a tree that was put together without them */
+static int sizeTree(rosterNode *node) {
+	if(node == NULL)
+		return 0;
+	node->size = node->count + sizeTree(node->left) + sizeTree(node->right);
+	return node->size;
+}
+
+/*
+	Builds a treap out of nodes that are already sorted in a single pass - the right spine is kept on a stack,
+	every node takes the part of it with lower priorities as its left subtree
+*/
+static rosterNode *buildTree(rosterNode **nodes, int length) {
+	rosterNode *root = NULL;
+	int depth = 0;
+	for(int i = 0; i < length; i++)
+	{
+		rosterNode *last = NULL;
+		while(depth > 0 && nodes[depth - 1]->priority < nodes[i]->priority)
+			last = nodes[--depth];
+		nodes[i]->left = last;
+		nodes[i]->right = NULL;
+		if(depth > 0)
+			nodes[depth - 1]->right = nodes[i];
+		else
+			root = nodes[i];
+		/* The spine overwrites the nodes that have been placed already, which are never looked at again */
+		nodes[depth++] = nodes[i];
+	}
+	sizeTree(root);
+	return root;
+}
+
+/* Unites two trees that have no name in common, in O(m log(n / m)) for m nodes in the smaller one */
+static rosterNode *unite(rosterNode *a, rosterNode *b) {
+	if(a == NULL)
+		return b;
+	if(b == NULL)
+		return a;
+	if(a->priority < b->priority)
+	{
+		rosterNode *swap = a;
+		a = b;
+		b = swap;
+	}
+	rosterNode *less, *rest;
+	splitByName(b, a->name, &less, &rest);
+	a->left = unite(a->left, less);
+	a->right = unite(a->right, rest);
+	updateSize(a);
+	return a;
+}
+
+/*
+	Adds a whole batch of names at once - the new ones are sorted, built into a tree of their own and united
+	with the roster, instead of going through a split and a merge each. Names that are there already (or
+	more than once in the batch) get more copies. Returns how many names were added, -2 if there's no memory
+	for them, in which case none were.
+*/
+int addRosterNames(roster *r, char **names, int length) {
+	if(length <= 0)
+		return 0;
+	char **sorted = malloc(length * sizeof(char *));
+	rosterNode **nodes = malloc(length * sizeof(rosterNode *));
+	if(sorted == NULL || nodes == NULL)
+	{
+		free(sorted);
+		free(nodes);
+		return -2;
+	}
+	memcpy(sorted, names, length * sizeof(char *));
+	qsort(sorted, length, sizeof(char *), compareNames);
+
+	/* Making all the new nodes first, so running out of memory leaves the roster as it was */
+	int numOfNodes = 0, status = 0;
+	for(int i = 0; i < length && status == 0; i++)
+	{
+		if(numOfNodes > 0 && strncmp(nodes[numOfNodes - 1]->name, sorted[i], MAX_NAME_SIZE) == 0)
+		{
+			nodes[numOfNodes - 1]->count++;
+			continue;
+		}
+		if(i > 0 && strncmp(sorted[i - 1], sorted[i], MAX_NAME_SIZE) == 0)
+			continue;
+		uint32_t hash = hashName(sorted[i]);
+		if(*findBucket(r, sorted[i], hash) != NULL)
+			continue;
+		rosterNode *node = malloc(sizeof(rosterNode));
+		if(node == NULL)
+		{
+			status = -2;
+			break;
+		}
+		strncpy(node->name, sorted[i], MAX_NAME_SIZE - 1);
+		node->name[MAX_NAME_SIZE - 1] = '\0';
+		node->hash = hash;
+		node->priority = nextPriority(r);
+		node->count = 1;
+		nodes[numOfNodes++] = node;
+	}
+	while(status == 0 && r->length + length > r->capacity)
+		status = growBuckets(r);
+	if(status != 0)
+	{
+		for(int i = 0; i < numOfNodes; i++)
+			free(nodes[i]);
+		free(sorted);
+		free(nodes);
+		return -2;
+	}
+
+	/* Copies of names that were there already go straight to their nodes */
+	for(int i = 0; i < length; i++)
+	{
+		if(i > 0 && strncmp(sorted[i - 1], sorted[i], MAX_NAME_SIZE) == 0)
+			continue;
+		rosterNode *existing = *findBucket(r, sorted[i], hashName(sorted[i]));
+		if(existing == NULL)
+			continue;
+		int copies = 1;
+		while(i + copies < length && strncmp(sorted[i], sorted[i + copies], MAX_NAME_SIZE) == 0)
+			copies++;
+		resizePath(r, existing->name, copies);
+		existing->count += copies;
+	}
+	for(int i = 0; i < numOfNodes; i++)
+	{
+		nodes[i]->hashNext = r->buckets[nodes[i]->hash & (r->capacity - 1)];
+		r->buckets[nodes[i]->hash & (r->capacity - 1)] = nodes[i];
+	}
+	r->root = unite(r->root, buildTree(nodes, numOfNodes));
+	r->length += length;
+	free(sorted);
+	free(nodes);
+	return length;
+}
+
+/* Returns the position the name was at (its last copy's), -1 if it wasn't there */
+int removeRosterName(roster *r, char *name) {
+	uint32_t hash = hashName(name);
+	rosterNode **link = findBucket(r, name, hash);
+	rosterNode *node = *link;
+	if(node == NULL)
+		return -1;
+	if(node->count > 1)
+	{
+		int position = resizePath(r, node->name, -1) + node->count - 1;
+		node->count--;
+		r->length--;
+		return position;
+	}
+	*link = node->hashNext;
+
+	/* The node is the first one of the part that doesn't sort before it */
+	rosterNode *less, *rest;
+	splitByName(r->root, node->name, &less, &rest);
+	int position = nodeSize(less);
+	rosterNode **parent = &rest;
+	while((*parent)->left != NULL)
+	{
+		(*parent)->size--;
+		parent = &(*parent)->left;
+	}
+	*parent = (*parent)->right;
+	r->root = merge(less, rest);
+	r->length--;
+	free(node);
+	return position;
+}
+
+/* Returns the position of the name's first copy, -1 if it isn't there */
+int findRosterName(roster *r, char *name) {
+	if(*findBucket(r, name, hashName(name)) == NULL)
+		return -1;
+	int position = 0;
+	rosterNode *node = r->root;
+	while(node != NULL)
+	{
+		int comparison = strncmp(name, node->name, MAX_NAME_SIZE);
+		if(comparison == 0)
+			return position + nodeSize(node->left);
+		if(comparison < 0)
+			node = node->left;
+		else
+		{
+			position += nodeSize(node->left) + node->count;
+			node = node->right;
+		}
+	}
+	return -1;
+}
+
+/* NULL if there's no name at the position */
+char *rosterNameAt(roster *r, int index) {
+	if(index < 0 || index >= r->length)
+		return NULL;
+	rosterNode *node = r->root;
+	while(node != NULL)
+	{
+		int leftSize = nodeSize(node->left);
+		if(index < leftSize)
+			node = node->left;
+		else if(index < leftSize + node->count)
+			return node->name;
+		else
+		{
+			index -= leftSize + node->count;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef _ROSTER_H_
+#define _ROSTER_H_
+
+#include <stdint.h>
+
+#include "socketcom.h"
+
+/*
+	Sorted set of nicknames for the client's user list.
+	The names are kept in a treap (a binary search tree balanced by random priorities) where every node
+	knows the size of its subtree, so adding, removing, finding where a name is in the order and finding
+	the name at a position are all O(log n). A hash index on top answers whether a name is there at all
+	without touching the tree.
+	A name can be in the roster more than once, since everyone who hasn't picked a nick goes by the same
+	one. A node keeps count of its copies, each of which takes a position of its own.
+*/
+
+typedef struct rosterNode {
+	char name[MAX_NAME_SIZE];
+	uint32_t hash;
+	uint32_t priority;
+	int count;
+	int size;
+	struct rosterNode *left;
+	struct rosterNode *right;
+	struct rosterNode *hashNext;
+} rosterNode;
+
+typedef struct {
+	rosterNode *root;
+	rosterNode **buckets;
+	int capacity;
+	int length;
+	uint32_t seed;
+} roster;
+
+int initRoster(roster *r);
+void freeRoster(roster *r);
+int addRosterName(roster *r, char *name);
+int addRosterNames(roster *r, char **names, int length);
+int removeRosterName(roster *r, char *name);
+int findRosterName(roster *r, char *name);
+char *rosterNameAt(roster *r, int index);
+
+#endif
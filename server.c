@@ -1,17 +1,42 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef USE_POLL
 #include <poll.h>
+#else
+#include <sys/epoll.h>
+#include <poll.h>
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <errno.h>
 
 #include "socketcom.h"
+#include "mpscqueue.h"
+#include "frame.h"
+#include "outqueue.h"
+#include "contable.h"
+#include "nickmap.h"
+#include "pool.h"
+#include "resolver.h"
+#include "logger.h"
+#include "history.h"
+#include "memberset.h"
+#include "metrics.h"
+#ifndef USE_POLL
+#include "uring.h"
+#endif
 
 #define checkError(expression, errorMessage)\
 do\
@@ -24,269 +49,2058 @@ do\
 } while(0);
 
 #define DEFAULT_PORT "8080"
-#define MAX_CONNECTIONS 256
+#define INITIAL_CONNECTIONS 256
+#define MAX_EVENTS 64
+#define MAX_THREADS 64
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define DEFAULT_HIGH_WATERMARK (256 * 1024)
+#define DEFAULT_LOW_WATERMARK (64 * 1024)
+#define MAX_CHANNELS 1024
+#define MAX_JOINED_CHANNELS 16
+
+/* Every client starts out with the default name, so it's shared and never indexed, neither name can be taken as a nick */
+#define DEFAULT_NAME "CLIENT"
+#define SERVER_NAME "SERVER"
+
+/* Slow consumer policies - what happens to a client whose outbound queue goes over the high watermark */
+#define DROP_CLIENT_P 0
+#define DROP_MESSAGES_P 1
+
+/* Event loop backends - picked at startup, the poll loop is a compile time choice of its own */
+#define EPOLL_B 0
+#define URING_B 1
+
+/* Handle types - every monitored descriptor is registered with a pointer to its handle */
+#define LISTENER_H 0
+#define CLIENT_H 1
+#define WAKEUP_H 2
+
+/* io_uring operation types - kept in the top byte of the user data, next to the handle pointer */
+#define ACCEPT_O 1
+#define WAKEUP_O 2
+#define RECV_O 3
+#define SEND_O 4
+#define WRITABLE_O 5
+#define uringData(operation, handle) (((uint64_t)(operation) << 56) | (uintptr_t)(handle))
+#define uringOperation(data) ((int)((data) >> 56))
+#define uringHandle(data) ((struct handle *)(uintptr_t)((data) & ((1ULL << 56) - 1)))
+
+/* Envelope types - work handed from one shard to another */
+#define BROADCAST_E 0
+#define PRIVATE_E 1
+#define CHANNEL_E 2
+#define PRESENCE_E 3
+
+/* The shortest entry is a one character name behind its marker, plus the space that separates it from the next */
+#define MAX_PRESENCE_EVENTS (MAX_PAYLOAD_SIZE / 3 + 1)
+
+struct handle {
+	int type;
+	int fd;
+};
 
 struct client {
+	struct handle handle;
+	int slotId;
+	int directoryId;
+	int registered;
 	char name[MAX_NAME_SIZE];
+	char host[MAX_HOST_SIZE];
+	char peer[MAX_PEER_SIZE];
+	int channels[MAX_JOINED_CHANNELS];
+	int numOfChannels;
+	int version;
+	/* How far the shard's presence batch had got when the client was sent the roster, 0 if it's all news to it */
+	int presenceMark;
+	messageReader reader;
+	outQueue outbox;
+	int congested;
+	int closing;
+	struct client *nextDoomed;
+	/* What the shard's byte counters already know about the outbound queue */
+	size_t accountedQueued;
+	size_t accountedSent;
+#ifndef USE_POLL
+	/* io_uring only - the client can't be freed while the kernel (or the dirty list) still refers to it */
+	int pendingOps;
+	int sending;
+	size_t sendBytes;
+	int blocked;
+	int dirty;
+	struct client *nextDirty;
+	struct msghdr sendHeader;
+	struct iovec sendVector[MAX_FLUSH_FRAMES];
+#endif
 };
 
-struct server {
+/*
+	Envelopes carry a reference to an already encoded frame, the receiving shard releases it.
+	Channel envelopes put the channel ID in place of the target slot and the channel name in place of the target.
+*/
+struct envelope {
+	mpscNode node;
+	int type;
+	frame *frame;
+	int targetSlot;
+	char target[MAX_NAME_SIZE];
+};
+
+/* A shard's members of a channel, the name tells whether a channel envelope still concerns them */
+struct shardChannel {
+	char name[MAX_NAME_SIZE];
+	memberSet members;
+};
+
+struct shard {
+	int id;
+	struct server *server;
+	pthread_t thread;
 	int numOfListeners;
-	int numOfMonitors;
+	struct handle *listeners;
+	connectionTable clients;
+	struct client *doomed;
+	struct handle wakeup;
+	atomic_int wakeupPending;
+	mpscQueue inbox;
+	pool pool;
+	struct shardChannel *channels;
+	metrics metrics;
+	/* Joins, departures and nick changes since the last flush, in the PRS_F payload format (see socketcom.h) */
+	char presence[MAX_PAYLOAD_SIZE];
+	int presenceLength;
+#ifdef USE_POLL
+	int monitorCapacity;
 	struct pollfd *monitors;
-	struct client *clients;
+#else
+	int epollFD;
+	struct epoll_event *events;
+	uring ring;
+	uringBuffers buffers;
+	struct client *dirty;
+#endif
 };
 
 /*
-	          Listeners
-	MONITORS: 0 1 ... k | k + 1 2 3 4 5 6 7 8 9 ...
-	 CLIENTS: x x ... x | k + 1 2 3 4 5 6 7 8 9 ...
-	            First client--^
+	Names of all the clients on all the shards for the connect roster, the chosen nicks are also indexed
+	in a hash map (see nickmap.h) that points at the owning shard and connection slot, which is what
+	private messages get routed through and what keeps nicks unique
+*/
+struct directoryEntry {
+	char name[MAX_NAME_SIZE];
+	int shardId;
+	struct client *client;
+};
+
+/*
+	Channels are kept in a fixed registry, indexed by the channel ID. The member count and the name are
+	only ever touched under the channel lock, a channel with no members left is free to be taken by the
+	next new name. The shard mask has a bit for every shard with members in the channel, it's only ever
+	changed by the shard the bit belongs to and read without the lock when a message is fanned out.
+*/
+struct channel {
+	char name[MAX_NAME_SIZE];
+	int members;
+	atomic_uint_least64_t shards;
+};
+
+struct server {
+	char *port;
+	size_t highWatermark;
+	size_t lowWatermark;
+	int slowPolicy;
+	int backend;
+	resolver *resolver;
+	history *history;
+	int replayCount;
+	time_t startTime;
+	statsEndpoint *stats;
+	int numOfShards;
+	struct shard *shards;
+	pthread_mutex_t directoryLock;
+	int directoryLength;
+	int directoryCapacity;
+	struct directoryEntry *directory;
+	nickMap nicks;
+	pthread_mutex_t channelLock;
+	int numOfChannels;
+	struct channel *channels;
+};
+
+/*
+	Every shard is a thread with its own listeners (bound to the same port through SO_REUSEPORT), its own
+	clients and its own event loop, so the kernel spreads incoming connections over the shards. The only
+	shared state is the directory, everything else crosses shards as envelopes pushed into the target
+	shard's lock-free inbox, followed by a poke on its wakeup eventfd.
+
+	The default backend is an edge-triggered epoll loop: every registered descriptor carries a pointer
+	to its handle, so a wakeup only touches the connections that actually have activity.
+
+	Clients live in a growable connection table (see contable.h), so there's no limit on their number
+	other than the descriptor limit, which gets raised as far as the hard limit allows.
+
+	Client records, frames, queue nodes and envelopes all come out of the shard's pool (see pool.h), so
+	a shard that has grown to fit its load relays messages without calling malloc or free.
+
+	The io_uring backend (--backend io_uring) keeps a multishot accept armed on every listener and a
+	multishot recv on every client, with the data landing in a ring of provided buffers shared by the
+	whole shard. Sends all go through the outbound queues: every client that gets something queued is
+	put on the dirty list, which is turned into one sendmsg per client at the end of the loop iteration
+	and submitted together with a single io_uring_enter, which also waits for the next completions.
+	The sends don't wait for room in the socket, one that comes back short marks the client as blocked
+	until a poll says the socket is writable again - only then do the watermarks apply, same as with epoll.
+
+	Compiling with -DUSE_POLL falls back to the old poll loop, where the monitor array is kept aligned
+	with the dense array of the connection table:
+
+	          Listeners    Wakeup
+	MONITORS: 0 1 ... k  | k + 1  | k + 2 k + 3 k + 4 ...
+	   DENSE:                       0     1     2     ...
+	                                ^--First client
 
 	Note: There's usually two listeners, one for IPv4 and one for IPv6
+
+	Nothing is ever written to a client socket behind its outbound queue's back. Whatever the socket won't
+	take right away waits in the queue until the socket reports that it's writable again. Once the queue
+	goes over the high watermark the client is congested, and depending on the slow consumer policy it's
+	either dropped or gets no new messages until the queue shrinks below the low watermark.
+
+	Clients are never freed in the middle of an event loop iteration, since a broadcast can find a slow
+	consumer while other handlers still hold pointers to it. They're marked as closing and put on the
+	doomed list instead, which gets reaped at the end of the iteration.
+
+	Client addresses are taken down in numeric form when they connect, so logging never waits on a name
+	server. With --resolve-hosts, a resolver thread (see resolver.h) looks the hostnames up in the background
+	and the log lines pick them up once they're known. Logging itself is asynchronous as well (see logger.h),
+	the event loops only ever drop fixed size records into a lock-free ring.
+
+	Every shard keeps counters and latency histograms of its own (see metrics.h), which only it writes
+	to. With --stats-socket, a UNIX socket hands out a report that adds all of them up.
+
+	With --history, chat and private messages are also appended to memory mapped segment files (see history.h)
+	and every client that connects gets the last --history-replay chat messages sent straight out of them.
+
+	Joins, departures and nick changes aren't broadcast one by one. Each shard writes them down as they
+	happen and sends them out together when it reaps its clients at the end of the loop iteration, as a
+	single PRS_F frame for every client and every other shard, so a storm of reconnects costs a frame per
+	client per iteration instead of a frame per client per reconnect. Version 1 clients don't know PRS_F,
+	each shard turns a batch back into the old CON_F, DIS_F and NIC_F signals for the ones it has.
+
+	Regular messages go to everyone, channel messages only to the channel's members. Every shard keeps the
+	slot IDs of its members of each channel in a sorted set (see memberset.h), and the channel registry
+	knows which shards have any members at all - a channel message costs one envelope per shard that has
+	members and one send per member, no matter how many other clients there are.
 */
 
-void initServer(struct server *server, char *port);
+void initServer(struct server *server, char *port, int numOfShards, size_t highWatermark, size_t lowWatermark, int slowPolicy, int backend, int resolveHosts, history *chatHistory, int replayCount);
 void killServer(struct server *server);
-int acceptClient(struct server *server, int listeningSocketFD);
-void killClient(struct server *server, int clientId);
-int broadcast(struct server *server, uint32_t type, char *name, char *payload, ...);
-int findByName(struct server *server, char *target);
+void initShard(struct shard *shard, struct server *server, int id);
+void killShard(struct shard *shard);
+void *runShard(void *arg);
+int watchClient(struct shard *shard, struct client *client);
+void unwatchClient(struct shard *shard, struct client *client);
+int acceptClients(struct shard *shard, struct handle *listener);
+struct client *admitClient(struct shard *shard, int clientSocketFD, struct sockaddr_storage *address, socklen_t addressLength);
+void serviceClient(struct shard *shard, struct client *client);
+int dispatchMessages(struct shard *shard, struct client *client);
+void dispatchMessage(struct shard *shard, struct client *client, char *messageStart);
+void flushClient(struct shard *shard, struct client *client);
+void dropClient(struct shard *shard, struct client *client);
+void checkCongestion(struct shard *shard, struct client *client);
+void logClient(struct shard *shard, struct client *client, int event);
+void accountClient(struct shard *shard, struct client *client);
+void reportStats(FILE *out, void *arg);
+void reapClients(struct shard *shard);
+void killClient(struct shard *shard, struct client *client);
+void freeClient(struct client *client);
+int sendFrame(struct shard *shard, struct client *client, frame *f);
+int sendToClient(struct shard *shard, struct client *client, uint32_t type, char *name, char *payload);
+int deliver(struct shard *shard, frame *f, struct client *exclude);
+int broadcast(struct shard *shard, uint32_t type, char *name, char *payload, struct client *exclude);
+int broadcastFrame(struct shard *shard, frame *f, struct client *exclude);
+int deliverChannel(struct shard *shard, int channelId, char *name, frame *f, struct client *exclude);
+int channelcast(struct shard *shard, int channelId, uint32_t type, char *name, char *payload, struct client *exclude);
+int channelcastFrame(struct shard *shard, int channelId, frame *f, struct client *exclude);
 
-int handleRegular(struct server *server, message *msg, int id);
-int handlePrivate(struct server *server, message *msg, int id);
-int handleConnect(struct server *server, message *msg, int id);
-int handleNickname(struct server *server, message *msg, int id);
+/* presence */
+int notePresence(struct shard *shard, char event, char *name, char *newName);
+int flushPresence(struct shard *shard);
+int deliverPresence(struct shard *shard, frame *f);
+int sendPresence(struct shard *shard, struct client *client, frame *f, frame *events[], int *numOfEvents);
+int expandPresence(frame *f, frame *events[]);
+
+#ifndef USE_POLL
+/* io_uring backend */
+void *runUringShard(void *arg);
+int armUringAccept(struct shard *shard, struct handle *listener);
+int armUringWakeup(struct shard *shard);
+int armUringRecv(struct shard *shard, struct client *client);
+void completeUringRecv(struct shard *shard, struct client *client, int result, unsigned flags);
+void completeUringSend(struct shard *shard, struct client *client, int result);
+void completeUringWritable(struct shard *shard, struct client *client);
+void markDirty(struct shard *shard, struct client *client);
+void submitSends(struct shard *shard);
+void settleClient(struct client *client);
+#endif
+
+/* cross-shard */
+int postEnvelope(struct shard *shard, struct shard *target, int type, frame *f, int targetSlot, char *targetName);
+void drainInbox(struct shard *shard);
+
+/* directory */
+int registerClient(struct server *server, struct shard *shard, struct client *client);
+void unregisterClient(struct server *server, struct client *client);
+int renameClient(struct server *server, struct shard *shard, struct client *client, char *newName);
+int lookupClient(struct server *server, char *name, int *shardId, int *slotId);
+
+/* channels */
+int joinChannel(struct shard *shard, struct client *client, char *name);
+void partChannel(struct shard *shard, struct client *client, int position);
+int findJoinedChannel(struct shard *shard, struct client *client, char *name);
+
+int handleRegular(struct shard *shard, message *msg, struct client *client);
+int handlePrivate(struct shard *shard, message *msg, struct client *client);
+int handleConnect(struct shard *shard, message *msg, struct client *client);
+int handleNickname(struct shard *shard, message *msg, struct client *client);
+int handleJoin(struct shard *shard, message *msg, struct client *client);
+int handlePart(struct shard *shard, message *msg, struct client *client);
+int handleList(struct shard *shard, message *msg, struct client *client);
+int handleChannel(struct shard *shard, message *msg, struct client *client);
 
 int main(int argc, char *argv[]) {
 
 	/* Server init */
 	char *port = DEFAULT_PORT;
-	if(argc >= 2)
-		port = argv[1];
-
-	struct server server;
-	initServer(&server, port);
+	int numOfThreads = 1;
+	long highWatermark = DEFAULT_HIGH_WATERMARK, lowWatermark = DEFAULT_LOW_WATERMARK;
+	int slowPolicy = DROP_CLIENT_P;
+	int backend = EPOLL_B;
+	int resolveHosts = 0;
+	loggerConfig logConfig;
+	defaultLoggerConfig(&logConfig);
+	char *separator;
+	int event;
+	char *historyDirectory = NULL;
+	long historySegmentSize = DEFAULT_HISTORY_SEGMENT_SIZE;
+	int historySegments = DEFAULT_HISTORY_SEGMENTS;
+	long historyMaxAge = 0;
+	int replayCount = DEFAULT_HISTORY_REPLAY;
+	char *statsPath = NULL;
 
-	printf("Server successfully started on port %s\n", port);
- 
-	while(1)
+	struct option options[] =
 	{
-		checkError(poll(server.monitors, server.numOfMonitors, -1) == -1, "poll");
-		int currentConnections = server.numOfMonitors;
-
-		/* Looping through all the active monitors */
-		for(int i = 0; i < currentConnections; i++)
+		{"threads", required_argument, NULL, 't'},
+		{"high-watermark", required_argument, NULL, 'H'},
+		{"low-watermark", required_argument, NULL, 'L'},
+		{"slow-policy", required_argument, NULL, 'p'},
+		{"backend", required_argument, NULL, 'b'},
+		{"resolve-hosts", no_argument, NULL, 'r'},
+		{"log-file", required_argument, NULL, 'f'},
+		{"log-file-size", required_argument, NULL, 'S'},
+		{"log-files", required_argument, NULL, 'k'},
+		{"log-level", required_argument, NULL, 'l'},
+		{"log-sample", required_argument, NULL, 's'},
+		{"history", required_argument, NULL, 'd'},
+		{"history-replay", required_argument, NULL, 'n'},
+		{"history-segment-size", required_argument, NULL, 'z'},
+		{"history-segments", required_argument, NULL, 'g'},
+		{"history-max-age", required_argument, NULL, 'a'},
+		{"stats-socket", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0}
+	};
+	int option;
+	while((option = getopt_long(argc, argv, "t:H:L:p:b:rf:S:k:l:s:d:n:z:g:a:m:", options, NULL)) != -1)
+	{
+		switch(option)
 		{
-			/* If there is activity on the current monitor */
-			if(server.monitors[i].revents & POLLIN)
-			{
-				/* And it's from one of the listening sockets */
-				if(i < server.numOfListeners)
+			case 't':
+				numOfThreads = atoi(optarg);
+				break;
+			case 'H':
+				highWatermark = atol(optarg);
+				break;
+			case 'L':
+				lowWatermark = atol(optarg);
+				break;
+			case 'p':
+				if(strcmp(optarg, "drop-client") == 0)
+					slowPolicy = DROP_CLIENT_P;
+				else if(strcmp(optarg, "drop-messages") == 0)
+					slowPolicy = DROP_MESSAGES_P;
+				else
 				{
-					/* It means that we have a new connection, so we're attempting to accepting it */
-					if(acceptClient(&server, server.monitors[i].fd) != -1)
-					{
-						printf("New connection from ");
-						checkError(printPeerInfo(server.monitors[server.numOfMonitors - 1].fd) == -1, "printPeerInfo");
-						sendMessageStream(server.monitors[server.numOfMonitors - 1].fd, SIG_M | REG_F, "SERVER", "To set a name, do /nick <name>");
-					}
-					else
-						printf("A client failed to connect to the server\n");
+					fprintf(stderr, "The slow policy has to be either drop-client or drop-messages\n");
+					exit(EXIT_FAILURE);
 				}
-				/* If it's not from the listening socket monitor */
+				break;
+			case 'b':
+#ifndef USE_POLL
+				if(strcmp(optarg, "epoll") == 0)
+					backend = EPOLL_B;
+				else if(strcmp(optarg, "io_uring") == 0)
+					backend = URING_B;
 				else
 				{
-					/* It's from one of the clients, so we're attempting to receive a message */
-					char buffer[TOTAL_BUFFER_SIZE];
-					int receivedTotal = receiveMessageStream(server.monitors[i].fd, buffer);
-
-					/* If client disconnected / there was an error reading from it, close its socket and compress arrays */
-					if(receivedTotal == 0 || receivedTotal == -1)
-					{
-						printf("Client disconnected from ");
-						checkError(printPeerInfo(server.monitors[i].fd) == -1, "printPeerInfo");
-						killClient(&server, i);
-						currentConnections--;
-						continue;
-					}
-
-					/* We're deserializing the message so we can check its type and decide what to do with it */
-					message msg = deserialize_struct_message(buffer);
-
-					/* Remove all non-alphanumeric characters from the message payload */
-					if(sanitize(&msg) == 0 && (msg.type == (REQ_M | REG_F) || msg.type == (REQ_M | PRV_F)))
-						continue;
-
-					/* The server only receives requests and nothing else */
-					if((msg.type & MASK_M) != REQ_M)
-						continue;
-
-					/* We're checking to see if the client name has been tampered with */
-					if(strcmp(msg.name, server.clients[i].name) != 0)
-						continue;
-
-					switch(msg.type & MASK_F)
-					{
-						case REG_F:
-							handleRegular(&server, &msg, i);
-							break;
-						case PRV_F:
-							handlePrivate(&server, &msg, i);
-							break;
-						case CON_F:
-							handleConnect(&server, &msg, i);
-							break;
-						case NIC_F:
-							handleNickname(&server, &msg, i);
-							break;
-					}
+					fprintf(stderr, "The backend has to be either epoll or io_uring\n");
+					exit(EXIT_FAILURE);
 				}
-			}
+#else
+				fprintf(stderr, "This server was built with the poll loop, which is the only backend it has\n");
+				exit(EXIT_FAILURE);
+#endif
+				break;
+			case 'r':
+				resolveHosts = 1;
+				break;
+			case 'f':
+				logConfig.path = optarg;
+				break;
+			case 'S':
+				logConfig.maxFileSize = atol(optarg);
+				break;
+			case 'k':
+				logConfig.maxFiles = atoi(optarg);
+				break;
+			case 'l':
+				logConfig.level = logLevelByName(optarg);
+				if(logConfig.level == -1)
+				{
+					fprintf(stderr, "The log level has to be one of debug, info, warn or error\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				/* EVENT=N logs one in every N occurrences of the event */
+				separator = strchr(optarg, '=');
+				if(separator != NULL)
+					*separator = '\0';
+				event = logEventByName(optarg);
+				if(separator == NULL || event == -1 || atoi(separator + 1) < 1)
+				{
+					fprintf(stderr, "Log sampling is given as EVENT=N, with N at least 1 and EVENT one of connected, disconnected, malformed, slow, refused or nick\n");
+					exit(EXIT_FAILURE);
+				}
+				logConfig.sampling[event] = atoi(separator + 1);
+				break;
+			case 'd':
+				historyDirectory = optarg;
+				break;
+			case 'n':
+				replayCount = atoi(optarg);
+				break;
+			case 'z':
+				historySegmentSize = atol(optarg);
+				break;
+			case 'g':
+				historySegments = atoi(optarg);
+				break;
+			case 'a':
+				historyMaxAge = atol(optarg);
+				break;
+			case 'm':
+				statsPath = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [--threads N] [--high-watermark BYTES] [--low-watermark BYTES] [--slow-policy drop-client|drop-messages] [--backend epoll|io_uring] [--resolve-hosts] [--log-file PATH] [--log-file-size BYTES] [--log-files N] [--log-level debug|info|warn|error] [--log-sample EVENT=N] [--history DIRECTORY] [--history-replay N] [--history-segment-size BYTES] [--history-segments N] [--history-max-age SECONDS] [--stats-socket PATH] [port]\n", argv[0]);
+				exit(EXIT_FAILURE);
 		}
 	}
+	if(optind < argc)
+		port = argv[optind];
+	if(numOfThreads < 1 || numOfThreads > MAX_THREADS)
+	{
+		fprintf(stderr, "The number of threads has to be between 1 and %d\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+	if(logConfig.maxFileSize <= 0 || logConfig.maxFiles < 0)
+	{
+		fprintf(stderr, "The log file size has to be positive and the number of log files can't be negative\n");
+		exit(EXIT_FAILURE);
+	}
+	if(historySegmentSize < MIN_HISTORY_SEGMENT_SIZE || historySegments < 1 || historyMaxAge < 0 || replayCount < 0)
+	{
+		fprintf(stderr, "History segments have to be at least %d bytes, with at least one of them kept, and neither the maximum age nor the replay count can be negative\n", MIN_HISTORY_SEGMENT_SIZE);
+		exit(EXIT_FAILURE);
+	}
+	if(lowWatermark <= 0 || highWatermark < lowWatermark)
+	{
+		fprintf(stderr, "The watermarks have to be positive, with the low one not above the high one\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* A client hanging up mid-send is handled through send's return value */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Every client takes up a descriptor, so we're allowing ourselves as many as we can get */
+	struct rlimit descriptorLimit;
+	if(getrlimit(RLIMIT_NOFILE, &descriptorLimit) == 0 && descriptorLimit.rlim_cur < descriptorLimit.rlim_max)
+	{
+		descriptorLimit.rlim_cur = descriptorLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &descriptorLimit);
+	}
+
+	history chatHistory;
+	if(historyDirectory != NULL)
+		checkError(openHistory(&chatHistory, historyDirectory, historySegmentSize, historySegments, historyMaxAge) == -1, "SERVER INIT FATAL ERROR - openHistory");
+
+	struct server server;
+	initServer(&server, port, numOfThreads, highWatermark, lowWatermark, slowPolicy, backend, resolveHosts, (historyDirectory != NULL) ? &chatHistory : NULL, replayCount);
+
+	statsEndpoint stats;
+	if(statsPath != NULL)
+	{
+		checkError(startStatsEndpoint(&stats, statsPath, reportStats, &server) == -1, "SERVER INIT FATAL ERROR - startStatsEndpoint");
+		server.stats = &stats;
+	}
+
+	logConfig.resolver = server.resolver;
+	checkError(startLogger(&logConfig) == -1, "SERVER INIT FATAL ERROR - startLogger");
+	logEvent(STARTED_E, -1, port, NULL, numOfThreads);
+
+	void *(*run)(void *) = runShard;
+#ifndef USE_POLL
+	if(backend == URING_B)
+		run = runUringShard;
+#endif
+
+	/* The first shard runs on the main thread */
+	for(int i = 1; i < server.numOfShards; i++)
+		checkError(pthread_create(&server.shards[i].thread, NULL, run, &server.shards[i]) != 0, "pthread_create");
+	run(&server.shards[0]);
 
 	/* We never get here */
+	for(int i = 1; i < server.numOfShards; i++)
+		pthread_join(server.shards[i].thread, NULL);
+	if(server.stats != NULL)
+		stopStatsEndpoint(server.stats);
+	stopLogger();
 	killServer(&server);
+	if(historyDirectory != NULL)
+		closeHistory(&chatHistory);
 	exit(EXIT_SUCCESS);
 }
 
-void initServer(struct server *server, char *port) {
+void initServer(struct server *server, char *port, int numOfShards, size_t highWatermark, size_t lowWatermark, int slowPolicy, int backend, int resolveHosts, history *chatHistory, int replayCount) {
+	server->port = port;
+	server->highWatermark = highWatermark;
+	server->lowWatermark = lowWatermark;
+	server->slowPolicy = slowPolicy;
+	server->backend = backend;
+	server->history = chatHistory;
+	server->replayCount = replayCount;
+	server->startTime = time(NULL);
+	server->stats = NULL;
+	server->resolver = NULL;
+	if(resolveHosts)
+	{
+		server->resolver = malloc(sizeof(resolver));
+		checkError(server->resolver == NULL, "SERVER INIT FATAL ERROR - resolver malloc");
+		checkError(startResolver(server->resolver, DEFAULT_RESOLVER_TTL) == -1, "SERVER INIT FATAL ERROR - startResolver");
+	}
+
+	checkError(pthread_mutex_init(&server->directoryLock, NULL) != 0, "SERVER INIT FATAL ERROR - pthread_mutex_init");
+	server->directoryCapacity = numOfShards * INITIAL_CONNECTIONS;
+	server->directory = malloc(server->directoryCapacity * sizeof(struct directoryEntry));
+	checkError(server->directory == NULL, "SERVER INIT FATAL ERROR - directory malloc");
+	server->directoryLength = 0;
+	checkError(initNickMap(&server->nicks, server->directoryCapacity) == -1, "SERVER INIT FATAL ERROR - nick map malloc");
+
+	/* The registry never moves, since the shard masks are read without the lock */
+	checkError(pthread_mutex_init(&server->channelLock, NULL) != 0, "SERVER INIT FATAL ERROR - pthread_mutex_init");
+	server->channels = malloc(MAX_CHANNELS * sizeof(struct channel));
+	checkError(server->channels == NULL, "SERVER INIT FATAL ERROR - channels malloc");
+	for(int i = 0; i < MAX_CHANNELS; i++)
+	{
+		strcpy(server->channels[i].name, "");
+		server->channels[i].members = 0;
+		atomic_init(&server->channels[i].shards, 0);
+	}
+	server->numOfChannels = 0;
+
+	server->shards = malloc(numOfShards * sizeof(struct shard));
+	checkError(server->shards == NULL, "SERVER INIT FATAL ERROR - shards malloc");
+	server->numOfShards = numOfShards;
+	for(int i = 0; i < numOfShards; i++)
+		initShard(&server->shards[i], server, i);
+}
+
+void killServer(struct server *server) {
+	for(int i = 0; i < server->numOfShards; i++)
+		killShard(&server->shards[i]);
+	/* Only now, since a shard's frames can still sit in the queues of the shards killed after it */
+	for(int i = 0; i < server->numOfShards; i++)
+		freePool(&server->shards[i].pool);
+	server->numOfShards = 0;
+	free(server->shards);
+	free(server->directory);
+	freeNickMap(&server->nicks);
+	pthread_mutex_destroy(&server->directoryLock);
+	free(server->channels);
+	pthread_mutex_destroy(&server->channelLock);
+	if(server->resolver != NULL)
+	{
+		stopResolver(server->resolver);
+		free(server->resolver);
+	}
+}
+
+void initShard(struct shard *shard, struct server *server, int id) {
+	shard->id = id;
+	shard->server = server;
+
+	/* Each shard gets its own set of listeners, SO_REUSEPORT lets the kernel balance between them */
 	int *listeners;
-	int numOfListeners = createListeners(&listeners, port);
+	int numOfListeners = createListeners(&listeners, server->port);
 	checkError(numOfListeners == -1, "SERVER INIT FATAL ERROR - createListeners");
-	
-	int totalNumOfMonitors = numOfListeners + MAX_CONNECTIONS;
 
-	server->monitors = malloc(totalNumOfMonitors * sizeof(struct pollfd));
-	checkError(server->monitors == NULL, "SERVER INIT FATAL ERROR - monitors malloc");
-	memset(server->monitors, 0, sizeof(totalNumOfMonitors * sizeof(struct pollfd)));
+	shard->listeners = malloc(numOfListeners * sizeof(struct handle));
+	checkError(shard->listeners == NULL, "SERVER INIT FATAL ERROR - listeners malloc");
 
-	/* 
-		We want to keep the monitor and client array indexes aligned to each other
-		for simplicity's sake, so we're allocating totalNumOfMonitors clients
-		and keeping the first numOfListeners clients unused.
-	*/
-	server->clients = malloc(totalNumOfMonitors * sizeof(struct client));
-	checkError(server->clients == NULL, "SERVER INIT FATAL ERROR - clients malloc");
-	memset(server->clients, 0, sizeof(totalNumOfMonitors * sizeof(struct pollfd)));
+	checkError(initConnectionTable(&shard->clients, INITIAL_CONNECTIONS) == -1, "SERVER INIT FATAL ERROR - initConnectionTable");
+
+	shard->wakeup.type = WAKEUP_H;
+	shard->wakeup.fd = eventfd(0, EFD_NONBLOCK);
+	checkError(shard->wakeup.fd == -1, "SERVER INIT FATAL ERROR - eventfd");
+	atomic_init(&shard->wakeupPending, 0);
+	initMpscQueue(&shard->inbox);
+	initPool(&shard->pool);
+	initMetrics(&shard->metrics);
+	shard->presenceLength = 0;
+
+	shard->channels = malloc(MAX_CHANNELS * sizeof(struct shardChannel));
+	checkError(shard->channels == NULL, "SERVER INIT FATAL ERROR - shard channels malloc");
+	for(int i = 0; i < MAX_CHANNELS; i++)
+	{
+		strcpy(shard->channels[i].name, "");
+		initMemberSet(&shard->channels[i].members);
+	}
+
+#ifdef USE_POLL
+	shard->monitorCapacity = numOfListeners + 1 + INITIAL_CONNECTIONS;
+	shard->monitors = malloc(shard->monitorCapacity * sizeof(struct pollfd));
+	checkError(shard->monitors == NULL, "SERVER INIT FATAL ERROR - monitors malloc");
+	memset(shard->monitors, 0, shard->monitorCapacity * sizeof(struct pollfd));
+	shard->monitors[numOfListeners].fd = shard->wakeup.fd;
+	shard->monitors[numOfListeners].events = POLLIN;
+#else
+	struct epoll_event event;
+	shard->dirty = NULL;
+	if(server->backend == URING_B)
+	{
+		/* Everything gets armed once the shard starts running */
+		checkError(initUring(&shard->ring, URING_ENTRIES) == -1, "SERVER INIT FATAL ERROR - io_uring_setup");
+		checkError(initUringBuffers(&shard->ring, &shard->buffers, 0, URING_BUFFERS, URING_BUFFER_SIZE) == -1, "SERVER INIT FATAL ERROR - io_uring provided buffers");
+	}
+	else
+	{
+		shard->epollFD = epoll_create1(0);
+		checkError(shard->epollFD == -1, "SERVER INIT FATAL ERROR - epoll_create1");
+		shard->events = malloc(MAX_EVENTS * sizeof(struct epoll_event));
+		checkError(shard->events == NULL, "SERVER INIT FATAL ERROR - events malloc");
+
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = &shard->wakeup;
+		checkError(epoll_ctl(shard->epollFD, EPOLL_CTL_ADD, shard->wakeup.fd, &event) == -1, "SERVER INIT FATAL ERROR - epoll_ctl");
+	}
+#endif
 
 	for(int i = 0; i < numOfListeners; i++)
 	{
-		server->monitors[i].fd = listeners[i];
-		server->monitors[i].events = POLLIN;
+		shard->listeners[i].type = LISTENER_H;
+		shard->listeners[i].fd = listeners[i];
+#ifdef USE_POLL
+		shard->monitors[i].fd = listeners[i];
+		shard->monitors[i].events = POLLIN;
+#else
+		if(server->backend == URING_B)
+			continue;
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = &shard->listeners[i];
+		checkError(epoll_ctl(shard->epollFD, EPOLL_CTL_ADD, listeners[i], &event) == -1, "SERVER INIT FATAL ERROR - epoll_ctl");
+#endif
 	}
-	server->numOfListeners = numOfListeners;
-	server->numOfMonitors = numOfListeners;
+	shard->numOfListeners = numOfListeners;
+	shard->doomed = NULL;
 	free(listeners);
 }
 
-void killServer(struct server *server) {
-	server->numOfListeners = 0;
-	server->numOfMonitors = 0;
-	free(server->monitors);
-	free(server->clients);
+void killShard(struct shard *shard) {
+	while(shard->clients.length > 0)
+		killClient(shard, connectionAt(&shard->clients, shard->clients.length - 1));
+	for(int i = 0; i < shard->numOfListeners; i++)
+		close(shard->listeners[i].fd);
+	shard->numOfListeners = 0;
+	drainInbox(shard);
+	close(shard->wakeup.fd);
+#ifdef USE_POLL
+	free(shard->monitors);
+#else
+	if(shard->server->backend == URING_B)
+	{
+		freeUring(&shard->ring);
+		freeUringBuffers(&shard->buffers);
+	}
+	else
+	{
+		close(shard->epollFD);
+		free(shard->events);
+	}
+#endif
+	free(shard->listeners);
+	freeConnectionTable(&shard->clients);
+	for(int i = 0; i < MAX_CHANNELS; i++)
+		freeMemberSet(&shard->channels[i].members);
+	free(shard->channels);
+}
+
+#ifdef USE_POLL
+void *runShard(void *arg) {
+	struct shard *shard = arg;
+	bindPool(&shard->pool);
+	while(1)
+	{
+		int clientOffset = shard->numOfListeners + 1;
+		int numOfMonitors = clientOffset + shard->clients.length;
+		checkError(poll(shard->monitors, numOfMonitors, -1) == -1, "poll");
+		struct timespec start;
+		startTimer(&start);
+
+		/* Looping through all the active monitors - new clients get appended, so we walk backwards */
+		for(int i = numOfMonitors - 1; i >= 0; i--)
+		{
+			short revents = shard->monitors[i].revents;
+			if(i < shard->numOfListeners)
+			{
+				if(revents & POLLIN)
+					acceptClients(shard, &shard->listeners[i]);
+			}
+			else if(i == shard->numOfListeners)
+			{
+				if(revents & POLLIN)
+					drainInbox(shard);
+			}
+			else
+			{
+				struct client *client = connectionAt(&shard->clients, i - clientOffset);
+				if(!client->closing && (revents & POLLOUT))
+					flushClient(shard, client);
+				if(!client->closing && (revents & (POLLIN | POLLHUP | POLLERR)))
+					serviceClient(shard, client);
+			}
+		}
+		reapClients(shard);
+		stopTimer(&shard->metrics, LOOP_T, &start);
+	}
+	return NULL;
+}
+#else
+void *runShard(void *arg) {
+	struct shard *shard = arg;
+	bindPool(&shard->pool);
+	while(1)
+	{
+		int numOfEvents = epoll_wait(shard->epollFD, shard->events, MAX_EVENTS, -1);
+		if(numOfEvents == -1 && errno == EINTR)
+			continue;
+		checkError(numOfEvents == -1, "epoll_wait");
+		struct timespec start;
+		startTimer(&start);
+
+		/* Only the descriptors with activity are reported, each one carrying its handle */
+		for(int i = 0; i < numOfEvents; i++)
+		{
+			struct handle *handle = shard->events[i].data.ptr;
+			uint32_t events = shard->events[i].events;
+			struct client *client;
+			switch(handle->type)
+			{
+				case LISTENER_H:
+					acceptClients(shard, handle);
+					break;
+				case WAKEUP_H:
+					drainInbox(shard);
+					break;
+				case CLIENT_H:
+					client = (struct client *)handle;
+					if(!client->closing && (events & EPOLLOUT))
+						flushClient(shard, client);
+					if(!client->closing && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+						serviceClient(shard, client);
+					break;
+			}
+		}
+		reapClients(shard);
+		stopTimer(&shard->metrics, LOOP_T, &start);
+	}
+	return NULL;
 }
+#endif
 
-int acceptClient(struct server *server, int listeningSocketFD) {
-	int clientSocketFD = acceptConnection(listeningSocketFD);
-	if(clientSocketFD == -1)
+#ifndef USE_POLL
+void *runUringShard(void *arg) {
+	struct shard *shard = arg;
+	bindPool(&shard->pool);
+	for(int i = 0; i < shard->numOfListeners; i++)
+		checkError(armUringAccept(shard, &shard->listeners[i]) == -1, "armUringAccept");
+	checkError(armUringWakeup(shard) == -1, "armUringWakeup");
+	struct timespec start;
+	int busy = 0;
+	while(1)
+	{
+		/* All of the iteration's sends go in along with the wait for what comes next */
+		submitSends(shard);
+
+		/* An iteration is timed up to the wait, so preparing its sends counts towards it */
+		if(busy)
+			stopTimer(&shard->metrics, LOOP_T, &start);
+		if(submitUring(&shard->ring, 1) == -1)
+			checkError(errno != EINTR && errno != EBUSY, "io_uring_enter");
+		startTimer(&start);
+		busy = 1;
+
+		struct io_uring_cqe *cqe;
+		while((cqe = peekUringCompletion(&shard->ring)) != NULL)
+		{
+			uint64_t data = cqe->user_data;
+			int result = cqe->res;
+			unsigned flags = cqe->flags;
+			advanceUringCompletions(&shard->ring);
+
+			struct handle *handle = uringHandle(data);
+			switch(uringOperation(data))
+			{
+				case ACCEPT_O:
+					if(result >= 0)
+						admitClient(shard, result, NULL, 0);
+					else
+						logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+					if(!(flags & IORING_CQE_F_MORE))
+						checkError(armUringAccept(shard, handle) == -1, "armUringAccept");
+					break;
+				case WAKEUP_O:
+					drainInbox(shard);
+					if(!(flags & IORING_CQE_F_MORE))
+						checkError(armUringWakeup(shard) == -1, "armUringWakeup");
+					break;
+				case RECV_O:
+					completeUringRecv(shard, (struct client *)handle, result, flags);
+					break;
+				case SEND_O:
+					completeUringSend(shard, (struct client *)handle, result);
+					break;
+				case WRITABLE_O:
+					completeUringWritable(shard, (struct client *)handle);
+					break;
+			}
+		}
+		reapClients(shard);
+	}
+	return NULL;
+}
+
+int armUringAccept(struct shard *shard, struct handle *listener) {
+	struct io_uring_sqe *sqe = nextUringEntry(&shard->ring);
+	if(sqe == NULL)
 		return -1;
-	if(server->numOfMonitors - server->numOfListeners == MAX_CONNECTIONS)
+	prepareUringAccept(sqe, listener->fd, uringData(ACCEPT_O, listener));
+	return 0;
+}
+
+int armUringWakeup(struct shard *shard) {
+	struct io_uring_sqe *sqe = nextUringEntry(&shard->ring);
+	if(sqe == NULL)
+		return -1;
+	prepareUringPoll(sqe, shard->wakeup.fd, POLLIN, 1, uringData(WAKEUP_O, &shard->wakeup));
+	return 0;
+}
+
+int armUringRecv(struct shard *shard, struct client *client) {
+	struct io_uring_sqe *sqe = nextUringEntry(&shard->ring);
+	if(sqe == NULL)
+		return -1;
+	prepareUringRecv(sqe, client->handle.fd, &shard->buffers, uringData(RECV_O, client));
+	client->pendingOps++;
+	return 0;
+}
+
+/* Same as serviceClient, except that the data has already been received into one of the provided buffers */
+void completeUringRecv(struct shard *shard, struct client *client, int result, unsigned flags) {
+	if(result > 0)
+	{
+		int bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+		char *data = uringBuffer(&shard->buffers, bufferId);
+		addCounter(&shard->metrics, BYTES_IN_C, result);
+		while(result > 0 && !client->closing)
+		{
+			int fed = feedMessageReader(&client->reader, data, result);
+			data += fed;
+			result -= fed;
+			dispatchMessages(shard, client);
+		}
+		recycleUringBuffer(&shard->buffers, bufferId);
+	}
+	/* Running out of provided buffers only stops the recv, it gets armed again below */
+	else if(result != -ENOBUFS && !client->closing)
+	{
+		logClient(shard, client, DISCONNECTED_E);
+		dropClient(shard, client);
+	}
+	if(!(flags & IORING_CQE_F_MORE))
+	{
+		client->pendingOps--;
+		if(!client->closing && armUringRecv(shard, client) == -1)
+			dropClient(shard, client);
+	}
+	settleClient(client);
+}
+
+void completeUringSend(struct shard *shard, struct client *client, int result) {
+	client->sending = 0;
+	client->pendingOps--;
+	if(result == -EAGAIN)
+		result = 0;
+	if(result < 0)
+		dropClient(shard, client);
+	else
+	{
+		consumeOutQueue(&client->outbox, result);
+		accountClient(shard, client);
+		if(client->outbox.queuedBytes < shard->server->lowWatermark)
+			client->congested = 0;
+		if((size_t)result < client->sendBytes && !client->closing)
+		{
+			/* The socket is full, the rest waits until it's writable again */
+			addCounter(&shard->metrics, PARTIAL_SENDS_C, 1);
+			struct io_uring_sqe *sqe = nextUringEntry(&shard->ring);
+			if(sqe == NULL)
+				dropClient(shard, client);
+			else
+			{
+				prepareUringPoll(sqe, client->handle.fd, POLLOUT, 0, uringData(WRITABLE_O, client));
+				client->pendingOps++;
+				client->blocked = 1;
+				checkCongestion(shard, client);
+			}
+		}
+		else if(client->outbox.head != NULL)
+			markDirty(shard, client);
+	}
+	settleClient(client);
+}
+
+void completeUringWritable(struct shard *shard, struct client *client) {
+	client->pendingOps--;
+	client->blocked = 0;
+	if(client->outbox.head != NULL)
+		markDirty(shard, client);
+	settleClient(client);
+}
+
+/* Being on the dirty list counts as a pending operation, so the client can't get freed while it's there */
+void markDirty(struct shard *shard, struct client *client) {
+	if(client->dirty || client->closing)
+		return;
+	client->dirty = 1;
+	client->pendingOps++;
+	client->nextDirty = shard->dirty;
+	shard->dirty = client;
+}
+
+/* Every client gets at most one send in flight, so its frames can't get reordered */
+void submitSends(struct shard *shard) {
+	while(shard->dirty != NULL)
+	{
+		struct client *client = shard->dirty;
+		shard->dirty = client->nextDirty;
+		client->dirty = 0;
+		client->pendingOps--;
+		if(!client->closing && !client->sending && !client->blocked && client->outbox.head != NULL)
+		{
+			struct io_uring_sqe *sqe = nextUringEntry(&shard->ring);
+			if(sqe == NULL)
+				dropClient(shard, client);
+			else
+			{
+				int count;
+				client->sendBytes = gatherOutQueue(&client->outbox, client->sendVector, MAX_FLUSH_FRAMES, &count);
+				memset(&client->sendHeader, 0, sizeof(struct msghdr));
+				client->sendHeader.msg_iov = client->sendVector;
+				client->sendHeader.msg_iovlen = count;
+				prepareUringSendmsg(sqe, client->handle.fd, &client->sendHeader, MSG_NOSIGNAL | MSG_DONTWAIT, uringData(SEND_O, client));
+				client->sending = 1;
+				client->pendingOps++;
+			}
+		}
+		settleClient(client);
+	}
+}
+
+/* A killed client gets freed once the last operation referring to it is done */
+void settleClient(struct client *client) {
+	if(client->slotId == -1 && client->pendingOps == 0)
+		freeClient(client);
+}
+#endif
+
+int watchClient(struct shard *shard, struct client *client) {
+#ifdef USE_POLL
+	int clientOffset = shard->numOfListeners + 1;
+	if(clientOffset + shard->clients.length > shard->monitorCapacity)
+	{
+		struct pollfd *monitors = realloc(shard->monitors, 2 * shard->monitorCapacity * sizeof(struct pollfd));
+		if(monitors == NULL)
+			return -1;
+		shard->monitors = monitors;
+		shard->monitorCapacity *= 2;
+	}
+	struct pollfd *monitor = &shard->monitors[clientOffset + connectionPosition(&shard->clients, client->slotId)];
+	monitor->fd = client->handle.fd;
+	monitor->events = POLLIN;
+	monitor->revents = 0;
+	return 0;
+#else
+	if(shard->server->backend == URING_B)
+		return armUringRecv(shard, client);
+
+	/* Edge-triggered EPOLLOUT only fires once a full socket drains, so it can stay registered for good */
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = &client->handle;
+	return epoll_ctl(shard->epollFD, EPOLL_CTL_ADD, client->handle.fd, &event);
+#endif
+}
+
+void unwatchClient(struct shard *shard, struct client *client) {
+#ifdef USE_POLL
+	/* Mirroring the connection table - the last monitor takes the place of the removed one */
+	int clientOffset = shard->numOfListeners + 1;
+	int position = connectionPosition(&shard->clients, client->slotId);
+	shard->monitors[clientOffset + position] = shard->monitors[clientOffset + shard->clients.length - 1];
+#else
+	/* Shutting the socket down completes whatever io_uring still has going on it */
+	if(shard->server->backend == URING_B)
+		shutdown(client->handle.fd, SHUT_RDWR);
+	else
+		epoll_ctl(shard->epollFD, EPOLL_CTL_DEL, client->handle.fd, NULL);
+#endif
+}
+
+/* With an edge-triggered listener we have to keep accepting until the backlog is empty */
+int acceptClients(struct shard *shard, struct handle *listener) {
+	int accepted = 0;
+	while(1)
+	{
+		struct sockaddr_storage address;
+		socklen_t addressLength;
+		int clientSocketFD = acceptConnection(listener->fd, &address, &addressLength);
+		if(clientSocketFD == -1)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+			break;
+		}
+		if(admitClient(shard, clientSocketFD, &address, addressLength) != NULL)
+			accepted++;
+	}
+	return accepted;
+}
+
+/* Sets up a freshly accepted connection, the socket gets closed if that fails */
+struct client *admitClient(struct shard *shard, int clientSocketFD, struct sockaddr_storage *address, socklen_t addressLength) {
+	struct client *client = poolAlloc(sizeof(struct client));
+	if(client == NULL)
+	{
+		close(clientSocketFD);
+		logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+		return NULL;
+	}
+	client->handle.type = CLIENT_H;
+	client->handle.fd = clientSocketFD;
+	strcpy(client->name, DEFAULT_NAME);
+
+	/* Multishot accepts don't hand the address over, so it has to be asked for */
+	struct sockaddr_storage peerAddress;
+	if(address == NULL)
+	{
+		address = &peerAddress;
+		addressLength = sizeof(struct sockaddr_storage);
+		if(getpeername(clientSocketFD, (struct sockaddr*)address, &addressLength) == -1)
+			addressLength = 0;
+	}
+	if(addressLength == 0 || describeAddress((struct sockaddr*)address, addressLength, client->host, client->peer) == -1)
+	{
+		strcpy(client->host, "");
+		strcpy(client->peer, "an unknown address");
+	}
+	else if(shard->server->resolver != NULL)
+		requestHostname(shard->server->resolver, (struct sockaddr*)address, addressLength, client->host);
+
+	client->version = PROTOCOL_V1;
+	client->presenceMark = 0;
+	initMessageReader(&client->reader);
+	initOutQueue(&client->outbox);
+	client->congested = 0;
+	client->closing = 0;
+	client->registered = 0;
+	client->numOfChannels = 0;
+	client->nextDoomed = NULL;
+	client->accountedQueued = 0;
+	client->accountedSent = 0;
+#ifndef USE_POLL
+	client->pendingOps = 0;
+	client->sending = 0;
+	client->blocked = 0;
+	client->dirty = 0;
+	client->nextDirty = NULL;
+#endif
+	client->slotId = insertConnection(&shard->clients, client);
+	if(client->slotId == -1)
 	{
 		close(clientSocketFD);
+		poolFree(client);
+		logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+		return NULL;
+	}
+	if(watchClient(shard, client) == -1)
+	{
+		removeConnection(&shard->clients, client->slotId);
+		close(clientSocketFD);
+		poolFree(client);
+		logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+		return NULL;
+	}
+	if(registerClient(shard->server, shard, client) == -1)
+	{
+		/* The client might already be known to io_uring, so it goes down the regular path from here */
+		dropClient(shard, client);
+		logEvent(REFUSED_E, shard->id, NULL, NULL, 0);
+		return NULL;
+	}
+
+	addCounter(&shard->metrics, ACCEPTS_C, 1);
+	logClient(shard, client, CONNECTED_E);
+	sendToClient(shard, client, SIG_M | REG_F, SERVER_NAME, "To set a name, do /nick <name>");
+	return client;
+}
+
+/*
+	Reads everything the socket has for us and dispatches every complete message in it. A short read means
+	the socket is drained, so usually a single recv per readiness notification is all it takes.
+*/
+void serviceClient(struct shard *shard, struct client *client) {
+	while(!client->closing)
+	{
+		int received = fillMessageReader(&client->reader, client->handle.fd);
+
+		/* Nothing left to read - wait for the next readiness notification */
+		if(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		/* If client disconnected / there was an error reading from it, close its socket and drop it */
+		if(received == 0 || received == -1)
+		{
+			logClient(shard, client, DISCONNECTED_E);
+			dropClient(shard, client);
+			return;
+		}
+		addCounter(&shard->metrics, BYTES_IN_C, received);
+
+		if(dispatchMessages(shard, client) == -1 || client->reader.drained)
+			return;
+	}
+}
+
+/* Takes every complete message out of the client's reader, returns -1 if the client got dropped over a malformed one */
+int dispatchMessages(struct shard *shard, struct client *client) {
+	char *messageStart;
+	int length = 0;
+	while(!client->closing && (length = nextMessage(&client->reader, &messageStart)) > 0)
+		dispatchMessage(shard, client, messageStart);
+
+	/* A client that doesn't speak the protocol gets cut off, there's no way to resynchronize with it */
+	if(length == -1)
+	{
+		logClient(shard, client, MALFORMED_E);
+		dropClient(shard, client);
 		return -1;
 	}
-	server->monitors[server->numOfMonitors].fd = clientSocketFD;
-	server->monitors[server->numOfMonitors].events = POLLIN;
-	server->monitors[server->numOfMonitors].revents = 0;
-	strcpy(server->clients[server->numOfMonitors].name, "CLIENT");
-	server->numOfMonitors++;
-	return clientSocketFD;
+	return 0;
+}
+
+void dispatchMessage(struct shard *shard, struct client *client, char *messageStart) {
+	/* We're deserializing the message so we can check its type and decide what to do with it */
+	message msg = decodeMessage(messageStart, client->reader.version);
+
+	/* Remove all non-alphanumeric characters from the message payload */
+	if(sanitize(&msg) == 0 && (msg.type == (REQ_M | REG_F) || msg.type == (REQ_M | PRV_F) || msg.type == (REQ_M | CHN_F)))
+		return;
+
+	/* The server only receives requests and nothing else */
+	if((msg.type & MASK_M) != REQ_M)
+		return;
+
+	/* We're checking to see if the client name has been tampered with */
+	if(strcmp(msg.name, client->name) != 0)
+		return;
+
+	addCounter(&shard->metrics, FRAMES_IN_C, 1);
+	struct timespec start;
+	startTimer(&start);
+	int timer;
+	switch(msg.type & MASK_F)
+	{
+		case REG_F:
+			handleRegular(shard, &msg, client);
+			timer = REGULAR_T;
+			break;
+		case PRV_F:
+			handlePrivate(shard, &msg, client);
+			timer = PRIVATE_T;
+			break;
+		case CON_F:
+			handleConnect(shard, &msg, client);
+			timer = CONNECT_T;
+			break;
+		case NIC_F:
+			handleNickname(shard, &msg, client);
+			timer = NICKNAME_T;
+			break;
+		case JOI_F:
+			handleJoin(shard, &msg, client);
+			timer = JOIN_T;
+			break;
+		case PRT_F:
+			handlePart(shard, &msg, client);
+			timer = PART_T;
+			break;
+		case LST_F:
+			handleList(shard, &msg, client);
+			timer = LIST_T;
+			break;
+		case CHN_F:
+			handleChannel(shard, &msg, client);
+			timer = CHANNEL_T;
+			break;
+		default:
+			return;
+	}
+	stopTimer(&shard->metrics, timer, &start);
 }
 
-void killClient(struct server *server, int clientId) {
-	broadcast(server, SIG_M | DIS_F, server->clients[clientId].name, NULL, clientId, -1);
-	close(server->monitors[clientId].fd);
-	server->monitors[clientId].fd = -1;
-	for(int i = clientId; i < server->numOfMonitors - 1; i++)
+/* Writes out as much of the outbound queue as the socket takes */
+void flushClient(struct shard *shard, struct client *client) {
+	int status = flushOutQueue(&client->outbox, client->handle.fd);
+	if(status == -1)
 	{
-		server->monitors[i].fd = server->monitors[i + 1].fd;
-		server->clients[i] = server->clients[i + 1];
+		dropClient(shard, client);
+		return;
 	}
-	server->numOfMonitors--;
+	accountClient(shard, client);
+	if(status == 1)
+		addCounter(&shard->metrics, PARTIAL_SENDS_C, 1);
+	if(client->outbox.queuedBytes < shard->server->lowWatermark)
+		client->congested = 0;
+#ifdef USE_POLL
+	if(status == 0)
+		shard->monitors[shard->numOfListeners + 1 + connectionPosition(&shard->clients, client->slotId)].events &= ~POLLOUT;
+#endif
+}
+
+void dropClient(struct shard *shard, struct client *client) {
+	if(client->closing)
+		return;
+	client->closing = 1;
+	client->nextDoomed = shard->doomed;
+	shard->doomed = client;
+}
+
+/* Sending out the iteration's presence changes can doom even more clients, whose departures go out in the next batch */
+void reapClients(struct shard *shard) {
+	do
+	{
+		while(shard->doomed != NULL)
+		{
+			struct client *client = shard->doomed;
+			shard->doomed = client->nextDoomed;
+			killClient(shard, client);
+		}
+		flushPresence(shard);
+	} while(shard->doomed != NULL);
+}
+
+void killClient(struct shard *shard, struct client *client) {
+	client->closing = 1;
+	if(client->registered)
+	{
+		unregisterClient(shard->server, client);
+		notePresence(shard, LEAVE_P, client->name, NULL);
+	}
+	/* The departure already tells the other members, and the slot is about to be reused */
+	while(client->numOfChannels > 0)
+		partChannel(shard, client, client->numOfChannels - 1);
+	unwatchClient(shard, client);
+	removeConnection(&shard->clients, client->slotId);
+
+	/* Whatever is still queued is as good as gone, and the counters stop following the queue from here */
+	accountClient(shard, client);
+	addCounter(&shard->metrics, QUEUED_BYTES_C, -(int64_t)client->accountedQueued);
+	addCounter(&shard->metrics, DISCONNECTS_C, 1);
+	client->slotId = -1;
+#ifndef USE_POLL
+	/* The kernel might still be using the client's buffers, in which case the last completion frees it */
+	if(client->pendingOps > 0)
+		return;
+#endif
+	freeClient(client);
+}
+
+void freeClient(struct client *client) {
+	clearOutQueue(&client->outbox);
+	close(client->handle.fd);
+	poolFree(client);
 }
 
 /*
-	The optional args should represent the IDs of clients which not to broadcast to.
-	They have to be listed in rising order and have to end with a negative value.
+	Hands a frame over to the client's outbound queue, applying the slow consumer policy.
+	The queue takes its own reference if it has to hold on to the frame.
+	Returns -1 if the frame won't reach the client.
 */
-int broadcast(struct server *server, uint32_t type, char *name, char *payload, ...) {
-	va_list excludes;
-	va_start(excludes, payload);
-	int exclude = va_arg(excludes, int);
-	for(int i = server->numOfListeners; i < server->numOfMonitors; i++)
+int sendFrame(struct shard *shard, struct client *client, frame *f) {
+	if(client->closing)
+		return -1;
+	struct server *server = shard->server;
+	if(client->congested && server->slowPolicy == DROP_MESSAGES_P)
+	{
+		addCounter(&shard->metrics, DROPPED_FRAMES_C, 1);
+		return -1;
+	}
+
+	int status;
+	size_t queuedBefore = client->outbox.queuedBytes;
+#ifndef USE_POLL
+	/* io_uring sends are batched, so everything goes through the queue until the end of the loop iteration */
+	if(server->backend == URING_B)
+	{
+		status = pushOutQueue(&client->outbox, f, client->version, 0);
+		if(status != -1)
+			markDirty(shard, client);
+	}
+	else
+#endif
+	status = writeOutQueue(&client->outbox, client->handle.fd, f, client->version);
+	if(status == -1)
+	{
+		dropClient(shard, client);
+		return -1;
+	}
+	addCounter(&shard->metrics, FRAMES_OUT_C, 1);
+	accountClient(shard, client);
+	if(client->outbox.queuedBytes == 0)
+		return 0;
+	/* Nothing was queued before, so the socket didn't take all of the frame */
+	if(queuedBefore == 0 && server->backend != URING_B)
+		addCounter(&shard->metrics, PARTIAL_SENDS_C, 1);
+
+#ifdef USE_POLL
+	shard->monitors[shard->numOfListeners + 1 + connectionPosition(&shard->clients, client->slotId)].events |= POLLOUT;
+#else
+	/* Under io_uring a queue is normal, it only counts once a send has found the socket full */
+	if(server->backend == URING_B && !client->blocked)
+		return 0;
+#endif
+	checkCongestion(shard, client);
+	return 0;
+}
+
+/* Applies the slow consumer policy to a client whose socket isn't taking everything that's queued */
+void checkCongestion(struct shard *shard, struct client *client) {
+	struct server *server = shard->server;
+	if(client->outbox.queuedBytes > server->highWatermark)
 	{
-		if(i == exclude)
+		client->congested = 1;
+		if(server->slowPolicy == DROP_CLIENT_P)
 		{
-			exclude = va_arg(excludes, int);
+			addCounter(&shard->metrics, SLOW_CLIENTS_C, 1);
+			logClient(shard, client, SLOW_E);
+			dropClient(shard, client);
+		}
+	}
+}
+
+/* The numeric host goes along so the logger can add the hostname once the resolver has found it */
+void logClient(struct shard *shard, struct client *client, int event) {
+	logEvent(event, shard->id, client->peer, client->host, 0);
+}
+
+/* Brings the shard's byte counters up to date with what the client's outbound queue did since the last time */
+void accountClient(struct shard *shard, struct client *client) {
+	if(client->slotId == -1)
+		return;
+	addCounter(&shard->metrics, BYTES_OUT_C, client->outbox.sentBytes - client->accountedSent);
+	addCounter(&shard->metrics, QUEUED_BYTES_C, (int64_t)client->outbox.queuedBytes - (int64_t)client->accountedQueued);
+	client->accountedSent = client->outbox.sentBytes;
+	client->accountedQueued = client->outbox.queuedBytes;
+}
+
+/* Runs on the stats endpoint's thread, so it only reads what the shards publish for everyone */
+void reportStats(FILE *out, void *arg) {
+	struct server *server = arg;
+	metrics *total = malloc(sizeof(metrics));
+	if(total == NULL)
+		return;
+	initMetrics(total);
+	poolStats poolTotal, shardPool;
+	memset(&poolTotal, 0, sizeof(poolStats));
+	for(int i = 0; i < server->numOfShards; i++)
+	{
+		sumMetrics(total, &server->shards[i].metrics);
+		getPoolStats(&server->shards[i].pool, &shardPool);
+		poolTotal.slabBytes += shardPool.slabBytes;
+		poolTotal.oversized += shardPool.oversized;
+		for(int j = 0; j < POOL_CLASSES; j++)
+			poolTotal.classes[j].inUse += shardPool.classes[j].inUse;
+	}
+
+	/* Envelopes are counted by the shard that posts them and by the one that drains them */
+	unsigned long long connections = atomic_load(&total->counters[ACCEPTS_C]) - atomic_load(&total->counters[DISCONNECTS_C]);
+	unsigned long long inboxDepth = atomic_load(&total->counters[ENVELOPES_POSTED_C]) - atomic_load(&total->counters[ENVELOPES_DRAINED_C]);
+	fprintf(out, "uptime_seconds %ld\n", (long)(time(NULL) - server->startTime));
+	fprintf(out, "shards %d\n", server->numOfShards);
+	fprintf(out, "connections %llu\n", connections);
+	fprintf(out, "inbox_depth %llu\n", inboxDepth);
+	writeMetrics(out, total);
+	fprintf(out, "pool_slab_bytes %zu\n", poolTotal.slabBytes);
+	fprintf(out, "pool_oversized %zu\n", poolTotal.oversized);
+	for(int j = 0; j < POOL_CLASSES; j++)
+		fprintf(out, "pool_in_use_%d %zu\n", MIN_BLOCK_SIZE << j, poolTotal.classes[j].inUse);
+	free(total);
+}
+
+/* For messages with a single recipient */
+int sendToClient(struct shard *shard, struct client *client, uint32_t type, char *name, char *payload) {
+	if(client->closing)
+		return -1;
+	frame *f = createFrame(type, name, payload);
+	if(f == NULL)
+		return -1;
+	int status = sendFrame(shard, client, f);
+	releaseFrame(f);
+	return status;
+}
+
+/* Sends to the clients of this shard only, the exclude client (if not NULL) doesn't receive the frame */
+int deliver(struct shard *shard, frame *f, struct client *exclude) {
+	for(int i = 0; i < shard->clients.length; i++)
+	{
+		struct client *client = connectionAt(&shard->clients, i);
+		if(client == exclude)
 			continue;
+		/* A client failing to take the frame doesn't concern the rest of them */
+		sendFrame(shard, client, f);
+	}
+	return 0;
+}
+
+/*
+	Sends to the clients of every shard, the exclude client (if not NULL) has to belong to this shard.
+	The message is encoded exactly once, every recipient and every other shard gets the same frame.
+*/
+int broadcast(struct shard *shard, uint32_t type, char *name, char *payload, struct client *exclude) {
+	frame *f = createFrame(type, name, payload);
+	if(f == NULL)
+		return -1;
+	broadcastFrame(shard, f, exclude);
+	releaseFrame(f);
+	return 0;
+}
+
+/* Same as broadcast, for a frame the caller has already created (and still holds a reference to) */
+int broadcastFrame(struct shard *shard, frame *f, struct client *exclude) {
+	deliver(shard, f, exclude);
+	for(int i = 0; i < shard->server->numOfShards; i++)
+	{
+		if(i != shard->id)
+			postEnvelope(shard, &shard->server->shards[i], BROADCAST_E, f, -1, NULL);
+	}
+	return 0;
+}
+
+/* Sends to this shard's members of the channel, if the channel still goes by that name */
+int deliverChannel(struct shard *shard, int channelId, char *name, frame *f, struct client *exclude) {
+	struct shardChannel *local = &shard->channels[channelId];
+	/* A channel envelope can outlive its channel, whose ID might have been taken by a new one since */
+	if(local->members.length == 0 || strcmp(local->name, name) != 0)
+		return -1;
+	for(int i = 0; i < local->members.length; i++)
+	{
+		struct client *client = findConnection(&shard->clients, local->members.slots[i]);
+		if(client != NULL && client != exclude)
+			sendFrame(shard, client, f);
+	}
+	return 0;
+}
+
+/*
+	Sends to the members of the channel on every shard, the exclude client (if not NULL) has to belong to
+	this shard. The channel's name is taken from this shard, so the client the message comes from has to
+	be (or have just been) one of its members.
+*/
+int channelcast(struct shard *shard, int channelId, uint32_t type, char *name, char *payload, struct client *exclude) {
+	frame *f = createFrame(type, name, payload);
+	if(f == NULL)
+		return -1;
+	channelcastFrame(shard, channelId, f, exclude);
+	releaseFrame(f);
+	return 0;
+}
+
+/* Same as channelcast, for a frame the caller has already created (and still holds a reference to) */
+int channelcastFrame(struct shard *shard, int channelId, frame *f, struct client *exclude) {
+	char *name = shard->channels[channelId].name;
+	deliverChannel(shard, channelId, name, f, exclude);
+	uint_least64_t shards = atomic_load(&shard->server->channels[channelId].shards);
+	for(int i = 0; i < shard->server->numOfShards; i++)
+	{
+		if(i != shard->id && (shards & (1ULL << i)))
+			postEnvelope(shard, &shard->server->shards[i], CHANNEL_E, f, channelId, name);
+	}
+	return 0;
+}
+
+/* Queues work for the target shard, only the first envelope since its last drain pays for the eventfd write */
+int postEnvelope(struct shard *shard, struct shard *target, int type, frame *f, int targetSlot, char *targetName) {
+	struct envelope *envelope = poolAlloc(sizeof(struct envelope));
+	if(envelope == NULL)
+		return -1;
+	envelope->type = type;
+	envelope->frame = retainFrame(f);
+	envelope->targetSlot = targetSlot;
+	strcpy(envelope->target, (targetName == NULL) ? "" : targetName);
+	pushMpscQueue(&target->inbox, &envelope->node);
+	addCounter(&shard->metrics, ENVELOPES_POSTED_C, 1);
+	if(atomic_exchange(&target->wakeupPending, 1) == 0)
+	{
+		uint64_t one = 1;
+		if(write(target->wakeup.fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			return -1;
+	}
+	return 0;
+}
+
+/* Adds a join, departure or nick change to the shard's next presence batch, sending the batch first if it's full */
+int notePresence(struct shard *shard, char event, char *name, char *newName) {
+	int length = 1 + strlen(name) + ((newName == NULL) ? 0 : 1 + strlen(newName));
+	if(shard->presenceLength > 0 && shard->presenceLength + 1 + length >= MAX_PAYLOAD_SIZE)
+		flushPresence(shard);
+	char *entry = shard->presence + shard->presenceLength;
+	if(shard->presenceLength > 0)
+		*entry++ = ' ';
+	if(newName == NULL)
+		sprintf(entry, "%c%s", event, name);
+	else
+		sprintf(entry, "%c%s %s", event, name, newName);
+	shard->presenceLength = entry - shard->presence + length;
+	return 0;
+}
+
+/*
+	Sends the batch to this shard's clients and every other shard. A client that got its roster since the
+	batch started only gets what was noted after that, the roster already has everything before it - the
+	client's own join included.
+*/
+int flushPresence(struct shard *shard) {
+	if(shard->presenceLength == 0)
+		return 0;
+	frame *f = createFrame(SIG_M | PRS_F, "", shard->presence);
+	frame *events[MAX_PRESENCE_EVENTS];
+	int numOfEvents = -1;
+	for(int i = 0; i < shard->clients.length; i++)
+	{
+		struct client *client = connectionAt(&shard->clients, i);
+		int mark = client->presenceMark;
+		client->presenceMark = 0;
+		if(mark == 0)
+		{
+			if(f != NULL)
+				sendPresence(shard, client, f, events, &numOfEvents);
+		}
+		else if(mark < shard->presenceLength)
+		{
+			/* Entries are separated by a single space, which the mark points at */
+			frame *rest = createFrame(SIG_M | PRS_F, "", shard->presence + mark + 1);
+			if(rest == NULL)
+				continue;
+			frame *restEvents[MAX_PRESENCE_EVENTS];
+			int numOfRestEvents = -1;
+			sendPresence(shard, client, rest, restEvents, &numOfRestEvents);
+			for(int j = 0; j < numOfRestEvents; j++)
+				releaseFrame(restEvents[j]);
+			releaseFrame(rest);
+		}
+	}
+	for(int j = 0; j < numOfEvents; j++)
+		releaseFrame(events[j]);
+	shard->presenceLength = 0;
+	if(f == NULL)
+		return -1;
+	for(int i = 0; i < shard->server->numOfShards; i++)
+	{
+		if(i != shard->id)
+			postEnvelope(shard, &shard->server->shards[i], PRESENCE_E, f, -1, NULL);
+	}
+	releaseFrame(f);
+	return 0;
+}
+
+/* For batches from other shards */
+int deliverPresence(struct shard *shard, frame *f) {
+	frame *events[MAX_PRESENCE_EVENTS];
+	int numOfEvents = -1;
+	for(int i = 0; i < shard->clients.length; i++)
+		sendPresence(shard, connectionAt(&shard->clients, i), f, events, &numOfEvents);
+	for(int j = 0; j < numOfEvents; j++)
+		releaseFrame(events[j]);
+	return 0;
+}
+
+/*
+	Version 1 clients get a signal per entry instead. They're only created for the first version 1 client
+	a batch goes to, a count of -1 says they haven't been yet, and it's up to the caller to release them.
+*/
+int sendPresence(struct shard *shard, struct client *client, frame *f, frame *events[], int *numOfEvents) {
+	if(client->version != PROTOCOL_V1)
+		return sendFrame(shard, client, f);
+	if(*numOfEvents == -1)
+		*numOfEvents = expandPresence(f, events);
+	for(int j = 0; j < *numOfEvents; j++)
+		sendFrame(shard, client, events[j]);
+	return 0;
+}
+
+/* Turns a PRS_F frame back into the CON_F, DIS_F and NIC_F signals it stands for, returns how many there are */
+int expandPresence(frame *f, frame *events[]) {
+	message msg = decodeMessage(frameData(f, PROTOCOL_V1), PROTOCOL_V1);
+	int numOfEvents = 0;
+	char *save, *entry = strtok_r(msg.payload, " ", &save);
+	while(entry != NULL && numOfEvents < MAX_PRESENCE_EVENTS)
+	{
+		frame *event = NULL;
+		if(entry[0] == JOIN_P)
+			event = createFrame(SIG_M | CON_F, entry + 1, NULL);
+		else if(entry[0] == LEAVE_P)
+			event = createFrame(SIG_M | DIS_F, entry + 1, NULL);
+		else if(entry[0] == RENAME_P)
+		{
+			char *newName = strtok_r(NULL, " ", &save);
+			if(newName == NULL)
+				break;
+			event = createFrame(SIG_M | NIC_F, entry + 1, newName);
+		}
+		if(event != NULL)
+			events[numOfEvents++] = event;
+		entry = strtok_r(NULL, " ", &save);
+	}
+	return numOfEvents;
+}
+
+void drainInbox(struct shard *shard) {
+	uint64_t count;
+	while(read(shard->wakeup.fd, &count, sizeof(count)) > 0)
+		;
+	atomic_store(&shard->wakeupPending, 0);
+
+	mpscNode *node;
+	while((node = popMpscQueue(&shard->inbox)) != NULL)
+	{
+		struct envelope *envelope = (struct envelope *)node;
+		addCounter(&shard->metrics, ENVELOPES_DRAINED_C, 1);
+		if(envelope->type == BROADCAST_E)
+			deliver(shard, envelope->frame, NULL);
+		else if(envelope->type == PRIVATE_E)
+		{
+			/* The target might have left or changed its name since the envelope was posted, and its slot might have been reused */
+			struct client *target = findConnection(&shard->clients, envelope->targetSlot);
+			if(target != NULL && strcmp(target->name, envelope->target) == 0)
+				sendFrame(shard, target, envelope->frame);
 		}
-		/* We're not checking if sending to a client failed - maybe they DC-ed in the middle of the broadcast */
-		sendMessageStream(server->monitors[i].fd, type, name, payload);
+		else if(envelope->type == CHANNEL_E)
+			deliverChannel(shard, envelope->targetSlot, envelope->target, envelope->frame, NULL);
+		else if(envelope->type == PRESENCE_E)
+			deliverPresence(shard, envelope->frame);
+		releaseFrame(envelope->frame);
+		poolFree(envelope);
 	}
-	va_end(excludes);
+}
+
+int registerClient(struct server *server, struct shard *shard, struct client *client) {
+	pthread_mutex_lock(&server->directoryLock);
+	if(server->directoryLength == server->directoryCapacity)
+	{
+		struct directoryEntry *directory = realloc(server->directory, 2 * server->directoryCapacity * sizeof(struct directoryEntry));
+		if(directory == NULL)
+		{
+			pthread_mutex_unlock(&server->directoryLock);
+			return -1;
+		}
+		server->directory = directory;
+		server->directoryCapacity *= 2;
+	}
+	struct directoryEntry *entry = &server->directory[server->directoryLength];
+	strcpy(entry->name, client->name);
+	entry->shardId = shard->id;
+	entry->client = client;
+	client->directoryId = server->directoryLength++;
+	client->registered = 1;
+	pthread_mutex_unlock(&server->directoryLock);
 	return 0;
 }
 
-int findByName(struct server *server, char *target) {
-	for(int i = server->numOfListeners; i < server->numOfMonitors; i++)
+/* The last entry takes the place of the removed one - directoryId is only ever touched under the lock */
+void unregisterClient(struct server *server, struct client *client) {
+	pthread_mutex_lock(&server->directoryLock);
+	if(strcmp(client->name, DEFAULT_NAME) != 0)
+		removeNick(&server->nicks, client->name);
+	struct directoryEntry *last = &server->directory[--server->directoryLength];
+	server->directory[client->directoryId] = *last;
+	last->client->directoryId = client->directoryId;
+	pthread_mutex_unlock(&server->directoryLock);
+}
+
+/* Fails if the new name is reserved or taken by someone else */
+int renameClient(struct server *server, struct shard *shard, struct client *client, char *newName) {
+	if(strcmp(newName, DEFAULT_NAME) == 0 || strcmp(newName, SERVER_NAME) == 0)
+		return -1;
+	pthread_mutex_lock(&server->directoryLock);
+	if(insertNick(&server->nicks, newName, shard->id, client->slotId) == -1)
 	{
-		if(strcmp(target, server->clients[i].name) == 0)
+		pthread_mutex_unlock(&server->directoryLock);
+		return -1;
+	}
+	if(strcmp(client->name, DEFAULT_NAME) != 0)
+		removeNick(&server->nicks, client->name);
+	strcpy(server->directory[client->directoryId].name, newName);
+	strcpy(client->name, newName);
+	pthread_mutex_unlock(&server->directoryLock);
+	return 0;
+}
+
+int lookupClient(struct server *server, char *name, int *shardId, int *slotId) {
+	int status = -1;
+	pthread_mutex_lock(&server->directoryLock);
+	nickEntry *entry = findNick(&server->nicks, name);
+	if(entry != NULL)
+	{
+		*shardId = entry->shardId;
+		*slotId = entry->slotId;
+		status = 0;
+	}
+	pthread_mutex_unlock(&server->directoryLock);
+	return status;
+}
+
+/*
+	Returns the channel's ID, or -1 if it isn't a channel name, the client is in too many channels already
+	or every channel ID is taken. A name nobody's in yet takes the first free ID.
+*/
+int joinChannel(struct shard *shard, struct client *client, char *name) {
+	if(name[0] != '#' || name[1] == '\0' || client->numOfChannels == MAX_JOINED_CHANNELS)
+		return -1;
+	struct server *server = shard->server;
+	pthread_mutex_lock(&server->channelLock);
+	int channelId = -1, freeId = -1;
+	for(int i = 0; i < server->numOfChannels && channelId == -1; i++)
+	{
+		if(server->channels[i].members == 0)
+		{
+			if(freeId == -1)
+				freeId = i;
+		}
+		else if(strcmp(server->channels[i].name, name) == 0)
+			channelId = i;
+	}
+	if(channelId == -1)
+	{
+		if(freeId == -1 && server->numOfChannels < MAX_CHANNELS)
+			freeId = server->numOfChannels++;
+		if(freeId == -1)
+		{
+			pthread_mutex_unlock(&server->channelLock);
+			return -1;
+		}
+		channelId = freeId;
+		strcpy(server->channels[channelId].name, name);
+	}
+
+	struct shardChannel *local = &shard->channels[channelId];
+	if(local->members.length == 0)
+		strcpy(local->name, name);
+	if(addMember(&local->members, client->slotId) == -1)
+	{
+		pthread_mutex_unlock(&server->channelLock);
+		return -1;
+	}
+	if(local->members.length == 1)
+		atomic_fetch_or(&server->channels[channelId].shards, 1ULL << shard->id);
+	server->channels[channelId].members++;
+	client->channels[client->numOfChannels++] = channelId;
+	pthread_mutex_unlock(&server->channelLock);
+	return channelId;
+}
+
+/* Takes the client out of the channel at the given position in its channel list */
+void partChannel(struct shard *shard, struct client *client, int position) {
+	struct server *server = shard->server;
+	int channelId = client->channels[position];
+	client->channels[position] = client->channels[--client->numOfChannels];
+
+	pthread_mutex_lock(&server->channelLock);
+	struct shardChannel *local = &shard->channels[channelId];
+	removeMember(&local->members, client->slotId);
+	if(local->members.length == 0)
+		atomic_fetch_and(&server->channels[channelId].shards, ~(1ULL << shard->id));
+	server->channels[channelId].members--;
+	pthread_mutex_unlock(&server->channelLock);
+}
+
+/* Returns the channel's position in the client's channel list, or -1 if the client isn't in it */
+int findJoinedChannel(struct shard *shard, struct client *client, char *name) {
+	for(int i = 0; i < client->numOfChannels; i++)
+	{
+		if(strcmp(shard->channels[client->channels[i]].name, name) == 0)
 			return i;
 	}
 	return -1;
 }
 
-int handleRegular(struct server *server, message *msg, int id) {
-	return broadcast(server, SIG_M | REG_F, server->clients[id].name, msg->payload, -1);
+int handleRegular(struct shard *shard, message *msg, struct client *client) {
+	frame *f = createFrame(SIG_M | REG_F, client->name, msg->payload);
+	if(f == NULL)
+		return -1;
+	if(shard->server->history != NULL)
+		appendHistory(shard->server->history, f, SIG_M | REG_F, NULL);
+	broadcastFrame(shard, f, NULL);
+	releaseFrame(f);
+	return 0;
 }
 
-int handlePrivate(struct server *server, message *msg, int id) {
-	char target[MAX_NAME_SIZE];
+int handlePrivate(struct shard *shard, message *msg, struct client *client) {
+	char target[MAX_NAME_SIZE] = "";
+	int targetShard, targetSlot;
 	int len = readArgs(msg->payload, target, NULL);
-	if(len != -1)
+	frame *f;
+	/* Only what the payload actually holds past the name, a name alone leaves nothing to send */
+	if(len != -1 && msg->payload[len] == ' ' && msg->payload[len + 1] != '\0' && lookupClient(shard->server, target, &targetShard, &targetSlot) != -1 && (f = createFrame(SIG_M | PRV_F, client->name, msg->payload + len + 1)) != NULL)
 	{
-		int targetID = findByName(server, target);
-		if(targetID != -1 && sendMessageStream(server->monitors[targetID].fd, SIG_M | PRV_F, server->clients[id].name, msg->payload + len + 1) != -1)
+		/* Targets on this shard are served directly, everyone else through their shard's inbox */
+		int status = -1;
+		if(targetShard == shard->id)
+		{
+			struct client *targetClient = findConnection(&shard->clients, targetSlot);
+			if(targetClient != NULL)
+				status = sendFrame(shard, targetClient, f);
+		}
+		else
+			status = postEnvelope(shard, &shard->server->shards[targetShard], PRIVATE_E, f, targetSlot, target);
+		if(status != -1 && shard->server->history != NULL)
+			appendHistory(shard->server->history, f, SIG_M | PRV_F, target);
+		releaseFrame(f);
+		if(status != -1)
 		{
-			sendMessageStream(server->monitors[id].fd, RES_M | SCS_S | PRV_F, server->clients[targetID].name, msg->payload + len + 1);
+			sendToClient(shard, client, RES_M | SCS_S | PRV_F, target, msg->payload + len + 1);
 			return 0;
 		}
 	}
-	sendMessageStream(server->monitors[id].fd, RES_M | FLR_S | PRV_F, server->clients[id].name, target);
+	sendToClient(shard, client, RES_M | FLR_S | PRV_F, client->name, target);
 	return -1;
 }
 
-int handleConnect(struct server *server, message *msg, int id) {
-	strcpy(server->clients[id].name, msg->name);
-	broadcast(server, SIG_M | CON_F, server->clients[id].name, NULL, id, -1);
-	for(int j = server->numOfListeners; j < server->numOfMonitors; j++)
-		sendMessageStream(server->monitors[id].fd, SIG_M | CON_F, server->clients[j].name, NULL);
+/*
+	The name in the request has already been checked against the client's own, so there's nothing to rename.
+	A client that puts the highest protocol version it speaks in the payload gets told which one we picked,
+	and everything after that response goes out in that version.
+*/
+int handleConnect(struct shard *shard, message *msg, struct client *client) {
+	if(msg->payloadLength > 0)
+	{
+		int version = atoi(msg->payload);
+		if(version > LATEST_PROTOCOL)
+			version = LATEST_PROTOCOL;
+		if(version < PROTOCOL_V1)
+			version = PROTOCOL_V1;
+		char versionStr[16];
+		sprintf(versionStr, "%d", version);
+		if(sendToClient(shard, client, RES_M | SCS_S | CON_F, client->name, versionStr) == -1)
+			return -1;
+		client->version = version;
+		if(version != PROTOCOL_V1)
+			upgradeMessageReader(&client->reader, version);
+	}
+
+	notePresence(shard, JOIN_P, client->name, NULL);
+
+	/*
+		Taking a snapshot of the roster so we're not sending while holding the directory lock. Nothing else
+		gets noted on this shard until the snapshot is taken, so it covers everything in the batch so far.
+	*/
+	struct server *server = shard->server;
+	pthread_mutex_lock(&server->directoryLock);
+	int rosterLength = server->directoryLength;
+	char (*roster)[MAX_NAME_SIZE] = malloc(rosterLength * MAX_NAME_SIZE);
+	if(roster != NULL)
+	{
+		for(int j = 0; j < rosterLength; j++)
+			strcpy(roster[j], server->directory[j].name);
+	}
+	client->presenceMark = shard->presenceLength;
+	pthread_mutex_unlock(&server->directoryLock);
+	if(roster == NULL)
+		return -1;
+
+	/* Version 2 clients get the roster in RST_F batches, as many names to a frame as fit */
+	if(client->version == PROTOCOL_V1)
+	{
+		for(int j = 0; j < rosterLength; j++)
+			sendToClient(shard, client, SIG_M | CON_F, roster[j], NULL);
+	}
+	else
+	{
+		char batch[MAX_PAYLOAD_SIZE];
+		int batchLength = 0;
+		for(int j = 0; j < rosterLength; j++)
+		{
+			int nameLength = strlen(roster[j]);
+			if(batchLength > 0 && batchLength + 1 + nameLength >= MAX_PAYLOAD_SIZE)
+			{
+				sendToClient(shard, client, SIG_M | RST_F, "", batch);
+				batchLength = 0;
+			}
+			if(batchLength > 0)
+				batch[batchLength++] = ' ';
+			memcpy(batch + batchLength, roster[j], nameLength + 1);
+			batchLength += nameLength;
+		}
+		if(batchLength > 0)
+			sendToClient(shard, client, SIG_M | RST_F, "", batch);
+	}
+	free(roster);
+
+	/* Catching the client up on the conversation, the frames point straight into the history segments */
+	if(server->history != NULL && server->replayCount > 0)
+	{
+		frame **replay = malloc(server->replayCount * sizeof(frame *));
+		int numOfFrames = (replay == NULL) ? -1 : replayHistory(server->history, SIG_M | REG_F, server->replayCount, replay);
+		for(int j = 0; j < numOfFrames; j++)
+		{
+			sendFrame(shard, client, replay[j]);
+			releaseFrame(replay[j]);
+		}
+		free(replay);
+	}
 	return 0;
 }
 
-int handleNickname(struct server *server, message *msg, int id) {
-	char newNick[MAX_NAME_SIZE];
-	if(readArgs(msg->payload, newNick, NULL) != -1)
+int handleNickname(struct shard *shard, message *msg, struct client *client) {
+	char newNick[MAX_NAME_SIZE], oldNick[MAX_NAME_SIZE];
+	strcpy(oldNick, client->name);
+	if(readArgs(msg->payload, newNick, NULL) != -1 && renameClient(shard->server, shard, client, newNick) != -1)
+	{
+		logEvent(NICK_E, shard->id, oldNick, newNick, 0);
+		sendToClient(shard, client, RES_M | SCS_S | NIC_F, oldNick, newNick);
+		notePresence(shard, RENAME_P, oldNick, newNick);
+		return 0;
+	}
+	sendToClient(shard, client, RES_M | FLR_S | NIC_F, client->name, newNick);
+	return -1;
+}
+
+/* Joining a channel the client is already in is a success that nobody else hears about */
+int handleJoin(struct shard *shard, message *msg, struct client *client) {
+	char name[MAX_NAME_SIZE] = "";
+	int channelId = -1;
+	if(readArgs(msg->payload, name, NULL) != -1)
 	{
-		if(sendMessageStream(server->monitors[id].fd, RES_M | SCS_S | NIC_F, server->clients[id].name, newNick) != -1)
+		if(findJoinedChannel(shard, client, name) != -1)
 		{
-			broadcast(server, SIG_M | NIC_F, server->clients[id].name, msg->payload, -1);
-			strcpy(server->clients[id].name, newNick);
+			sendToClient(shard, client, RES_M | SCS_S | JOI_F, client->name, name);
 			return 0;
 		}
+		channelId = joinChannel(shard, client, name);
 	}
-	sendMessageStream(server->monitors[id].fd, RES_M | FLR_S | NIC_F, server->clients[id].name, newNick);
-	return -1;
+	if(channelId == -1)
+	{
+		sendToClient(shard, client, RES_M | FLR_S | JOI_F, client->name, name);
+		return -1;
+	}
+	sendToClient(shard, client, RES_M | SCS_S | JOI_F, client->name, name);
+	channelcast(shard, channelId, SIG_M | JOI_F, client->name, name, client);
+	return 0;
 }
+
+int handlePart(struct shard *shard, message *msg, struct client *client) {
+	char name[MAX_NAME_SIZE] = "";
+	int position = -1;
+	if(readArgs(msg->payload, name, NULL) != -1)
+		position = findJoinedChannel(shard, client, name);
+	if(position == -1)
+	{
+		sendToClient(shard, client, RES_M | FLR_S | PRT_F, client->name, name);
+		return -1;
+	}
+	/* The shard's copy of the name outlives the client's membership, so the rest can still be told */
+	int channelId = client->channels[position];
+	partChannel(shard, client, position);
+	sendToClient(shard, client, RES_M | SCS_S | PRT_F, client->name, name);
+	channelcast(shard, channelId, SIG_M | PRT_F, client->name, name, NULL);
+	return 0;
+}
+
+/* Every channel with members and how many, one response each, same as the connect roster */
+int handleList(struct shard *shard, message *msg, struct client *client) {
+	/* The request carries nothing but the type, the handler just has the same signature as the rest */
+	(void)msg;
+	struct server *server = shard->server;
+	pthread_mutex_lock(&server->channelLock);
+	int numOfChannels = 0;
+	char (*channels)[MAX_NAME_SIZE + 16] = malloc((server->numOfChannels + 1) * (MAX_NAME_SIZE + 16));
+	if(channels != NULL)
+	{
+		for(int i = 0; i < server->numOfChannels; i++)
+		{
+			if(server->channels[i].members > 0)
+				sprintf(channels[numOfChannels++], "%s %d", server->channels[i].name, server->channels[i].members);
+		}
+	}
+	pthread_mutex_unlock(&server->channelLock);
+	if(channels == NULL)
+		return -1;
+
+	if(numOfChannels == 0)
+		sendToClient(shard, client, RES_M | FLR_S | LST_F, SERVER_NAME, NULL);
+	for(int i = 0; i < numOfChannels; i++)
+		sendToClient(shard, client, RES_M | SCS_S | LST_F, SERVER_NAME, channels[i]);
+	free(channels);
+	return 0;
+}
+
+/* The payload is the channel followed by the message, it's relayed as it is to the channel's members only */
+int handleChannel(struct shard *shard, message *msg, struct client *client) {
+	char name[MAX_NAME_SIZE] = "";
+	int len = readArgs(msg->payload, name, NULL);
+	int position = -1;
+	if(len != -1 && msg->payload[len] == ' ' && msg->payload[len + 1] != '\0')
+		position = findJoinedChannel(shard, client, name);
+	if(position == -1)
+	{
+		sendToClient(shard, client, RES_M | FLR_S | CHN_F, client->name, name);
+		return -1;
+	}
+	frame *f = createFrame(SIG_M | CHN_F, client->name, msg->payload);
+	if(f == NULL)
+		return -1;
+	if(shard->server->history != NULL)
+		appendHistory(shard->server->history, f, SIG_M | CHN_F, name);
+	channelcastFrame(shard, client->channels[position], f, NULL);
+	releaseFrame(f);
+	return 0;
+}
\ No newline at end of file
@@ -3,10 +3,14 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "socketcom.h"
 
@@ -44,15 +48,93 @@ message deserialize_struct_message(char *buffer) {
 	offset += MAX_NAME_SIZE;
 	msg.payloadLength = deserialize_uint32_t(buffer + offset);
 	offset += sizeof(uint32_t);
-	memcpy(msg.payload, buffer + offset, MAX_PAYLOAD_SIZE);
+	/* Only the payload itself is copied, the buffer doesn't have to extend any further than the message */
+	if(msg.payloadLength >= MAX_PAYLOAD_SIZE)
+		msg.payloadLength = MAX_PAYLOAD_SIZE - 1;
+	memcpy(msg.payload, buffer + offset, msg.payloadLength);
+	msg.payload[msg.payloadLength] = '\0';
 	return msg;
 }
 
-int sanitize(message *msg) {
+/* Returns the number of bytes written, at most MAX_VARINT_SIZE */
+int serialize_varint(char *buffer, uint32_t val) {
+	int length = 0;
+	while(val >= 0x80)
+	{
+		buffer[length++] = (val & 0x7F) | 0x80;
+		val >>= 7;
+	}
+	buffer[length++] = val;
+	return length;
+}
+
+/* Returns the number of bytes read, 0 if the varint isn't all there yet and -1 if it's too long to be valid */
+int deserialize_varint(char *buffer, int available, uint32_t *val) {
+	uint32_t result = 0;
+	for(int i = 0; i < MAX_VARINT_SIZE; i++)
+	{
+		if(i == available)
+			return 0;
+		unsigned char byte = buffer[i];
+		result |= (uint32_t)(byte & 0x7F) << (7 * i);
+		if(!(byte & 0x80))
+		{
+			*val = result;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+/* No main type has every bit of MASK_M set, so neither side does anything with a message that didn't decode */
+static message rejectedMessage(void) {
+	message msg;
+	msg.type = MASK_M;
+	memset(msg.name, 0, MAX_NAME_SIZE);
+	msg.payloadLength = 0;
+	msg.payload[0] = '\0';
+	return msg;
+}
+
+/* The message has to have been checked by nextMessage already, anything that still doesn't add up gets rejected */
+message deserialize_compact_message(char *buffer) {
+	message msg;
+	uint32_t nameLength = 0;
+	int offset = 0, length = deserialize_varint(buffer, MAX_VARINT_SIZE, &msg.type);
+	if(length <= 0)
+		return rejectedMessage();
+	offset += length;
+	length = deserialize_varint(buffer + offset, MAX_VARINT_SIZE, &nameLength);
+	if(length <= 0 || nameLength >= MAX_NAME_SIZE)
+		return rejectedMessage();
+	offset += length;
+	memcpy(msg.name, buffer + offset, nameLength);
+	memset(msg.name + nameLength, 0, MAX_NAME_SIZE - nameLength);
+	offset += nameLength;
+	length = deserialize_varint(buffer + offset, MAX_VARINT_SIZE, &msg.payloadLength);
+	if(length <= 0 || msg.payloadLength >= MAX_PAYLOAD_SIZE)
+		return rejectedMessage();
+	offset += length;
+	memcpy(msg.payload, buffer + offset, msg.payloadLength);
+	msg.payload[msg.payloadLength] = '\0';
+	return msg;
+}
+
+message decodeMessage(char *buffer, int version) {
+	return (version == PROTOCOL_V2) ? deserialize_compact_message(buffer) : deserialize_struct_message(buffer);
+}
+
+/*
+	Drops everything outside the printable range along with leading spaces and every space that follows
+	another one in the original payload. This is the reference implementation - the vectorized ones below
+	have to give exactly the same result, which microbench --check compares on every kernel the CPU has.
+*/
+int sanitizeScalar(message *msg) {
 	int count = 0, twsFlag = 1;
-	for(int i = 0; i < msg->payloadLength; i++)
+	for(uint32_t i = 0; i < msg->payloadLength; i++)
 	{
-		if(msg->payload[i] >= 32 && msg->payload[i] <= 127)
+		unsigned char byte = msg->payload[i];
+		if(byte >= 32 && byte <= 127)
 		{
 			if(msg->payload[i] == ' ' && twsFlag)
 				continue;
@@ -68,6 +150,180 @@ int sanitize(message *msg) {
 	return count;
 }
 
+#ifdef __x86_64__
+
+/*
+	The kernels work on the payload in place. Everything up to the first byte that's kept goes the scalar
+	way, after that a byte is kept if it's printable and isn't a space following a space, which is the same
+	test for every byte and so can be done a whole vector at a time. Output never gets ahead of input, but
+	a full vector store can land on input bytes that were already loaded, so the byte before each block
+	is carried over in a variable rather than read back from the payload.
+
+	Most chat text has nothing to drop, so a block where every byte is kept is stored as it is (or not at
+	all while nothing has been dropped yet). Other blocks get compacted - one byte per kept bit with SSE2,
+	eight bytes at a time with a shuffle from compactTable with AVX2.
+*/
+
+/* Index of the first byte that ends up in the output, or the length if there isn't one */
+static int firstKept(char *payload, int length) {
+	int i = 0;
+	while(i < length && ((unsigned char)payload[i] < 32 || (unsigned char)payload[i] > 127 || payload[i] == ' '))
+		i++;
+	return i;
+}
+
+/* Finishes off the payload from byte i, previous being the original byte before it */
+static int sanitizeTail(char *payload, int i, int length, int count, char previous) {
+	for(; i < length; i++)
+	{
+		char current = payload[i];
+		if((unsigned char)current >= 32 && (unsigned char)current <= 127 && (current != ' ' || previous != ' '))
+			payload[count++] = current;
+		previous = current;
+	}
+	return count;
+}
+
+/* Goes 16 bytes at a time from byte i, which the AVX2 kernel also uses for what's left after its blocks */
+static int sanitizeBlocks(char *payload, int i, int length, int count, char previous) {
+	const __m128i printable = _mm_set1_epi8(31), spaces = _mm_set1_epi8(' ');
+	char block[16];
+	for(; i + 16 <= length; i += 16)
+	{
+		__m128i current = _mm_loadu_si128((__m128i*)(payload + i));
+		__m128i before = _mm_or_si128(_mm_slli_si128(current, 1), _mm_cvtsi32_si128((unsigned char)previous));
+		/* Bytes are signed, so everything from 128 up fails the comparison along with the control characters */
+		__m128i doubled = _mm_and_si128(_mm_cmpeq_epi8(current, spaces), _mm_cmpeq_epi8(before, spaces));
+		unsigned int mask = _mm_movemask_epi8(_mm_andnot_si128(doubled, _mm_cmpgt_epi8(current, printable)));
+		previous = payload[i + 15];
+
+		if(mask == 0xFFFF)
+		{
+			if(count != i)
+				_mm_storeu_si128((__m128i*)(payload + count), current);
+			count += 16;
+			continue;
+		}
+		_mm_storeu_si128((__m128i*)block, current);
+		while(mask != 0)
+		{
+			payload[count++] = block[__builtin_ctz(mask)];
+			mask &= mask - 1;
+		}
+	}
+	return sanitizeTail(payload, i, length, count, previous);
+}
+
+static int sanitizeSSE2(char *payload, int length) {
+	int i = firstKept(payload, length);
+	if(i == length)
+		return 0;
+	payload[0] = payload[i];
+	return sanitizeBlocks(payload, i + 1, length, 1, payload[i]);
+}
+
+/* Shuffle indices that move the bytes picked out by an 8 bit mask to the front */
+static uint8_t compactTable[256][8];
+
+__attribute__((target("avx2")))
+static int sanitizeAVX2(char *payload, int length) {
+	int i = firstKept(payload, length), count = 0;
+	if(i == length)
+		return 0;
+	char previous = payload[i];
+	payload[count++] = payload[i++];
+
+	const __m256i printable = _mm256_set1_epi8(31), spaces = _mm256_set1_epi8(' ');
+	char block[32];
+	for(; i + 32 <= length; i += 32)
+	{
+		__m256i current = _mm256_loadu_si256((__m256i*)(payload + i));
+		/* Shifting by a byte across the two lanes takes the low lane moved up into the high one */
+		__m256i before = _mm256_alignr_epi8(current, _mm256_permute2x128_si256(current, current, 0x08), 15);
+		before = _mm256_or_si256(before, _mm256_set_epi64x(0, 0, 0, (unsigned char)previous));
+		__m256i doubled = _mm256_and_si256(_mm256_cmpeq_epi8(current, spaces), _mm256_cmpeq_epi8(before, spaces));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_andnot_si256(doubled, _mm256_cmpgt_epi8(current, printable)));
+		previous = payload[i + 31];
+
+		if(mask == 0xFFFFFFFF)
+		{
+			if(count != i)
+				_mm256_storeu_si256((__m256i*)(payload + count), current);
+			count += 32;
+			continue;
+		}
+		/* Every store is 8 bytes, which never goes past the end of the group being compacted */
+		_mm256_storeu_si256((__m256i*)block, current);
+		for(int group = 0; group < 4; group++)
+		{
+			unsigned int bits = (mask >> (8 * group)) & 0xFF;
+			__m128i bytes = _mm_loadl_epi64((__m128i*)(block + 8 * group));
+			__m128i order = _mm_loadl_epi64((__m128i*)compactTable[bits]);
+			_mm_storel_epi64((__m128i*)(payload + count), _mm_shuffle_epi8(bytes, order));
+			count += __builtin_popcount(bits);
+		}
+	}
+	/* The rest is SSE code, which pays for every switch over while the upper halves are dirty */
+	_mm256_zeroupper();
+	return sanitizeBlocks(payload, i, length, count, previous);
+}
+
+static int bestKernel = SCALAR_K;
+
+/* Picks the kernel once at startup, before there are any other threads around to call sanitize */
+__attribute__((constructor))
+static void chooseSanitizeKernel(void) {
+	for(int bits = 0; bits < 256; bits++)
+	{
+		int length = 0;
+		for(int j = 0; j < 8; j++)
+			if(bits & (1 << j))
+				compactTable[bits][length++] = j;
+		/* A set top bit makes the shuffle put a zero there */
+		while(length < 8)
+			compactTable[bits][length++] = 0x80;
+	}
+	__builtin_cpu_init();
+	bestKernel = __builtin_cpu_supports("avx2") ? AVX2_K : SSE2_K;
+}
+
+#else
+
+static int bestKernel = SCALAR_K;
+
+#endif
+
+int bestSanitizeKernel(void) {
+	return bestKernel;
+}
+
+/* Kernels the CPU doesn't have fall back to the scalar one */
+int sanitizeWith(message *msg, int kernel) {
+	if(kernel > bestKernel)
+		kernel = SCALAR_K;
+	int count;
+	switch(kernel)
+	{
+#ifdef __x86_64__
+		case SSE2_K:
+			count = sanitizeSSE2(msg->payload, msg->payloadLength);
+			break;
+		case AVX2_K:
+			count = sanitizeAVX2(msg->payload, msg->payloadLength);
+			break;
+#endif
+		default:
+			return sanitizeScalar(msg);
+	}
+	msg->payloadLength = count;
+	msg->payload[count] = '\0';
+	return count;
+}
+
+int sanitize(message *msg) {
+	return sanitizeWith(msg, bestKernel);
+}
+
 int sendByteStream(int socketFD, char *buffer, int length) {
 	int sent = 0, sentTotal = 0;
 	while((sent = send(socketFD, buffer + sentTotal, length - sentTotal, 0)) > 0)
@@ -77,6 +333,46 @@ int sendByteStream(int socketFD, char *buffer, int length) {
 	return sentTotal;
 }
 
+/*
+	Sends all the buffers in the vector with one sendmsg per socket buffer's worth, without gathering
+	them into one place first. Works like sendByteStream - returns the number of bytes sent, which is
+	less than the total if the socket filled up, and -1 on error. The vector gets used up in the process.
+*/
+int sendVectorStream(int socketFD, struct iovec *vector, int count) {
+	struct msghdr header;
+	memset(&header, 0, sizeof(struct msghdr));
+	int sent = 0, sentTotal = 0;
+	while(count > 0 && vector->iov_len == 0)
+	{
+		vector++;
+		count--;
+	}
+	while(count > 0)
+	{
+		header.msg_iov = vector;
+		header.msg_iovlen = count;
+		if((sent = sendmsg(socketFD, &header, MSG_NOSIGNAL)) <= 0)
+			break;
+		sentTotal += sent;
+
+		/* Skipping over whatever went out, the first buffer left might have only gone out partially */
+		while(count > 0 && (size_t)sent >= vector->iov_len)
+		{
+			sent -= vector->iov_len;
+			vector++;
+			count--;
+		}
+		if(count > 0)
+		{
+			vector->iov_base = (char *)vector->iov_base + sent;
+			vector->iov_len -= sent;
+		}
+	}
+	if(sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	return sentTotal;
+}
+
 int receiveByteStream(int socketFD, char *buffer, int length) {
 	int received = 0, receivedTotal = 0;
 	while((received = recv(socketFD, buffer + receivedTotal, length - receivedTotal, 0)) > 0)
@@ -100,20 +396,165 @@ int receiveMessageStream(int socketFD, char *buffer) {
 	return prefix + received;
 }
 
-int sendMessageStream(int socketFD, uint32_t type, char *name, char *payload) {
-	message msg;
-	msg.type = type;
-	strcpy(msg.name, name);
-	if(payload == NULL)
-		msg.payloadLength = 0;	
-	else
+/* Writes the prefix only, so the payload can be put (or sent) after it without going through a message struct */
+int encodeMessagePrefix(char *buffer, uint32_t type, char *name, uint32_t payloadLength) {
+	serialize_uint32_t(buffer, type);
+	strncpy(buffer + sizeof(uint32_t), name, MAX_NAME_SIZE);
+	serialize_uint32_t(buffer + sizeof(uint32_t) + MAX_NAME_SIZE, payloadLength);
+	return MESSAGE_PREFIX_SIZE;
+}
+
+/* Same as encodeMessagePrefix, but for version 2 - the buffer has to have room for MAX_COMPACT_PREFIX_SIZE bytes */
+int encodeCompactPrefix(char *buffer, uint32_t type, char *name, uint32_t payloadLength) {
+	int nameLength = strnlen(name, MAX_NAME_SIZE - 1);
+	int offset = serialize_varint(buffer, type);
+	offset += serialize_varint(buffer + offset, nameLength);
+	memcpy(buffer + offset, name, nameLength);
+	offset += nameLength;
+	offset += serialize_varint(buffer + offset, payloadLength);
+	return offset;
+}
+
+int encodePrefix(char *buffer, int version, uint32_t type, char *name, uint32_t payloadLength) {
+	if(version == PROTOCOL_V2)
+		return encodeCompactPrefix(buffer, type, name, payloadLength);
+	return encodeMessagePrefix(buffer, type, name, payloadLength);
+}
+
+int encodeMessageStream(char *buffer, int version, uint32_t type, char *name, char *payload) {
+	uint32_t payloadLength = (payload == NULL) ? 0 : strlen(payload);
+	int prefixLength = encodePrefix(buffer, version, type, name, payloadLength);
+	if(payloadLength > 0)
+		memcpy(buffer + prefixLength, payload, payloadLength);
+	return prefixLength + payloadLength;
+}
+
+/* Only the prefix gets encoded, the payload goes out straight from the caller's buffer */
+int sendMessageStream(int socketFD, int version, uint32_t type, char *name, char *payload) {
+	char prefix[MAX_PREFIX_SIZE];
+	uint32_t payloadLength = (payload == NULL) ? 0 : strlen(payload);
+	struct iovec vector[2];
+	vector[0].iov_base = prefix;
+	vector[0].iov_len = encodePrefix(prefix, version, type, name, payloadLength);
+	vector[1].iov_base = payload;
+	vector[1].iov_len = payloadLength;
+	return sendVectorStream(socketFD, vector, 2);
+}
+
+void initMessageReader(messageReader *reader) {
+	reader->state = PREFIX_R;
+	reader->start = reader->end = 0;
+	reader->drained = 0;
+	reader->version = PROTOCOL_V1;
+	reader->pendingVersion = 0;
+	reader->prefixLength = 0;
+	reader->payloadLength = 0;
+}
+
+/* The reader moves on to the new version with the first message that's actually in it (see socketcom.h) */
+void upgradeMessageReader(messageReader *reader, int version) {
+	reader->pendingVersion = version;
+}
+
+/* Returns the prefix length and fills in the payload length, 0 if the prefix isn't all there yet and -1 if it's invalid */
+static int readCompactPrefix(char *buffer, int available, uint32_t *payloadLength) {
+	uint32_t type, nameLength;
+	int offset = 0, length;
+	if((length = deserialize_varint(buffer, available, &type)) <= 0)
+		return length;
+	offset += length;
+	if((length = deserialize_varint(buffer + offset, available - offset, &nameLength)) <= 0)
+		return length;
+	offset += length;
+	if(nameLength >= MAX_NAME_SIZE)
+		return -1;
+	offset += nameLength;
+	if(offset >= available)
+		return 0;
+	if((length = deserialize_varint(buffer + offset, available - offset, payloadLength)) <= 0)
+		return length;
+	return offset + length;
+}
+
+/* Moving the unparsed leftover to the front to make room */
+static void compactMessageReader(messageReader *reader) {
+	if(reader->start > 0)
+	{
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+}
+
+/*
+	Returns the number of bytes received, 0 if the peer closed the connection and -1 on error (or EAGAIN).
+	A read that didn't fill up all the free space means the socket has been drained, which gets noted in
+	the reader's drained flag so the caller doesn't have to go for another recv just to get an EAGAIN.
+*/
+int fillMessageReader(messageReader *reader, int socketFD) {
+	compactMessageReader(reader);
+	int space = READ_BUFFER_SIZE - reader->end;
+	int received = recv(socketFD, reader->buffer + reader->end, space, 0);
+	if(received > 0)
+		reader->end += received;
+	reader->drained = (received < space);
+	return received;
+}
+
+/*
+	Same as a fill, but for data that's already been received somewhere else. Returns how much of it fit,
+	the rest has to wait until the complete messages have been taken out.
+*/
+int feedMessageReader(messageReader *reader, char *data, int length) {
+	compactMessageReader(reader);
+	int space = READ_BUFFER_SIZE - reader->end;
+	if(length > space)
+		length = space;
+	memcpy(reader->buffer + reader->end, data, length);
+	reader->end += length;
+	return length;
+}
+
+/*
+	Returns the length of the next complete message and points messageStart at it, 0 if there's no
+	complete message in the buffer yet and -1 if the stream doesn't hold a valid message.
+	The message stays valid until the next fill, and is in the reader's current version.
+*/
+int nextMessage(messageReader *reader, char **messageStart) {
+	int available = reader->end - reader->start;
+	if(reader->state == PREFIX_R)
 	{
-		msg.payloadLength = strlen(payload);
-		strcpy(msg.payload, payload);
+		if(available == 0)
+			return 0;
+		if(reader->pendingVersion != 0 && (reader->buffer[reader->start] & 0x80))
+		{
+			reader->version = reader->pendingVersion;
+			reader->pendingVersion = 0;
+		}
+		if(reader->version == PROTOCOL_V2)
+		{
+			reader->prefixLength = readCompactPrefix(reader->buffer + reader->start, available, &reader->payloadLength);
+			if(reader->prefixLength <= 0)
+				return reader->prefixLength;
+		}
+		else
+		{
+			if(available < MESSAGE_PREFIX_SIZE)
+				return 0;
+			reader->prefixLength = MESSAGE_PREFIX_SIZE;
+			reader->payloadLength = deserialize_uint32_t(reader->buffer + reader->start + 4 + MAX_NAME_SIZE);
+		}
+		if(reader->payloadLength >= MAX_PAYLOAD_SIZE)
+			return -1;
+		reader->state = PAYLOAD_R;
 	}
-	char buffer[TOTAL_BUFFER_SIZE];
-	serialize_struct_message(buffer, &msg);
-	return sendByteStream(socketFD, buffer, MESSAGE_PREFIX_SIZE + msg.payloadLength);
+	int length = reader->prefixLength + reader->payloadLength;
+	if(available < length)
+		return 0;
+	*messageStart = reader->buffer + reader->start;
+	reader->start += length;
+	reader->state = PREFIX_R;
+	return length;
 }
 
 int readArgs(char *str, ...) {
@@ -200,15 +641,19 @@ int createListeners(int **listeners, char *portStr) {
 	return (counter == 0) ? -1 : counter;
 }
 
-int acceptConnection(int listeningSocketFD) {
-	struct sockaddr_storage clientAddress;
-	memset(&clientAddress, 0, sizeof(struct sockaddr_storage));
-	socklen_t addressLength = sizeof(struct sockaddr_storage);
-	int clientSocketFD = accept(listeningSocketFD, (struct sockaddr*)&clientAddress, &addressLength);
-	if(clientSocketFD == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+/* The peer's address comes along with the connection, so nobody has to ask for it later */
+int acceptConnection(int listeningSocketFD, struct sockaddr_storage *address, socklen_t *addressLength) {
+	memset(address, 0, sizeof(struct sockaddr_storage));
+	*addressLength = sizeof(struct sockaddr_storage);
+	int clientSocketFD = accept(listeningSocketFD, (struct sockaddr*)address, addressLength);
+	/* errno is left untouched so callers can tell an empty backlog (EAGAIN) apart from a real failure */
+	if(clientSocketFD == -1)
 		return -1;
 	if(setSocketNonBlocking(clientSocketFD) == -1)
+	{
+		close(clientSocketFD);
 		return -1;
+	}
 	return clientSocketFD;
 }
 
@@ -251,15 +696,15 @@ int connectToServer(char *addressStr, char *portStr) {
 	return (flag == 0) ? -1 : socketFD;
 }
 
-int printPeerInfo(int socketFD) {
-	struct sockaddr_storage address;
-	memset(&address, 0, sizeof(struct sockaddr_storage));
-	socklen_t addressLength = sizeof(struct sockaddr_storage);
-	if(getpeername(socketFD, (struct sockaddr*)&address, &addressLength) == -1)
+/*
+	Formats an address as its numeric host (MAX_HOST_SIZE) and as host:port (MAX_PEER_SIZE), with brackets
+	around IPv6 hosts. Being numeric, this never waits on a name server.
+*/
+int describeAddress(struct sockaddr *address, socklen_t addressLength, char *host, char *peer) {
+	char service[NI_MAXSERV];
+	if(getnameinfo(address, addressLength, host, MAX_HOST_SIZE, service, sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
 		return -1;
-	char host[NI_MAXHOST], service[NI_MAXSERV];
-	if(getnameinfo((struct sockaddr*)&address, addressLength, host, sizeof(host), service, sizeof(service), 0) == -1)
-		return -1;
-	printf("address: %s, port: %s\n", host, service);
+	snprintf(peer, MAX_PEER_SIZE, (address->sa_family == AF_INET6) ? "[%s]:%s" : "%s:%s", host, service);
 	return 0;
 }
+
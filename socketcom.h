@@ -2,11 +2,21 @@
 #define _SOCKETCOM_H_
 
 #include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #define MAX_NAME_SIZE 32
 #define MESSAGE_PREFIX_SIZE (4 + MAX_NAME_SIZE + 4)
+#define MAX_VARINT_SIZE 5
+#define MAX_COMPACT_PREFIX_SIZE (MAX_VARINT_SIZE + 1 + MAX_NAME_SIZE + MAX_VARINT_SIZE)
+#define MAX_PREFIX_SIZE ((MAX_COMPACT_PREFIX_SIZE > MESSAGE_PREFIX_SIZE) ? MAX_COMPACT_PREFIX_SIZE : MESSAGE_PREFIX_SIZE)
 #define MAX_PAYLOAD_SIZE 1024
 #define TOTAL_BUFFER_SIZE (MESSAGE_PREFIX_SIZE + MAX_PAYLOAD_SIZE)
+#define READ_BUFFER_SIZE (4 * TOTAL_BUFFER_SIZE)
+
+/* Numeric addresses only - IPv6 with a scope ID at most, and the port plus brackets on top of that for the peer */
+#define MAX_HOST_SIZE 64
+#define MAX_PEER_SIZE (MAX_HOST_SIZE + 8)
 
 /*
 	The message structure is as follows:
@@ -15,8 +25,31 @@
 
 	Note: When receiving a message, we first receive the prefix (MESSAGE_PREFIX_SIZE) bytes, read it, and
 	then receive another PAYLOAD LENGTH bytes
+
+	Version 2 of the protocol carries the same fields in a compact form:
+	|TYPE - varint|NAME LENGTH - varint|NAME - NAME LENGTH bytes|PAYLOAD LENGTH - varint|PAYLOAD|
+
+	Varints are little-endian base 128, 7 bits per byte with the top bit set on every byte but the last.
+	Every connection starts out on version 1. A client that speaks version 2 says so in the payload of its
+	CON_F request, the server answers with a CON_F response carrying the version it picked, and from then
+	on the server only sends that version. The client switches right after the response, so the server
+	has to take version 1 messages that were already on their way - the two are told apart by the first
+	byte, which is the low (or high) byte of a version 1 type and so never has the top bit set, while a
+	version 2 type always has a subtype and never fits in a single varint byte.
+
+	A version 2 client gets the list of everyone on the server in RST_F signals instead of a CON_F signal
+	per name - the names are separated by spaces, as many of them to a message as fit in the payload.
+	Joins, departures and nick changes come to it in PRS_F signals as well, each one a batch of whatever
+	changed since the last one, in order: +name for a join, -name for a departure and >old new for a
+	nick change. Nicks can't contain spaces, so the first character of every entry is all that's needed.
 */
 
+/* Protocol versions */
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define LATEST_PROTOCOL PROTOCOL_V2
+#define LATEST_PROTOCOL_STR "2"
+
 /* Main message types - first 4 bits of the type indicator */
 #define MASK_M 0xF
 #define REQ_M 0
@@ -35,6 +68,23 @@
 #define CON_F 768
 #define DIS_F 1024
 #define NIC_F 1280
+#define JOI_F 1536
+#define PRT_F 1792
+#define LST_F 2048
+#define CHN_F 2304
+#define RST_F 2560
+#define PRS_F 2816
+
+/* Presence entries - the first character of each entry in a PRS_F payload */
+#define JOIN_P '+'
+#define LEAVE_P '-'
+#define RENAME_P '>'
+
+/* sanitize kernels, from slowest to fastest - sanitize uses the fastest one the CPU has */
+#define SCALAR_K 0
+#define SSE2_K 1
+#define AVX2_K 2
+#define KERNELS 3
 
 typedef struct {
 	uint32_t type;
@@ -43,25 +93,66 @@ typedef struct {
 	char payload[MAX_PAYLOAD_SIZE];
 } message;
 
+/*
+	Incremental message reader.
+	Every fill does a single recv into whatever space is left in the buffer, after which all the complete
+	messages in it can be taken out one by one. A message that's only partially there stays in the buffer
+	(the parser remembers where it got to) until the following fills complete it, so it doesn't matter how
+	the stream was split up into segments or how many messages arrive at once.
+*/
+
+/* Reader states */
+#define PREFIX_R 0
+#define PAYLOAD_R 1
+
+typedef struct {
+	int state;
+	int start;
+	int end;
+	int drained;
+	int version;
+	int pendingVersion;
+	int prefixLength;
+	uint32_t payloadLength;
+	char buffer[READ_BUFFER_SIZE];
+} messageReader;
+
 /* serialization */
 char *serialize_uint32_t(char *buffer, uint32_t val);
 char *serialize_struct_message(char *buffer, message *msg);
 uint32_t deserialize_uint32_t(char *buffer);
 message deserialize_struct_message(char *buffer);
+int serialize_varint(char *buffer, uint32_t val);
+int deserialize_varint(char *buffer, int available, uint32_t *val);
+message deserialize_compact_message(char *buffer);
+message decodeMessage(char *buffer, int version);
 int sanitize(message *msg);
+int sanitizeScalar(message *msg);
+int sanitizeWith(message *msg, int kernel);
+int bestSanitizeKernel(void);
 
 /* communication */
 int receiveByteStream(int socketFD, char *buffer, int length);
 int receiveMessageStream(int socketFD, char *buffer);
 int sendByteStream(int socketFD, char *buffer, int length);
-int sendMessageStream(int socketFD, uint32_t type, char *name, char *payload);
+int sendVectorStream(int socketFD, struct iovec *vector, int count);
+int encodeMessagePrefix(char *buffer, uint32_t type, char *name, uint32_t payloadLength);
+int encodeCompactPrefix(char *buffer, uint32_t type, char *name, uint32_t payloadLength);
+int encodePrefix(char *buffer, int version, uint32_t type, char *name, uint32_t payloadLength);
+int encodeMessageStream(char *buffer, int version, uint32_t type, char *name, char *payload);
+int sendMessageStream(int socketFD, int version, uint32_t type, char *name, char *payload);
 int readArgs(char *str, ...);
+void initMessageReader(messageReader *reader);
+int fillMessageReader(messageReader *reader, int socketFD);
+int feedMessageReader(messageReader *reader, char *data, int length);
+int nextMessage(messageReader *reader, char **messageStart);
+void upgradeMessageReader(messageReader *reader, int version);
 
 /* sockets */
 int setSocketNonBlocking(int socketFD);
 int createListeners(int **listeners, char *portStr);
-int acceptConnection(int listeningSocketFD);
+int acceptConnection(int listeningSocketFD, struct sockaddr_storage *address, socklen_t *addressLength);
 int connectToServer(char *addressStr, char *portStr);
-int printPeerInfo(int socketFD);
+int describeAddress(struct sockaddr *address, socklen_t addressLength, char *host, char *peer);
 
 #endif
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "spscqueue.h"
+
+/* The capacity has to be a power of two, returns -1 if it isn't or the slots couldn't be allocated */
+int initSpscQueue(spscQueue *queue, size_t capacity, size_t slotSize) {
+	if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+		return -1;
+	queue->slots = malloc(capacity * slotSize);
+	if(queue->slots == NULL)
+		return -1;
+	queue->slotSize = slotSize;
+	queue->mask = capacity - 1;
+	atomic_store_explicit(&queue->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->tail, 0, memory_order_relaxed);
+	queue->cachedTail = 0;
+	queue->cachedHead = 0;
+	return 0;
+}
+
+void freeSpscQueue(spscQueue *queue) {
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+/* Producer only - returns the slot to fill in, or NULL if the ring is full */
+void *reserveSpscQueue(spscQueue *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if(head - queue->cachedTail > queue->mask)
+	{
+		queue->cachedTail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+		if(head - queue->cachedTail > queue->mask)
+			return NULL;
+	}
+	return queue->slots + (head & queue->mask) * queue->slotSize;
+}
+
+/* Producer only - hands the slot that was reserved last over to the consumer */
+void publishSpscQueue(spscQueue *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+/* Consumer only - returns the oldest published slot, or NULL if the ring is empty */
+void *peekSpscQueue(spscQueue *queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if(tail == queue->cachedHead)
+	{
+		queue->cachedHead = atomic_load_explicit(&queue->head, memory_order_acquire);
+		if(tail == queue->cachedHead)
+			return NULL;
+	}
+	return queue->slots + (tail & queue->mask) * queue->slotSize;
+}
+
+/* Consumer only - gives the slot from the last peek back to the producer */
+void releaseSpscQueue(spscQueue *queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,39 @@
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+	Bounded lock-free single-producer single-consumer ring of fixed size slots.
+	The producer reserves the next free slot, fills it in place and publishes it, the consumer peeks at
+	the oldest published slot and releases it once it's done with it - nothing gets copied in or out, and
+	neither side ever takes a lock. Each side keeps its own index on its own cache line, along with a
+	cached copy of the other side's, so it only has to look at the other side's line when the ring seems
+	to be full (or empty).
+
+	Only one thread may ever produce and only one may consume.
+*/
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+	char *slots;
+	size_t slotSize;
+	size_t mask;
+	/* Producer's line */
+	_Alignas(SPSC_CACHE_LINE) atomic_size_t head;
+	size_t cachedTail;
+	/* Consumer's line */
+	_Alignas(SPSC_CACHE_LINE) atomic_size_t tail;
+	size_t cachedHead;
+} spscQueue;
+
+int initSpscQueue(spscQueue *queue, size_t capacity, size_t slotSize);
+void freeSpscQueue(spscQueue *queue);
+void *reserveSpscQueue(spscQueue *queue);
+void publishSpscQueue(spscQueue *queue);
+void *peekSpscQueue(spscQueue *queue);
+void releaseSpscQueue(spscQueue *queue);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+int initUring(uring *ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(struct io_uring_params));
+	/* A broadcast can complete a send for every client at once, so the completion ring gets some headroom */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 4 * entries;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd == -1)
+		return -1;
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ringsSize = (sqSize > cqSize) ? sqSize : cqSize;
+	ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->rings == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+	{
+		munmap(ring->rings, ring->ringsSize);
+		close(ring->fd);
+		return -1;
+	}
+
+	char *rings = ring->rings;
+	ring->sqHead = (unsigned *)(rings + params.sq_off.head);
+	ring->sqTail = (unsigned *)(rings + params.sq_off.tail);
+	ring->sqMask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring->sqEntries = *(unsigned *)(rings + params.sq_off.ring_entries);
+	ring->sqLocalTail = *ring->sqTail;
+	ring->cqHead = (unsigned *)(rings + params.cq_off.head);
+	ring->cqTail = (unsigned *)(rings + params.cq_off.tail);
+	ring->cqMask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	/* Entries are always submitted in the order they're handed out, so the indirection array is the identity */
+	unsigned *sqArray = (unsigned *)(rings + params.sq_off.array);
+	for(unsigned i = 0; i < ring->sqEntries; i++)
+		sqArray[i] = i;
+	return 0;
+}
+
+void freeUring(uring *ring) {
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->rings, ring->ringsSize);
+	close(ring->fd);
+}
+
+/* Returns a zeroed entry, submitting whatever's pending first if the ring is full */
+struct io_uring_sqe *nextUringEntry(uring *ring) {
+	if(ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+	{
+		if(submitUring(ring, 0) == -1)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqLocalTail++;
+	return sqe;
+}
+
+/* Submits every entry handed out so far and waits until there's at least waitFor completions */
+int submitUring(uring *ring, unsigned waitFor) {
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+	unsigned toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	if(toSubmit == 0 && waitFor == 0)
+		return 0;
+	return syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor, (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_cqe *peekUringCompletion(uring *ring) {
+	unsigned head = *ring->cqHead;
+	if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cqMask];
+}
+
+/* Hands the peeked completion's slot back to the kernel, so it has to be copied out before this */
+void advanceUringCompletions(uring *ring) {
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/* The number of entries has to be a power of two */
+int initUringBuffers(uring *ring, uringBuffers *buffers, int group, unsigned entries, int bufferSize) {
+	buffers->entries = entries;
+	buffers->bufferSize = bufferSize;
+	buffers->group = group;
+	buffers->memory = malloc((size_t)entries * bufferSize);
+	if(buffers->memory == NULL)
+		return -1;
+	buffers->ring = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buffers->ring == MAP_FAILED)
+	{
+		free(buffers->memory);
+		return -1;
+	}
+
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(struct io_uring_buf_reg));
+	registration.ring_addr = (uintptr_t)buffers->ring;
+	registration.ring_entries = entries;
+	registration.bgid = group;
+	if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1)
+	{
+		freeUringBuffers(buffers);
+		return -1;
+	}
+	for(unsigned i = 0; i < entries; i++)
+		recycleUringBuffer(buffers, i);
+	return 0;
+}
+
+/* Unregistering happens along with the ring itself */
+void freeUringBuffers(uringBuffers *buffers) {
+	munmap(buffers->ring, buffers->entries * sizeof(struct io_uring_buf));
+	free(buffers->memory);
+}
+
+void recycleUringBuffer(uringBuffers *buffers, int bufferId) {
+	/* The tail shares its place with the first buffer's reserved field, so the entries are filled in field by field */
+	unsigned short tail = buffers->ring->tail;
+	struct io_uring_buf *buffer = &buffers->ring->bufs[tail & (buffers->entries - 1)];
+	buffer->addr = (uintptr_t)uringBuffer(buffers, bufferId);
+	buffer->len = buffers->bufferSize;
+	buffer->bid = bufferId;
+	__atomic_store_n(&buffers->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void prepareUringAccept(struct io_uring_sqe *sqe, int listenerFD, uint64_t data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenerFD;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = data;
+}
+
+void prepareUringPoll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t data) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->poll32_events = events;
+	sqe->user_data = data;
+}
+
+void prepareUringRecv(struct io_uring_sqe *sqe, int socketFD, uringBuffers *buffers, uint64_t data) {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = socketFD;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buffers->group;
+	sqe->user_data = data;
+}
+
+void prepareUringSendmsg(struct io_uring_sqe *sqe, int socketFD, struct msghdr *header, unsigned flags, uint64_t data) {
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = socketFD;
+	sqe->addr = (uintptr_t)header;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+}
@@ -0,0 +1,64 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+	Minimal io_uring wrapper on top of the raw system calls.
+	Submission entries are handed out in order and only published to the kernel on submit, so a whole
+	loop iteration's worth of work goes in with a single io_uring_enter. Completions are read straight
+	out of the shared completion ring.
+
+	Provided buffers are a ring of equally sized buffers registered with the kernel, which picks one
+	whenever a recv that selects from the group has data. The buffer ID comes back in the completion
+	flags, and the buffer has to be recycled once its contents have been used up.
+*/
+
+typedef struct {
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned sqLocalTail;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t ringsSize;
+	size_t sqesSize;
+} uring;
+
+typedef struct {
+	struct io_uring_buf_ring *ring;
+	char *memory;
+	unsigned entries;
+	int bufferSize;
+	int group;
+} uringBuffers;
+
+#define uringBuffer(buffers, bufferId) ((buffers)->memory + (size_t)(bufferId) * (buffers)->bufferSize)
+
+int initUring(uring *ring, unsigned entries);
+void freeUring(uring *ring);
+struct io_uring_sqe *nextUringEntry(uring *ring);
+int submitUring(uring *ring, unsigned waitFor);
+struct io_uring_cqe *peekUringCompletion(uring *ring);
+void advanceUringCompletions(uring *ring);
+
+int initUringBuffers(uring *ring, uringBuffers *buffers, int group, unsigned entries, int bufferSize);
+void freeUringBuffers(uringBuffers *buffers);
+void recycleUringBuffer(uringBuffers *buffers, int bufferId);
+
+/* multishot operations keep posting completions (flagged with IORING_CQE_F_MORE) until they stop */
+void prepareUringAccept(struct io_uring_sqe *sqe, int listenerFD, uint64_t data);
+void prepareUringPoll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t data);
+void prepareUringRecv(struct io_uring_sqe *sqe, int socketFD, uringBuffers *buffers, uint64_t data);
+void prepareUringSendmsg(struct io_uring_sqe *sqe, int socketFD, struct msghdr *header, unsigned flags, uint64_t data);
+
+#endif